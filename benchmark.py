@@ -3,30 +3,32 @@
 from subprocess import *
 import os
 import sys
-import time
-import csv
-
-def bench(benchPath):
-
-    startTime = time.time()
-
-    benchCmd = './zeta %s' % benchPath
+import json
+
+# File in which baseline results are stored
+BASELINE_PATH = 'benchmarks/baseline.json'
+
+def bench(benchPath, numIters, numWarmup, perfCounters):
+
+    # The package is loaded once and run repeatedly in-process,
+    # the last line of output is a JSON report of the timings
+    benchCmd = './zeta --bench %s --iters %d --warmup %d' % (
+        benchPath,
+        numIters,
+        numWarmup
+    )
+    if perfCounters:
+        benchCmd += ' --perf-counters'
     pipe = Popen(benchCmd, shell=True, stdout=PIPE, stderr=PIPE)
-
-    # Wait until the benchmark terminates
-    pipe.wait()
-
-    endTime = time.time()
+    out, err = pipe.communicate()
 
     # Verify the return code
     ret = pipe.returncode
     if ret != 0:
         raise Exception('invalid return code: ' + str(ret))
 
-    # Compute the time in milliseconds
-    deltaTime = 1000 * (endTime - startTime)
-
-    return deltaTime
+    lines = out.decode('utf-8').strip().split('\n')
+    return json.loads(lines[-1])
 
 # Computes the geometric mean of a list of values
 def geoMean(numList):
@@ -40,38 +42,135 @@ def geoMean(numList):
 
     return prod ** (1.0/len(numList))
 
-def runBenchs():
+# Format a hardware counter value averaged per iteration
+def perIter(result, name, scale):
+    if 'perf' not in result or result['perf']['iters'][name] is None:
+        return '%10s' % 'n/a'
+    val = result['perf']['iters'][name] / result['iters']
+    return '%10.1f' % (val / scale)
+
+def runBenchs(numIters, numWarmup, saveBaseline, perfCounters):
 
     benchList = [
+        'benchmarks/binary_trees.pls',
+        'benchmarks/deltablue.pls',
+        'benchmarks/fannkuch.pls',
+        'benchmarks/hashmap.pls',
         'benchmarks/img_fill.pls',
         'benchmarks/incr_field_1m.pls',
         'benchmarks/fcalls_10m.zim',
         'benchmarks/fib29.pls',
         #'benchmarks/fib36.zim',
         'benchmarks/loop_cnt_100m.zim',
+        'benchmarks/nbody.pls',
         'benchmarks/plush_parser.zim',
+        'benchmarks/richards.pls',
         'benchmarks/saw_wave.pls',
         'benchmarks/sine_wave.pls',
+        'benchmarks/spectral_norm.pls',
+        'benchmarks/tokenizer.pls',
     ]
 
+    baseline = {}
+    if os.path.exists(BASELINE_PATH) and not saveBaseline:
+        with open(BASELINE_PATH) as f:
+            baseline = json.load(f)
+
+    sys.stdout.write('benchmark'.ljust(35))
+    sys.stdout.write('parse ms'.rjust(10))
+    sys.stdout.write('init ms'.rjust(10))
+    sys.stdout.write('first ms'.rjust(10))
+    sys.stdout.write('median ms'.rjust(10))
+    sys.stdout.write('p99 ms'.rjust(10))
+    if baseline:
+        sys.stdout.write('vs base'.rjust(10))
+    if perfCounters:
+        sys.stdout.write('M instrs'.rjust(10))
+        sys.stdout.write('M cycles'.rjust(10))
+        sys.stdout.write('K br-miss'.rjust(10))
+        sys.stdout.write('K L1-miss'.rjust(10))
+    sys.stdout.write('\n')
+
+    results = {}
     timeVals = []
+    ratios = []
 
     for benchPath in benchList:
 
         sys.stdout.write(benchPath.ljust(35))
         sys.stdout.flush()
 
-        timeMs = bench(benchPath)
-        timeVals += [timeMs]
+        result = bench(benchPath, numIters, numWarmup, perfCounters)
+        results[benchPath] = result
+
+        medianMs = result['iter_ms']['median']
+        timeVals += [medianMs]
+
+        sys.stdout.write('%10.1f' % result['parse_ms'])
+        sys.stdout.write('%10.1f' % result['init_ms'])
+        sys.stdout.write('%10.1f' % result['first_call_ms'])
+        sys.stdout.write('%10.1f' % medianMs)
+        sys.stdout.write('%10.1f' % result['iter_ms']['p99'])
+
+        if benchPath in baseline:
+            ratio = medianMs / baseline[benchPath]['iter_ms']['median']
+            ratios += [ratio]
+            sys.stdout.write('%9.3fx' % ratio)
+        elif baseline:
+            sys.stdout.write(10 * ' ')
+
+        # Counter values are per timed iteration
+        if perfCounters:
+            sys.stdout.write(perIter(result, 'instructions', 1e6))
+            sys.stdout.write(perIter(result, 'cycles', 1e6))
+            sys.stdout.write(perIter(result, 'branch_misses', 1e3))
+            sys.stdout.write(perIter(result, 'l1d_misses', 1e3))
 
-        sys.stdout.write('%6d ms\n' % timeMs)
+        sys.stdout.write('\n')
 
-    meanTime = geoMean(timeVals)
-    sys.stdout.write(44 * '-' + '\n')
+    lineLen = 35 + 50 + (10 if baseline else 0) + (40 if perfCounters else 0)
+    sys.stdout.write(lineLen * '-' + '\n')
     sys.stdout.write('geometric mean'.ljust(35))
-    sys.stdout.write('%6d ms\n' % meanTime)
+    sys.stdout.write(30 * ' ')
+    sys.stdout.write('%10.1f' % geoMean(timeVals))
+    if ratios:
+        sys.stdout.write(10 * ' ')
+        sys.stdout.write('%9.3fx' % geoMean(ratios))
+    sys.stdout.write('\n')
+
+    if saveBaseline:
+        with open(BASELINE_PATH, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+        sys.stdout.write('baseline saved to %s\n' % BASELINE_PATH)
+
+def main():
+
+    numIters = 5
+    numWarmup = 1
+    saveBaseline = False
+    perfCounters = False
+
+    args = sys.argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == '--iters':
+            numIters = int(args.pop(0))
+        elif arg == '--warmup':
+            numWarmup = int(args.pop(0))
+        elif arg == '--save-baseline':
+            saveBaseline = True
+        elif arg == '--perf-counters':
+            perfCounters = True
+        else:
+            sys.stdout.write(
+                'usage: benchmark.py [--iters N] [--warmup M] [--save-baseline] '
+                '[--perf-counters]\n'
+            )
+            sys.exit(1)
+
+    runBenchs(numIters, numWarmup, saveBaseline, perfCounters)
 
 # TODO: trigger make, NDEBUG?
 
 # Run the benchmarks
-runBenchs()
+main()
@@ -80,6 +80,9 @@ private:
 
 public:
 
+    /// Function name, empty if anonymous
+    std::string name;
+
     Function(
         size_t numParams,
         Block* entryBlock
@@ -124,6 +127,8 @@ public:
         out += "  entry:@" + entryBlock->getHandle() + ",\n";
         out += "  num_params:" + std::to_string(numParams) + ",\n";
         out += "  num_locals:" + std::to_string(numLocals) + ",\n";
+        if (name != "")
+            out += "  name:'" + name + "',\n";
         out += "};\n\n";
 
         entryBlock = nullptr;
@@ -345,6 +350,18 @@ void genLogicalOr(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 void genObjExpr(CodeGenCtx& ctx, ASTExpr* protoExpr, ObjectExpr* objExpr);
 void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 
+/**
+Name an anonymous function expression after the variable or field
+it gets assigned to, so that profiles and errors can refer to it
+*/
+void nameFunExpr(ASTExpr* expr, std::string name)
+{
+    auto funExpr = dynamic_cast<FunExpr*>(expr);
+
+    if (funExpr && funExpr->name == "")
+        funExpr->name = name;
+}
+
 /**
 Generate code for a code unit
 */
@@ -355,6 +372,7 @@ std::string genUnit(FunExpr* unitAST)
     Block* entryBlock = new Block();
 
     Function* unitFun = new Function(0, entryBlock);
+    unitFun->name = "init";
 
     // Register the variable declarations
     registerDecls(unitFun, unitAST->body, true);
@@ -390,13 +408,19 @@ std::string genUnit(FunExpr* unitAST)
     return out;
 }
 
-void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
+void runtimeCall(
+    CodeGenCtx& ctx,
+    std::string funName,
+    size_t numArgs,
+    Block* contBlock = nullptr
+)
 {
     ctx.addStr("op:'push', val:@global_obj");
     ctx.addStr("op:'push', val:'rt_" + funName + "'");
     ctx.addOp("get_field");
 
-    auto contBlock = new Block();
+    if (!contBlock)
+        contBlock = new Block();
     ctx.addBranch(
         "call",
         "ret_to",
@@ -408,6 +432,66 @@ void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
     ctx.merge(contBlock);
 }
 
+void genExpr(CodeGenCtx& ctx, ASTExpr* expr);
+
+/**
+Generate a binary operation with an inline fast path for int32 operands.
+The fast path instructions are executed when both operands are int32,
+and must produce the same result as the runtime function, which is only
+called on the slow path. Integer literal operands are not type checked.
+*/
+void genInt32BinOp(
+    CodeGenCtx& ctx,
+    ASTExpr* lhsExpr,
+    ASTExpr* rhsExpr,
+    std::vector<std::string> fastInstrs,
+    std::string rtFunName
+)
+{
+    genExpr(ctx, lhsExpr);
+    genExpr(ctx, rhsExpr);
+
+    bool checkLhs = !dynamic_cast<IntExpr*>(lhsExpr);
+    bool checkRhs = !dynamic_cast<IntExpr*>(rhsExpr);
+
+    // Both operands are constants, no type tests needed
+    if (!checkLhs && !checkRhs)
+    {
+        for (auto& instr : fastInstrs)
+            ctx.addStr(instr);
+        return;
+    }
+
+    auto fastBlock = new Block();
+    auto slowBlock = new Block();
+    auto contBlock = new Block();
+
+    if (checkLhs)
+    {
+        auto nextBlock = checkRhs? new Block():fastBlock;
+        ctx.addStr("op:'dup', idx:1");
+        ctx.addStr("op:'has_tag', tag:'int32'");
+        ctx.addBranch("if_true", "then", nextBlock, "else", slowBlock);
+        ctx.merge(nextBlock);
+    }
+
+    if (checkRhs)
+    {
+        ctx.addStr("op:'dup', idx:0");
+        ctx.addStr("op:'has_tag', tag:'int32'");
+        ctx.addBranch("if_true", "then", fastBlock, "else", slowBlock);
+        ctx.merge(fastBlock);
+    }
+
+    for (auto& instr : fastInstrs)
+        ctx.addStr(instr);
+    ctx.addBranch("jump", "to", contBlock);
+
+    // The runtime call returns directly to the continuation block
+    ctx.merge(slowBlock);
+    runtimeCall(ctx, rtFunName, 2, contBlock);
+}
+
 void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 {
     if (auto intExpr = dynamic_cast<IntExpr*>(expr))
@@ -507,9 +591,8 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         if (unOp->op == &OP_NEG)
         {
             // Generate 0 - x
-            ctx.addPush("0");
-            genExpr(ctx, unOp->expr);
-            runtimeCall(ctx, "sub", 2);
+            IntExpr zeroExpr(0);
+            genInt32BinOp(ctx, &zeroExpr, unOp->expr, { "op:'sub_i32'" }, "sub");
             return;
         }
 
@@ -553,50 +636,74 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
             }
 
             // Equality comparison
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "eq", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'eq_i32'" },
+                "eq"
+            );
             return;
         }
 
         // Inequality comparison
         if (binOp->op == &OP_NE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "ne", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'eq_i32'", "op:'push', val:$false", "op:'eq_bool'" },
+                "ne"
+            );
             return;
         }
 
         if (binOp->op == &OP_LT)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "lt", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'lt_i32'" },
+                "lt"
+            );
             return;
         }
 
         if (binOp->op == &OP_LE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "le", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'le_i32'" },
+                "le"
+            );
             return;
         }
 
         if (binOp->op == &OP_GT)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "gt", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'gt_i32'" },
+                "gt"
+            );
             return;
         }
 
         if (binOp->op == &OP_GE)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "ge", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'ge_i32'" },
+                "ge"
+            );
             return;
         }
 
@@ -618,41 +725,68 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 
         if (binOp->op == &OP_ADD)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "add", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'add_i32'" },
+                "add"
+            );
             return;
         }
 
         if (binOp->op == &OP_SUB)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "sub", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'sub_i32'" },
+                "sub"
+            );
             return;
         }
 
         if (binOp->op == &OP_MUL)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "mul", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'mul_i32'" },
+                "mul"
+            );
             return;
         }
 
         if (binOp->op == &OP_DIV)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "div", 2);
+            // Division of integers produces a float32
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                {
+                    "op:'i32_to_f32'",
+                    "op:'swap'",
+                    "op:'i32_to_f32'",
+                    "op:'swap'",
+                    "op:'div_f32'"
+                },
+                "div"
+            );
             return;
         }
 
         if (binOp->op == &OP_MOD)
         {
-            genExpr(ctx, binOp->lhsExpr);
-            genExpr(ctx, binOp->rhsExpr);
-            runtimeCall(ctx, "mod", 2);
+            genInt32BinOp(
+                ctx,
+                binOp->lhsExpr,
+                binOp->rhsExpr,
+                { "op:'mod_i32'" },
+                "mod"
+            );
             return;
         }
 
@@ -730,6 +864,7 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
             funExpr->params.size(),
             entryBlock
         );
+        fun->name = funExpr->name;
 
         // Register the parameter variables
         for (auto paramName : funExpr->params)
@@ -863,6 +998,8 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
 
     if (auto varStmt = dynamic_cast<VarStmt*>(stmt))
     {
+        nameFunExpr(varStmt->initExpr, varStmt->identName);
+
         if (ctx.fun->hasLocal(varStmt->identName))
         {
             genExpr(ctx, varStmt->initExpr);
@@ -891,6 +1028,10 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
     {
         genExpr(ctx, throwStmt->expr);
         runtimeCall(ctx, "throw", 1);
+
+        // The throw call never returns, but its continuation block
+        // must still leave the stack balanced
+        ctx.addOp("pop");
         return;
     }
 
@@ -1138,6 +1279,8 @@ void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
             throw ParseError("cannot assign to exports variable");
         }
 
+        nameFunExpr(rhsExpr, identExpr->name);
+
         if (ctx.fun->hasLocal(identExpr->name))
         {
             auto localIdx = ctx.fun->getLocalIdx(identExpr->name);
@@ -1166,6 +1309,8 @@ void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
             auto identExpr = dynamic_cast<IdentExpr*>(binOp->rhsExpr);
             assert (identExpr);
 
+            nameFunExpr(rhsExpr, identExpr->name);
+
             // Evaluate the rhs value
             genExpr(ctx, rhsExpr);
 
@@ -1179,6 +1324,23 @@ void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
             return;
         }
 
+        // Assignment to an array element
+        if (binOp->op == &OP_INDEX)
+        {
+            // Evaluate the rhs value
+            genExpr(ctx, rhsExpr);
+
+            // Evaluate the base and the index
+            genExpr(ctx, binOp->lhsExpr);
+            genExpr(ctx, binOp->rhsExpr);
+
+            ctx.addStr("op:'dup', idx:2");
+            runtimeCall(ctx, "setElem", 3);
+            ctx.addOp("pop");
+
+            return;
+        }
+
         assert (false);
     }
 
@@ -1,10 +1,19 @@
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
-#include <regex>
 #include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "core.h"
 #include "parser.h"
+#include "image.h"
 #include "interp.h"
 
 #ifdef HAVE_SDL2
@@ -52,6 +61,10 @@ Value HostFn::call3(Value arg0, Value arg1, Value arg2)
     return f3(arg0, arg1, arg2);
 }
 
+/// Host functions, by name
+/// Note: host function names must be unique across core packages
+std::unordered_map<std::string, HostFn*> hostFns;
+
 void setHostFn(
     Object pkgObj,
     std::string name,
@@ -59,7 +72,14 @@ void setHostFn(
     void* fptr
 )
 {
-    auto fnObj = new HostFn(name, numParams, fptr);
+    // Core packages may be instantiated more than once,
+    // but each host function has a single HostFn object
+    auto& fnObj = hostFns[name];
+
+    if (!fnObj)
+        fnObj = new HostFn(name, numParams, fptr);
+
+    assert (fnObj->getNumParams() == numParams);
 
     auto fnVal = Value((refptr)fnObj, TAG_HOSTFN);
 
@@ -389,14 +409,299 @@ Value get_core_audio_pkg()
 #endif
 }
 
+//============================================================================
+// core/vm package
+//============================================================================
+
+Value heap_snapshot(Value fileName)
+{
+    assert (fileName.isString());
+    writeHeapSnapshot((std::string)fileName);
+    return Value::UNDEF;
+}
+
+Value get_core_vm_pkg()
+{
+    auto exports = Object::newObject(32);
+    setHostFn(exports, "heap_snapshot", 1, (void*)heap_snapshot);
+    return exports;
+}
+
 //============================================================================
 
 // Cache of loaded packages
 std::unordered_map<std::string, Value> pkgCache;
 
+// Parse image files lazily
+bool lazyLoad = false;
+
+// Cache language package parse results on disk
+bool parseCache = true;
+
+// Global definitions of language packages, by package file path. Cached
+// parse results refer to the nodes of their language package by name.
+std::unordered_map<std::string, ImageDefs> langPkgDefs;
+
+// Forward declarations
+void buildPkgIndex();
+std::string findPkgPath(std::string pkgName);
+
+// Packages parsed ahead of time by the parallel loader, by name
+std::unordered_map<std::string, Value> preloadedPkgs;
+
+/**
+Parse the packages statically imported by an image, along with the
+packages they import, on a pool of worker threads. The parsed packages
+are only initialized when the running program imports them, so the
+order in which init functions run is unchanged.
+
+Only plain image files are preloaded. Packages written in other
+languages need their language package to run, and are loaded as usual.
+Parse errors are also left to be reported when the package is imported.
+*/
+void preloadPkgs(
+    const std::vector<std::string>& imports,
+    size_t numThreads
+)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    // Packages waiting to be parsed, and already queued
+    std::vector<std::string> queue;
+    std::unordered_set<std::string> queued;
+
+    // Number of packages being parsed
+    size_t numActive = 0;
+
+    auto enqueue = [&](const std::vector<std::string>& pkgNames)
+    {
+        for (auto& pkgName : pkgNames)
+        {
+            if (pkgCache.find(pkgName) != pkgCache.end() ||
+                preloadedPkgs.find(pkgName) != preloadedPkgs.end() ||
+                !queued.insert(pkgName).second)
+                continue;
+
+            queue.push_back(pkgName);
+        }
+    };
+
+    enqueue(imports);
+
+    if (queue.empty())
+        return;
+
+    // The package index is built before the workers can look it up
+    buildPkgIndex();
+
+    auto worker = [&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;)
+        {
+            cond.wait(lock, [&]() { return !queue.empty() || numActive == 0; });
+
+            if (queue.empty())
+                break;
+
+            auto pkgName = queue.back();
+            queue.pop_back();
+            numActive++;
+
+            lock.unlock();
+
+            Value pkg;
+            std::vector<std::string> pkgImports;
+
+            try
+            {
+                auto pkgPath = findPkgPath(pkgName);
+
+                if (pkgPath != "" && !isBinImage(pkgPath))
+                {
+                    Input input(pkgPath);
+
+                    if (parseLang(input) == "")
+                        pkg = parseInput(input, pkgImports);
+                }
+            }
+
+            catch (RunError& e)
+            {
+                pkg = Value::UNDEF;
+            }
+
+            lock.lock();
+
+            if (pkg.isObject())
+            {
+                preloadedPkgs[pkgName] = pkg;
+                enqueue(pkgImports);
+            }
+
+            numActive--;
+            cond.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; ++i)
+        threads.push_back(std::thread(worker));
+
+    for (auto& thread : threads)
+        thread.join();
+}
+
+/// FNV-1a hash of a byte string
+uint64_t hashBytes(
+    const char* data,
+    size_t len,
+    uint64_t hash = 14695981039346656037ULL
+)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+uint64_t hashBytes(std::string str, uint64_t hash)
+{
+    // Include the terminating null so that fields can't run together
+    return hashBytes(str.c_str(), str.length() + 1, hash);
+}
+
+/**
+Get the directory where parse results are cached, creating it if
+needed. The cache is opt-in: it is only used when ZETA_PARSE_CACHE_DIR
+is set, since entries are never evicted. Returns an empty string if
+no directory is usable.
+*/
+std::string getParseCacheDir()
+{
+    static bool initialized = false;
+    static std::string cacheDir;
+
+    if (initialized)
+        return cacheDir;
+    initialized = true;
+
+    auto envDir = getenv("ZETA_PARSE_CACHE_DIR");
+    if (!envDir || std::string(envDir) == "")
+        return cacheDir;
+
+    if (mkdir(envDir, 0755) != 0 && errno != EEXIST)
+        return cacheDir;
+
+    cacheDir = envDir;
+    return cacheDir;
+}
+
+/**
+Get the path of the cached parse result for a source file
+
+The cache is content-addressed. Entries are keyed on the source name
+and text, on the identity of the language package (its name, and the
+size and modification time of its package file) and on the binary image
+format version. Editing a source file or updating the language package
+changes the key, so stale entries are never read, only left behind.
+*/
+std::string getParseCachePath(Input& input, std::string langPkgName)
+{
+    auto cacheDir = getParseCacheDir();
+    if (cacheDir == "")
+        return "";
+
+    auto hash = hashBytes(input.getDataPtr(), input.getDataLen());
+    hash = hashBytes(input.getSrcName(), hash);
+    hash = hashBytes(langPkgName, hash);
+
+    struct stat st;
+    auto langPkgPath = findPkgPath(langPkgName);
+    if (langPkgPath != "" && stat(langPkgPath.c_str(), &st) == 0)
+    {
+        hash = hashBytes(std::to_string(st.st_size), hash);
+        hash = hashBytes(std::to_string(st.st_mtim.tv_sec), hash);
+        hash = hashBytes(std::to_string(st.st_mtim.tv_nsec), hash);
+    }
+
+    hash = hashBytes(std::to_string(BIN_IMAGE_VERSION), hash);
+
+    char hashStr[32];
+    sprintf(hashStr, "%016llx", (unsigned long long)hash);
+    return cacheDir + "/" + hashStr + ".zimb";
+}
+
+/// Write a parse result into the cache
+/// Nodes of the language package are written as references to its
+/// definitions, so that they are shared, not copied, when loading
+/// Failures are ignored, since caching is only an optimization
+void writeParseCache(
+    Value exportVal,
+    std::string cachePath,
+    const ImageDefs& langDefs
+)
+{
+    // Write to a temporary file first, so that concurrent
+    // processes never observe a partially written entry
+    auto tmpPath = cachePath + "." + std::to_string(getpid()) + ".tmp";
+
+    try
+    {
+        writeBinImage(exportVal, tmpPath, &langDefs);
+
+        if (rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+            remove(tmpPath.c_str());
+    }
+
+    catch (RunError& e)
+    {
+        remove(tmpPath.c_str());
+    }
+}
+
 /// Load a package based on its path
 Object load(std::string pkgPath)
 {
+    // Binary images are loaded directly, without parsing
+    if (isBinImage(pkgPath))
+    {
+        auto exportVal = readBinImage(pkgPath);
+
+        if (!exportVal.isObject())
+        {
+            throw RunError("exports value is not an object");
+        }
+
+        return Object(exportVal);
+    }
+
+    // Lazily loaded images keep a view of the mapped file data
+    if (lazyLoad)
+    {
+        size_t dataLen;
+        auto data = mapFile(pkgPath, dataLen);
+        Input input(data, dataLen, pkgPath);
+
+        // Files written in other languages are parsed as usual
+        if (parseLang(input) == "")
+        {
+            auto exportVal = parseInputLazy(input);
+
+            if (!exportVal.isObject())
+            {
+                throw RunError("exports value is not an object");
+            }
+
+            return Object(exportVal);
+        }
+    }
+
     Input input(pkgPath);
 
     Value exportVal;
@@ -407,6 +712,14 @@ Object load(std::string pkgPath)
     // If a language package is specified
     if (langPkgName != "")
     {
+        auto cachePath = parseCache? getParseCachePath(input, langPkgName):"";
+
+        // Keep the definitions of the language package when it is
+        // loaded, so that cached results can refer to them
+        auto langPkgPath = findPkgPath(langPkgName);
+        if (cachePath != "" && langPkgPath != "")
+            langPkgDefs[langPkgPath];
+
         //std::cout << "Loading language package" << std::endl;
 
         auto langPkgVal = import(langPkgName);
@@ -425,10 +738,36 @@ Object load(std::string pkgPath)
             );
         }
 
+        // Language packages loaded lazily or from binary images
+        // have no definition names, and their results are not cached
+        auto defsItr = langPkgDefs.find(langPkgPath);
+        if (defsItr == langPkgDefs.end() || defsItr->second.empty())
+            cachePath = "";
+
+        // Look for a cached parse result
+        if (cachePath != "" && fileExists(cachePath))
+        {
+            try
+            {
+                auto cachedVal = readBinImage(cachePath, &defsItr->second);
+                if (cachedVal.isObject())
+                    return Object(cachedVal);
+            }
+
+            // Corrupted cache entries are discarded
+            catch (RunError& e)
+            {
+                remove(cachePath.c_str());
+            }
+        }
+
         // Create an object to pass the input data
         auto inputObj = Object::newObject();
         inputObj.setField("src_name", String(input.getSrcName()));
-        inputObj.setField("src_string", String(input.getInputStr()));
+        inputObj.setField(
+            "src_string",
+            String(input.getDataPtr(), input.getDataLen())
+        );
         inputObj.setField("str_idx", Value::int32(input.getInputIdx()));
         inputObj.setField("line_no", Value::int32(input.getLineNo()));
         inputObj.setField("col_no", Value::int32(input.getColNo()));
@@ -441,11 +780,30 @@ Object load(std::string pkgPath)
         exportVal = callExportFn(langPkg, "parse_input", args);
 
         //std::cout << "Returned from parse_input" << std::endl;
+
+        if (cachePath != "" && exportVal.isObject())
+        {
+            writeParseCache(exportVal, cachePath, defsItr->second);
+        }
     }
     else
     {
         // Parse the package file contents
-        exportVal = parseInput(input);
+        std::vector<std::string> imports;
+        auto defsItr = langPkgDefs.find(pkgPath);
+        exportVal = parseInput(
+            input,
+            imports,
+            (defsItr != langPkgDefs.end())? &defsItr->second:nullptr
+        );
+
+        // Parse the packages this one imports ahead of time
+        // With a single core, this would gain nothing
+        auto numThreads = std::thread::hardware_concurrency();
+        if (exportVal.isObject() && numThreads > 1)
+        {
+            preloadPkgs(imports, numThreads);
+        }
     }
 
     if (!exportVal.isObject())
@@ -458,21 +816,124 @@ Object load(std::string pkgPath)
     return pkg;
 }
 
+/// Index of the package directory, package names to file paths
+std::unordered_map<std::string, std::string> pkgIndex;
+
+/// Add the packages found under a directory to the package index
+void indexPkgDir(std::string dirPath, std::string namePrefix)
+{
+    auto dir = opendir(dirPath.c_str());
+
+    if (!dir)
+        return;
+
+    while (auto entry = readdir(dir))
+    {
+        auto entryName = std::string(entry->d_name);
+
+        if (entryName == "." || entryName == "..")
+            continue;
+
+        auto entryPath = dirPath + entryName;
+
+        struct stat st;
+        if (stat(entryPath.c_str(), &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            indexPkgDir(entryPath + "/", namePrefix + entryName + "/");
+        }
+        else if (entryName == "package" && namePrefix != "")
+        {
+            // Strip the trailing slash to get the package name
+            auto pkgName = namePrefix.substr(0, namePrefix.length() - 1);
+            pkgIndex[pkgName] = entryPath;
+        }
+    }
+
+    closedir(dir);
+}
+
+/// Build the package directory index, if not already built
+/// Note: the package directory is indexed once, so packages
+/// added to it while running are not found
+void buildPkgIndex()
+{
+    static bool indexBuilt = false;
+
+    if (!indexBuilt)
+    {
+        indexPkgDir(PKGS_DIR, "");
+        indexBuilt = true;
+    }
+}
+
+/// Find the file path for a package name
+/// Note: this is safe to call concurrently once the index is built
 std::string findPkgPath(std::string pkgName)
 {
     // If the package name directly maps to a relative path
     if (fileExists(pkgName))
         return pkgName;
 
-    // Look in the package directory
-    auto pkgPath = PKGS_DIR + pkgName + "/package";
-    if (fileExists(pkgPath))
-        return pkgPath;
+    buildPkgIndex();
+
+    // Look in the package directory index
+    auto itr = pkgIndex.find(pkgName);
+    if (itr != pkgIndex.end())
+        return itr->second;
 
     // Not found
     return "";
 }
 
+/**
+Check that a package name is valid. Package names are made of
+lowercase alphanumeric parts separated by single forward slashes.
+The last part may contain one dot (a file extension), between two
+alphanumeric characters.
+*/
+bool isValidPkgName(const std::string& pkgName)
+{
+    // Index of the start of the last part
+    size_t partStart = 0;
+
+    // Index of the dot in the last part, if any
+    size_t dotIdx = std::string::npos;
+
+    for (size_t i = 0; i < pkgName.length(); ++i)
+    {
+        auto ch = pkgName[i];
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9'))
+            continue;
+
+        // Parts and extensions must be non-empty
+        if (i == partStart || i == dotIdx + 1)
+            return false;
+
+        if (ch == '/' && dotIdx == std::string::npos)
+        {
+            partStart = i + 1;
+            continue;
+        }
+
+        if (ch == '.' && dotIdx == std::string::npos)
+        {
+            dotIdx = i;
+            continue;
+        }
+
+        return false;
+    }
+
+    return (
+        pkgName.length() > partStart &&
+        pkgName.length() != dotIdx + 1
+    );
+}
+
 Value getCorePkg(std::string pkgName)
 {
     // Internal/core packages
@@ -482,6 +943,8 @@ Value getCorePkg(std::string pkgName)
         return get_core_window_pkg();
     if (pkgName == "core/audio")
         return get_core_audio_pkg();
+    if (pkgName == "core/vm")
+        return get_core_vm_pkg();
 
     return Value::UNDEF;
 }
@@ -489,14 +952,8 @@ Value getCorePkg(std::string pkgName)
 /// Import a package based on its name, and perform caching
 Value import(std::string pkgName)
 {
-    // Package names may only contain lowercase identifiers
-    // separated by single forward slashes
-    std::regex ex("([a-z0-9]+/)*[a-z0-9]+.?[a-z0-9]+");
-    if(!regex_match(pkgName, ex))
-    {
-        std::cout << "invalid package name: \"" << pkgName << "\"" << std::endl;
-        return Value::FALSE;
-    }
+    // Names of packages which could not be found
+    static std::unordered_set<std::string> missingPkgs;
 
     // If the package is already loaded
     auto itr = pkgCache.find(pkgName);
@@ -505,12 +962,28 @@ Value import(std::string pkgName)
         return itr->second;
     }
 
+    if (!isValidPkgName(pkgName))
+    {
+        std::cout << "invalid package name: \"" << pkgName << "\"" << std::endl;
+        return Value::FALSE;
+    }
+
+    // If this package was previously looked for and not found
+    if (missingPkgs.find(pkgName) != missingPkgs.end())
+    {
+        return Value::UNDEF;
+    }
+
     // If we can find a package file for this name
     auto pkgPath = findPkgPath(pkgName);
     if (pkgPath != "")
     {
-        // Load the package file
-        auto pkg = load(pkgPath);
+        // Use the preloaded package, if available
+        auto preItr = preloadedPkgs.find(pkgName);
+        auto pkg = (preItr != preloadedPkgs.end())? Object(preItr->second):load(pkgPath);
+
+        if (preItr != preloadedPkgs.end())
+            preloadedPkgs.erase(preItr);
 
         // Cache the package
         pkgCache[pkgName] = pkg;
@@ -533,5 +1006,123 @@ Value import(std::string pkgName)
     }
 
     // Package not found
+    missingPkgs.insert(pkgName);
     return Value::UNDEF;
 }
+
+HostFn* findHostFn(std::string name)
+{
+    // Instantiate the core packages so their host functions are known
+    if (hostFns.find(name) == hostFns.end())
+    {
+        getCorePkg("core/io");
+        getCorePkg("core/window");
+        getCorePkg("core/audio");
+        getCorePkg("core/vm");
+    }
+
+    auto itr = hostFns.find(name);
+    return (itr != hostFns.end())? itr->second:nullptr;
+}
+
+std::vector<std::pair<std::string, Value>> getLoadedPkgs()
+{
+    return std::vector<std::pair<std::string, Value>>(
+        pkgCache.begin(),
+        pkgCache.end()
+    );
+}
+
+void writeSnapshot(Object pkg, std::string fileName)
+{
+    // Package cache entries, as (name, package) pairs
+    auto pkgs = Array(2 * pkgCache.size());
+    for (auto& entry : pkgCache)
+    {
+        pkgs.push(String(entry.first));
+        pkgs.push(entry.second);
+    }
+
+    // Note: compiled code is not saved, it is recompiled lazily
+    auto snap = Object::newObject();
+    snap.setField("pkg", pkg);
+    snap.setField("pkgs", pkgs);
+
+    writeBinImage(snap, fileName);
+}
+
+Object readSnapshot(std::string fileName)
+{
+    auto snapVal = readBinImage(fileName);
+
+    if (!snapVal.isObject() ||
+        !Object(snapVal).hasField("pkg") ||
+        !Object(snapVal).hasField("pkgs"))
+    {
+        throw RunError("\"" + fileName + "\" is not a package snapshot");
+    }
+
+    auto snap = Object(snapVal);
+    auto pkg = snap.getField("pkg");
+    auto pkgs = snap.getField("pkgs");
+
+    if (!pkg.isObject() || !pkgs.isArray() || Array(pkgs).length() % 2 != 0)
+    {
+        throw RunError("invalid package snapshot \"" + fileName + "\"");
+    }
+
+    auto pkgArr = Array(pkgs);
+    for (size_t i = 0; i < pkgArr.length(); i += 2)
+    {
+        auto pkgName = pkgArr.getElem(i);
+
+        if (!pkgName.isString())
+        {
+            throw RunError("invalid package snapshot \"" + fileName + "\"");
+        }
+
+        pkgCache[(std::string)pkgName] = pkgArr.getElem(i + 1);
+    }
+
+    return Object(pkg);
+}
+
+void testCore()
+{
+    std::cout << "core package tests" << std::endl;
+
+    assert (isValidPkgName("core/io"));
+    assert (isValidPkgName("lang/plush/0"));
+    assert (isValidPkgName("tests/plush/module.pls"));
+    assert (isValidPkgName("a"));
+    assert (!isValidPkgName(""));
+    assert (!isValidPkgName("/core/io"));
+    assert (!isValidPkgName("core//io"));
+    assert (!isValidPkgName("core/io/"));
+    assert (!isValidPkgName("Core/io"));
+    assert (!isValidPkgName("core/../io"));
+    assert (!isValidPkgName("core.io/x"));
+    assert (!isValidPkgName("module."));
+    assert (!isValidPkgName("module.a.b"));
+    assert (!isValidPkgName("std/peval/0 "));
+
+    assert (findPkgPath("lang/plush/0") != "");
+    assert (findPkgPath("lang/plush") == "");
+    assert (import("core/io").isObject());
+    assert (import("core/io") == import("core/io"));
+    assert (import("not/a/package") == Value::UNDEF);
+    assert (import("not/a/package") == Value::UNDEF);
+
+    // Static imports are parsed ahead of time, transitively
+    std::vector<std::string> imports;
+    Input input("tests/vm/imports.zim");
+    parseLang(input);
+    parseInput(input, imports);
+    preloadPkgs(imports, 2);
+    assert (preloadedPkgs.count("tests/vm/importa.zim") == 1);
+    assert (preloadedPkgs.count("tests/vm/importb.zim") == 1);
+    assert (preloadedPkgs.count("tests/vm/closure.zim") == 1);
+    auto pkgA = preloadedPkgs["tests/vm/importa.zim"];
+    assert (import("tests/vm/importa.zim") == pkgA);
+    assert (preloadedPkgs.count("tests/vm/importa.zim") == 0);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <utility>
+#include <vector>
 #include "runtime.h"
 
 /**
@@ -29,10 +31,35 @@ public:
     Value call3(Value arg0, Value arg1, Value arg2);
 
     size_t getNumParams() const { return numParams; }
+
+    std::string getName() const { return name; }
 };
 
+/// Find a host function by name, or return null if not found
+HostFn* findHostFn(std::string name);
+
+/// Parse image files lazily, as definitions are referenced
+extern bool lazyLoad;
+
+/// Cache the results of language package parsers on disk, when
+/// ZETA_PARSE_CACHE_DIR is set
+extern bool parseCache;
+
 /// Load a package based on its path
 Object load(std::string pkgPath);
 
 /// Import a package based on its name, and perform caching
 Value import(std::string pkgName);
+
+/// Get the packages imported so far, by name
+std::vector<std::pair<std::string, Value>> getLoadedPkgs();
+
+/// Write a snapshot of an initialized package, along with
+/// the packages it imported
+void writeSnapshot(Object pkg, std::string fileName);
+
+/// Load a snapshot, restoring the package cache
+/// Returns the initialized package
+Object readSnapshot(std::string fileName);
+
+void testCore();
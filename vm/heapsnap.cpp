@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "runtime.h"
+#include "heapsnap.h"
+
+/// Heap block listed in a snapshot
+struct SnapNode
+{
+    char kind = 0;
+    size_t size = 0;
+    size_t site = 0;
+
+    /// Length of strings and arrays, number of fields of objects
+    size_t len = 0;
+
+    /// Outgoing references, as node indices
+    std::vector<size_t> refs;
+
+    /// Object field name strings, as node indices
+    std::vector<size_t> names;
+
+    /// Contents hash and leading text of strings
+    std::string hash;
+    std::string text;
+
+    /// Immediate dominator and retained size
+    size_t idom = SIZE_MAX;
+    size_t retained = 0;
+};
+
+/// Decode a text field escaped with "%XX" sequences
+static std::string unescape(const std::string& str)
+{
+    std::string out;
+
+    for (size_t i = 0; i < str.length(); ++i)
+    {
+        if (str[i] == '%' && i + 2 < str.length())
+        {
+            out += (char)strtol(str.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+            continue;
+        }
+
+        out += str[i];
+    }
+
+    return out;
+}
+
+/// Parsed snapshot. Node 0 is a synthetic root referencing all roots.
+class HeapSnapshot
+{
+public:
+
+    std::vector<SnapNode> nodes;
+
+    /// Node index of each block id
+    std::unordered_map<size_t, size_t> nodeIdxs;
+
+    /// Number of root references per root kind
+    std::unordered_map<std::string, size_t> rootCounts;
+
+    /// Allocation site names, by site id
+    std::unordered_map<size_t, std::string> sites;
+
+    HeapSnapshot()
+    {
+        nodes.resize(1);
+    }
+
+    /// Get the node index of a reference, creating the node if needed
+    size_t getNode(const std::string& ref)
+    {
+        auto id = (size_t)strtoull(ref.c_str(), nullptr, 10);
+        auto itr = nodeIdxs.find(id);
+        if (itr != nodeIdxs.end())
+            return itr->second;
+
+        auto idx = nodes.size();
+        nodes.resize(idx + 1);
+        nodeIdxs[id] = idx;
+        return idx;
+    }
+
+    /// Add a reference to a node being parsed
+    /// Note: this may resize the node vector
+    void addRef(SnapNode& node, const std::string& ref)
+    {
+        if (ref != "-")
+            node.refs.push_back(getNode(ref));
+    }
+
+    void parseLine(const std::string& line)
+    {
+        std::istringstream in(line);
+        std::vector<std::string> fields;
+        std::string field;
+        while (in >> field)
+            fields.push_back(field);
+
+        if (fields.empty())
+            return;
+
+        auto& kind = fields[0];
+
+        if (kind == "root")
+        {
+            if (fields.size() != 3)
+                throw RunError("invalid root record: " + line);
+
+            auto label = unescape(fields[1]);
+            auto rootKind = label.substr(0, label.find(':'));
+            rootCounts[rootKind]++;
+
+            if (fields[2] != "-")
+            {
+                auto idx = getNode(fields[2]);
+                nodes[0].refs.push_back(idx);
+            }
+            return;
+        }
+
+        if (kind == "site")
+        {
+            if (fields.size() != 4)
+                throw RunError("invalid site record: " + line);
+
+            auto name = unescape(fields[2]);
+            if (fields[3] != "-")
+                name += " (" + unescape(fields[3]) + ")";
+            sites[strtoull(fields[1].c_str(), nullptr, 10)] = name;
+            return;
+        }
+
+        if (kind != "str" && kind != "arr" && kind != "obj")
+            throw RunError("unknown snapshot record: " + line);
+
+        if (fields.size() < 5)
+            throw RunError("invalid node record: " + line);
+
+        auto idx = getNode(fields[1]);
+        SnapNode node;
+        node.kind = kind[0];
+        node.size = strtoull(fields[2].c_str(), nullptr, 10);
+        node.site = strtoull(fields[3].c_str(), nullptr, 10);
+        node.len = strtoull(fields[4].c_str(), nullptr, 10);
+
+        if (kind == "str")
+        {
+            if (fields.size() < 6)
+                throw RunError("invalid string record: " + line);
+
+            node.hash = fields[5];
+            node.text = (fields.size() > 6)? unescape(fields[6]):"";
+        }
+        else if (kind == "arr")
+        {
+            for (size_t i = 5; i < fields.size(); ++i)
+                addRef(node, fields[i]);
+        }
+        else
+        {
+            if (fields.size() != 5 + 2 * node.len)
+                throw RunError("invalid object record: " + line);
+
+            for (size_t i = 5; i < fields.size(); i += 2)
+            {
+                addRef(node, fields[i]);
+                node.names.push_back(node.refs.back());
+                addRef(node, fields[i + 1]);
+            }
+        }
+
+        nodes[idx] = node;
+    }
+
+    /// Compute the immediate dominators, using the iterative algorithm
+    /// of Cooper, Harvey and Kennedy, then the retained sizes
+    void computeDominators()
+    {
+        // Order the nodes in reverse postorder from the root
+        std::vector<size_t> postOrder;
+        std::vector<size_t> postNum(nodes.size(), SIZE_MAX);
+        std::vector<bool> visited(nodes.size(), false);
+        std::vector<std::pair<size_t, size_t>> stack;
+
+        stack.push_back({ 0, 0 });
+        visited[0] = true;
+
+        while (!stack.empty())
+        {
+            auto& top = stack.back();
+            auto& refs = nodes[top.first].refs;
+
+            if (top.second < refs.size())
+            {
+                auto next = refs[top.second++];
+                if (!visited[next])
+                {
+                    visited[next] = true;
+                    stack.push_back({ next, 0 });
+                }
+                continue;
+            }
+
+            postNum[top.first] = postOrder.size();
+            postOrder.push_back(top.first);
+            stack.pop_back();
+        }
+
+        std::vector<std::vector<size_t>> preds(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            for (auto ref : nodes[i].refs)
+                preds[ref].push_back(i);
+        }
+
+        auto intersect = [&](size_t a, size_t b)
+        {
+            while (a != b)
+            {
+                while (postNum[a] < postNum[b])
+                    a = nodes[a].idom;
+                while (postNum[b] < postNum[a])
+                    b = nodes[b].idom;
+            }
+            return a;
+        };
+
+        nodes[0].idom = 0;
+
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+
+            for (auto itr = postOrder.rbegin(); itr != postOrder.rend(); ++itr)
+            {
+                auto idx = *itr;
+                if (idx == 0)
+                    continue;
+
+                size_t newIdom = SIZE_MAX;
+                for (auto pred : preds[idx])
+                {
+                    if (nodes[pred].idom == SIZE_MAX)
+                        continue;
+                    newIdom = (newIdom == SIZE_MAX)? pred:intersect(pred, newIdom);
+                }
+
+                if (nodes[idx].idom != newIdom)
+                {
+                    nodes[idx].idom = newIdom;
+                    changed = true;
+                }
+            }
+        }
+
+        // Dominated nodes come after their dominators in reverse postorder
+        for (auto idx : postOrder)
+            nodes[idx].retained += nodes[idx].size;
+        for (auto idx : postOrder)
+        {
+            if (idx != 0)
+                nodes[nodes[idx].idom].retained += nodes[idx].retained;
+        }
+    }
+
+    /**
+    Compute the retained size of the blocks allocated at each site. Blocks
+    dominated by another block from the same site are already counted.
+    */
+    std::unordered_map<size_t, size_t> retainedBySite()
+    {
+        std::vector<std::vector<size_t>> children(nodes.size());
+        for (size_t i = 1; i < nodes.size(); ++i)
+        {
+            if (nodes[i].idom != SIZE_MAX)
+                children[nodes[i].idom].push_back(i);
+        }
+
+        std::unordered_map<size_t, size_t> retained;
+        std::unordered_map<size_t, size_t> activeSites;
+
+        // Walk the dominator tree, tracking the sites of the ancestors
+        std::vector<std::pair<size_t, bool>> stack;
+        stack.push_back({ 0, false });
+
+        while (!stack.empty())
+        {
+            auto idx = stack.back().first;
+            auto done = stack.back().second;
+            stack.pop_back();
+
+            auto site = nodes[idx].site;
+
+            if (done)
+            {
+                activeSites[site]--;
+                continue;
+            }
+
+            if (idx != 0 && activeSites[site] == 0)
+                retained[site] += nodes[idx].retained;
+
+            activeSites[site]++;
+            stack.push_back({ idx, true });
+            for (auto child : children[idx])
+                stack.push_back({ child, false });
+        }
+
+        return retained;
+    }
+
+    std::string siteName(size_t site)
+    {
+        if (site == 0)
+            return "<unknown>";
+
+        auto itr = sites.find(site);
+        return (itr != sites.end())? itr->second:"<site " + std::to_string(site) + ">";
+    }
+
+    std::string quote(std::string text)
+    {
+        const size_t MAX_LEN = 32;
+        if (text.length() > MAX_LEN)
+            text = text.substr(0, MAX_LEN) + "...";
+
+        std::string out = "\"";
+        for (auto ch : text)
+        {
+            if (ch == '\n')
+                out += "\\n";
+            else if (ch == '"' || ch == '\\')
+                out += std::string("\\") + ch;
+            else
+                out += ch;
+        }
+        return out + "\"";
+    }
+
+    /// Describe a node, listing the first few fields of objects
+    std::string describe(size_t idx)
+    {
+        const size_t MAX_FIELDS = 4;
+        auto& node = nodes[idx];
+
+        if (node.kind == 's')
+            return "string " + quote(node.text);
+
+        if (node.kind == 'a')
+            return "array[" + std::to_string(node.len) + "]";
+
+        std::string out = "object {";
+        for (size_t i = 0; i < node.names.size() && i < MAX_FIELDS; ++i)
+        {
+            if (i > 0)
+                out += ", ";
+            out += nodes[node.names[i]].text;
+        }
+        if (node.names.size() > MAX_FIELDS)
+            out += ", ...";
+        return out + "}";
+    }
+};
+
+void printHeapSummary(std::string fileName, size_t numRows)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        throw RunError("could not open heap snapshot \"" + fileName + "\"");
+    }
+
+    std::string line;
+    if (!std::getline(file, line) || line != "zeta-heap-snapshot 1")
+    {
+        throw RunError("\"" + fileName + "\" is not a heap snapshot");
+    }
+
+    HeapSnapshot snap;
+    while (std::getline(file, line))
+        snap.parseLine(line);
+
+    snap.computeDominators();
+
+    // Totals per kind of block
+    const char* KIND_NAMES[] = { "strings", "arrays", "objects" };
+    const char KINDS[] = { 's', 'a', 'o' };
+    size_t kindCounts[3] = { 0, 0, 0 };
+    size_t kindBytes[3] = { 0, 0, 0 };
+    bool sitesTracked = false;
+
+    for (size_t i = 1; i < snap.nodes.size(); ++i)
+    {
+        auto& node = snap.nodes[i];
+        for (size_t k = 0; k < 3; ++k)
+        {
+            if (node.kind != KINDS[k])
+                continue;
+            kindCounts[k]++;
+            kindBytes[k] += node.size;
+        }
+
+        if (node.site != 0)
+            sitesTracked = true;
+    }
+
+    printf("heap snapshot: %zu blocks, %zu bytes\n", snap.nodes.size() - 1, snap.nodes[0].retained);
+    for (size_t k = 0; k < 3; ++k)
+        printf("  %-8s %10zu blocks %12zu bytes\n", KIND_NAMES[k], kindCounts[k], kindBytes[k]);
+
+    printf("root references:");
+    for (auto kind : { "stack", "pkg", "code" })
+        printf(" %s: %zu", kind, snap.rootCounts[kind]);
+    printf("\n");
+
+    // Blocks retaining the most memory
+    std::vector<size_t> order;
+    for (size_t i = 1; i < snap.nodes.size(); ++i)
+        order.push_back(i);
+
+    std::sort(
+        order.begin(),
+        order.end(),
+        [&](size_t a, size_t b)
+        {
+            return snap.nodes[a].retained > snap.nodes[b].retained;
+        }
+    );
+
+    printf("largest dominators:\n");
+    printf("  %12s %10s  %s\n", "retained", "shallow", "block");
+    for (size_t i = 0; i < order.size() && i < numRows; ++i)
+    {
+        auto& node = snap.nodes[order[i]];
+        printf(
+            "  %12zu %10zu  %s",
+            node.retained,
+            node.size,
+            snap.describe(order[i]).c_str()
+        );
+        if (node.site != 0)
+            printf(", %s", snap.siteName(node.site).c_str());
+        printf("\n");
+    }
+
+    // Retained and shallow sizes per allocation site
+    if (sitesTracked)
+    {
+        auto retained = snap.retainedBySite();
+
+        std::unordered_map<size_t, std::pair<size_t, size_t>> shallow;
+        for (size_t i = 1; i < snap.nodes.size(); ++i)
+        {
+            auto& stats = shallow[snap.nodes[i].site];
+            stats.first++;
+            stats.second += snap.nodes[i].size;
+        }
+
+        std::vector<std::pair<size_t, size_t>> bySite(retained.begin(), retained.end());
+        std::sort(
+            bySite.begin(),
+            bySite.end(),
+            [](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b)
+            {
+                return a.second > b.second;
+            }
+        );
+
+        printf("retained size by allocation site:\n");
+        printf("  %12s %10s %10s  %s\n", "retained", "shallow", "blocks", "site");
+        for (size_t i = 0; i < bySite.size() && i < numRows; ++i)
+        {
+            auto site = bySite[i].first;
+            printf(
+                "  %12zu %10zu %10zu  %s\n",
+                bySite[i].second,
+                shallow[site].second,
+                shallow[site].first,
+                snap.siteName(site).c_str()
+            );
+        }
+    }
+    else
+    {
+        printf("allocation sites were not tracked, see --heap-snapshot\n");
+    }
+
+    // Strings with identical contents
+    std::unordered_map<std::string, std::vector<size_t>> strsByHash;
+    for (size_t i = 1; i < snap.nodes.size(); ++i)
+    {
+        auto& node = snap.nodes[i];
+        if (node.kind == 's')
+            strsByHash[node.hash + ":" + std::to_string(node.len)].push_back(i);
+    }
+
+    std::vector<std::pair<size_t, size_t>> dups;
+    size_t numCopies = 0;
+    size_t wasted = 0;
+
+    for (auto& entry : strsByHash)
+    {
+        auto& copies = entry.second;
+        if (copies.size() < 2)
+            continue;
+
+        auto dupBytes = (copies.size() - 1) * snap.nodes[copies[0]].size;
+        dups.push_back({ copies[0], copies.size() });
+        numCopies += copies.size() - 1;
+        wasted += dupBytes;
+    }
+
+    std::sort(
+        dups.begin(),
+        dups.end(),
+        [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b)
+        {
+            return (
+                (a.second - 1) * snap.nodes[a.first].size >
+                (b.second - 1) * snap.nodes[b.first].size
+            );
+        }
+    );
+
+    printf(
+        "duplicate strings: %zu contents with copies, %zu redundant copies, %zu bytes\n",
+        dups.size(),
+        numCopies,
+        wasted
+    );
+    printf("  %10s %10s  %s\n", "copies", "wasted", "text");
+    for (size_t i = 0; i < dups.size() && i < numRows; ++i)
+    {
+        auto& node = snap.nodes[dups[i].first];
+        printf(
+            "  %10zu %10zu  %s\n",
+            dups[i].second,
+            (dups[i].second - 1) * node.size,
+            snap.quote(node.text).c_str()
+        );
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+/*
+Heap snapshot format
+
+Snapshots are text files with one record per line, and fields
+separated by single spaces. The first line is the header:
+
+    zeta-heap-snapshot 1
+
+Each heap block reachable from the roots is listed once, with a
+numeric id starting at 1, its size in bytes and the id of the site
+which allocated it, zero if unknown. References to other blocks are
+given by id, and non-heap values (ie: int32, bool) are written "-".
+
+    str <id> <size> <site> <len> <hash> <text>
+    arr <id> <size> <site> <len> <ref>...
+    obj <id> <size> <site> <numFields> { <nameRef> <valRef> }...
+    root <label> <ref>
+    site <site> <fun> <pos>
+
+String hashes are 64-bit FNV-1a hashes of the contents, in hex. The
+text field holds up to the first 64 bytes of a string, and is omitted
+for empty strings. Object field names are string blocks. Root labels
+are "stack", "code", or "pkg:" followed by a package name. Site
+positions are "-" when unknown.
+
+Text fields (string text, root labels, function names) are escaped,
+bytes which are spaces, control characters, non-ASCII or "%" being
+written as "%XX", in hex. Lines can appear in any order.
+*/
+
+/// Print a summary of a heap snapshot file: the largest dominators,
+/// retained sizes by allocation site, and duplicate strings
+void printHeapSummary(std::string fileName, size_t numRows);
@@ -0,0 +1,664 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+#include "runtime.h"
+#include "parser.h"
+#include "image.h"
+#include "core.h"
+
+/*
+Binary image format (.zimb)
+
+All integers are stored in little-endian byte order.
+
+    magic           8 bytes, "ZETAIMGB"
+    version         uint32
+    numStrings      uint32
+    strings         numStrings x { len:uint32, chars:len bytes }
+    numNodes        uint32
+    nodes           numNodes x { tag:uint8, count:uint32 }
+    node bodies     for each node, in order:
+                    object: count x { name:uint32 (string index), value }
+                    array:  count x value
+    root            value
+
+Values are encoded as a tag byte followed by a payload:
+
+    undef           no payload
+    bool            uint8
+    int32           int32
+    float32         4 bytes, IEEE 754
+    string          uint32 index into the string table
+    object/array    uint32 index into the node table
+    hostfn          uint32 index of the function name in the string table
+    extern          uint32 index of a definition name in the string table
+
+External references point to objects and arrays defined in another
+image, ie: the runtime functions of a language package referenced by
+the code it generated. They are written with the tag EXTERN_TAG, and
+are resolved by name against the definitions of that image when
+loading, so that its nodes are shared rather than copied.
+
+Since all objects and arrays are listed with their field/element counts
+before any node body, a loader can allocate them all with the right
+capacity up front, and then fill them in a single linear pass, with
+references resolved as plain indices.
+*/
+
+/// Value tag for references to definitions of another image
+/// This is not a runtime tag, and only appears in binary images
+const uint8_t EXTERN_TAG = 0xFF;
+
+/// Convert between host and little-endian byte order, in place
+/// Byte swapping is its own inverse, so this is used for both directions
+static void swapLittleEndian(uint8_t* bytes, size_t size)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    std::reverse(bytes, bytes + size);
+#endif
+}
+
+/**
+Binary image serializer
+*/
+class BinWriter
+{
+private:
+
+    std::vector<uint8_t> buf;
+
+    /// Names of the external definitions, by node
+    std::unordered_map<refptr, std::string> externNames;
+
+    /// String table
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint32_t> stringIdxs;
+
+    /// Object and array nodes
+    std::vector<Value> nodes;
+    std::unordered_map<refptr, uint32_t> nodeIdxs;
+
+    template <typename T> void write(T val)
+    {
+        auto bytes = (uint8_t*)&val;
+        swapLittleEndian(bytes, sizeof(T));
+        buf.insert(buf.end(), bytes, bytes + sizeof(T));
+    }
+
+    uint32_t getStringIdx(const std::string& str)
+    {
+        auto itr = stringIdxs.find(str);
+        if (itr != stringIdxs.end())
+            return itr->second;
+
+        auto idx = (uint32_t)strings.size();
+        strings.push_back(str);
+        stringIdxs[str] = idx;
+        return idx;
+    }
+
+    /// Collect the strings and nodes reachable from a root value
+    void collect(Value root)
+    {
+        std::vector<Value> stack;
+        stack.push_back(root);
+
+        while (!stack.empty())
+        {
+            auto val = stack.back();
+            stack.pop_back();
+
+            switch (val.getTag())
+            {
+                case TAG_UNDEF:
+                case TAG_BOOL:
+                case TAG_INT32:
+                case TAG_FLOAT32:
+                break;
+
+                case TAG_STRING:
+                getStringIdx((std::string)val);
+                break;
+
+                case TAG_OBJECT:
+                case TAG_ARRAY:
+                {
+                    auto ptr = (refptr)val;
+                    if (nodeIdxs.find(ptr) != nodeIdxs.end())
+                        break;
+
+                    // External nodes are referenced by name, not copied
+                    auto externItr = externNames.find(ptr);
+                    if (externItr != externNames.end())
+                    {
+                        getStringIdx(externItr->second);
+                        break;
+                    }
+
+                    nodeIdxs[ptr] = (uint32_t)nodes.size();
+                    nodes.push_back(val);
+
+                    if (val.isObject())
+                    {
+                        auto obj = Object(val);
+                        for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+                        {
+                            auto fieldName = itr.get();
+                            getStringIdx(fieldName);
+                            auto fieldVal = obj.getField(fieldName);
+
+                            // Materialize lazily loaded entry blocks
+                            if (fieldVal.getTag() == TAG_IMGREF &&
+                                ImgRef(fieldVal).getImgIdx() != 0)
+                            {
+                                fieldVal = resolveLazyRef(fieldVal);
+                                obj.setField(fieldName, fieldVal);
+                            }
+
+                            stack.push_back(fieldVal);
+                        }
+                    }
+                    else
+                    {
+                        auto arr = Array(val);
+                        for (size_t i = 0; i < arr.length(); ++i)
+                            stack.push_back(arr.getElem(i));
+                    }
+                }
+                break;
+
+                // Host functions are saved by name
+                case TAG_HOSTFN:
+                getStringIdx(((HostFn*)val.getWord().ptr)->getName());
+                break;
+
+                default:
+                throw RunError(
+                    "cannot serialize value with tag " +
+                    std::to_string((int)val.getTag()) +
+                    " into a binary image"
+                );
+            }
+        }
+    }
+
+    void writeValue(Value val)
+    {
+        auto tag = val.getTag();
+
+        if (tag == TAG_OBJECT || tag == TAG_ARRAY)
+        {
+            auto externItr = externNames.find((refptr)val);
+            if (externItr != externNames.end())
+            {
+                write<uint8_t>(EXTERN_TAG);
+                write<uint32_t>(stringIdxs[externItr->second]);
+                return;
+            }
+        }
+
+        write<uint8_t>(tag);
+
+        switch (tag)
+        {
+            case TAG_UNDEF:
+            break;
+
+            case TAG_BOOL:
+            write<uint8_t>((bool)val? 1:0);
+            break;
+
+            case TAG_INT32:
+            write<int32_t>((int32_t)val);
+            break;
+
+            case TAG_FLOAT32:
+            write<float>((float)val);
+            break;
+
+            case TAG_STRING:
+            write<uint32_t>(stringIdxs[(std::string)val]);
+            break;
+
+            case TAG_OBJECT:
+            case TAG_ARRAY:
+            write<uint32_t>(nodeIdxs[(refptr)val]);
+            break;
+
+            case TAG_HOSTFN:
+            write<uint32_t>(stringIdxs[((HostFn*)val.getWord().ptr)->getName()]);
+            break;
+
+            default:
+            assert (false);
+        }
+    }
+
+    uint32_t countFields(Object obj)
+    {
+        uint32_t count = 0;
+        for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+            count++;
+        return count;
+    }
+
+public:
+
+    BinWriter(const ImageDefs* externs = nullptr)
+    {
+        if (!externs)
+            return;
+
+        for (auto& def : *externs)
+        {
+            if (def.second.isObject() || def.second.isArray())
+                externNames[(refptr)def.second] = def.first;
+        }
+    }
+
+    /// Serialize the graph reachable from a root value
+    const std::vector<uint8_t>& serialize(Value root)
+    {
+        collect(root);
+
+        auto magic = (const uint8_t*)BIN_IMAGE_MAGIC;
+        buf.insert(buf.end(), magic, magic + BIN_IMAGE_MAGIC_LEN);
+        write<uint32_t>(BIN_IMAGE_VERSION);
+
+        write<uint32_t>(strings.size());
+        for (auto& str : strings)
+        {
+            write<uint32_t>(str.length());
+            buf.insert(buf.end(), str.begin(), str.end());
+        }
+
+        write<uint32_t>(nodes.size());
+        for (auto node : nodes)
+        {
+            write<uint8_t>(node.getTag());
+            if (node.isObject())
+                write<uint32_t>(countFields(node));
+            else
+                write<uint32_t>(Array(node).length());
+        }
+
+        for (auto node : nodes)
+        {
+            if (node.isObject())
+            {
+                auto obj = Object(node);
+                for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+                {
+                    auto fieldName = itr.get();
+                    write<uint32_t>(stringIdxs[fieldName]);
+                    writeValue(obj.getField(fieldName));
+                }
+            }
+            else
+            {
+                auto arr = Array(node);
+                for (size_t i = 0; i < arr.length(); ++i)
+                    writeValue(arr.getElem(i));
+            }
+        }
+
+        writeValue(root);
+
+        return buf;
+    }
+};
+
+/**
+Binary image loader
+*/
+class BinReader
+{
+private:
+
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+
+    std::string srcName;
+
+    /// Definitions external references are resolved against
+    const ImageDefs* externs;
+
+    /// Heap strings for each string table entry
+    std::vector<Value> strings;
+
+    /// Whether string table entries were checked to be valid field names
+    std::vector<bool> validNames;
+
+    /// Objects and arrays for each node table entry
+    std::vector<Value> nodes;
+
+    /// Field/element counts for each node table entry
+    std::vector<uint32_t> counts;
+
+    void error(std::string msg)
+    {
+        throw ParseError(srcName + " - " + msg);
+    }
+
+    template <typename T> T read()
+    {
+        if (pos + sizeof(T) > size)
+            error("unexpected end of binary image");
+
+        T val;
+        memcpy(&val, data + pos, sizeof(T));
+        swapLittleEndian((uint8_t*)&val, sizeof(T));
+        pos += sizeof(T);
+        return val;
+    }
+
+    uint32_t readIdx(size_t limit)
+    {
+        auto idx = read<uint32_t>();
+        if (idx >= limit)
+            error("invalid index in binary image");
+        return idx;
+    }
+
+    Value readValue()
+    {
+        auto tag = read<uint8_t>();
+
+        switch (tag)
+        {
+            case TAG_UNDEF:
+            return Value::UNDEF;
+
+            case TAG_BOOL:
+            return read<uint8_t>()? Value::TRUE:Value::FALSE;
+
+            case TAG_INT32:
+            return Value::int32(read<int32_t>());
+
+            case TAG_FLOAT32:
+            return Value::float32(read<float>());
+
+            case TAG_STRING:
+            return strings[readIdx(strings.size())];
+
+            case TAG_OBJECT:
+            case TAG_ARRAY:
+            {
+                auto node = nodes[readIdx(nodes.size())];
+                if (node.getTag() != tag)
+                    error("node reference with mismatched tag");
+                return node;
+            }
+
+            case TAG_HOSTFN:
+            {
+                auto name = (std::string)strings[readIdx(strings.size())];
+                auto hostFn = findHostFn(name);
+                if (!hostFn)
+                    error("unknown host function \"" + name + "\"");
+                return Value((refptr)hostFn, TAG_HOSTFN);
+            }
+
+            case EXTERN_TAG:
+            {
+                auto name = (std::string)strings[readIdx(strings.size())];
+                if (!externs || externs->find(name) == externs->end())
+                    error("unresolved external reference \"" + name + "\"");
+                return externs->at(name);
+            }
+
+            default:
+            error("invalid value tag in binary image");
+        }
+
+        return Value::UNDEF;
+    }
+
+public:
+
+    BinReader(
+        const uint8_t* data,
+        size_t size,
+        std::string srcName,
+        const ImageDefs* externs = nullptr
+    )
+    : data(data),
+      size(size),
+      srcName(srcName),
+      externs(externs)
+    {
+    }
+
+    Value load()
+    {
+        if (size < BIN_IMAGE_MAGIC_LEN ||
+            memcmp(data, BIN_IMAGE_MAGIC, BIN_IMAGE_MAGIC_LEN) != 0)
+            error("not a binary image");
+        pos = BIN_IMAGE_MAGIC_LEN;
+
+        auto version = read<uint32_t>();
+        if (version == 0 || version > BIN_IMAGE_VERSION)
+            error("unsupported binary image version");
+
+        // Allocate the strings
+        auto numStrings = read<uint32_t>();
+        strings.reserve(numStrings);
+        for (size_t i = 0; i < numStrings; ++i)
+        {
+            auto len = read<uint32_t>();
+            if (pos + len > size)
+                error("unexpected end of binary image");
+            strings.push_back(String(std::string((char*)data + pos, len)));
+            pos += len;
+        }
+        validNames.resize(numStrings, false);
+
+        // Allocate the objects and arrays with their final capacity
+        auto numNodes = read<uint32_t>();
+        nodes.reserve(numNodes);
+        counts.reserve(numNodes);
+        for (size_t i = 0; i < numNodes; ++i)
+        {
+            auto tag = read<uint8_t>();
+            auto count = read<uint32_t>();
+
+            if (tag == TAG_OBJECT)
+                nodes.push_back(Object::newObjectExact(std::max(2 * count, 2u)));
+            else if (tag == TAG_ARRAY)
+                nodes.push_back(Array(count));
+            else
+                error("invalid node tag in binary image");
+
+            counts.push_back(count);
+        }
+
+        // Fill in the node contents
+        for (size_t i = 0; i < numNodes; ++i)
+        {
+            auto node = nodes[i];
+
+            if (node.isObject())
+            {
+                auto obj = Object(node);
+                for (size_t j = 0; j < counts[i]; ++j)
+                {
+                    auto nameIdx = readIdx(numStrings);
+
+                    if (!validNames[nameIdx])
+                    {
+                        if (!isValidIdent((std::string)strings[nameIdx]))
+                            error("invalid field name in binary image");
+                        validNames[nameIdx] = true;
+                    }
+
+                    obj.setField(String(strings[nameIdx]), readValue());
+                }
+            }
+            else
+            {
+                auto arr = Array(node);
+                for (size_t j = 0; j < counts[i]; ++j)
+                    arr.push(readValue());
+            }
+        }
+
+        auto root = readValue();
+
+        if (pos != size)
+            error("unconsumed data at end of binary image");
+
+        return root;
+    }
+};
+
+/// Read the contents of a binary file
+std::vector<uint8_t> readBinFile(std::string fileName)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+
+    if (!file)
+    {
+        throw RunError("failed to open file \"" + fileName + "\"");
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    std::vector<uint8_t> data(len);
+    auto numRead = fread(data.data(), 1, len, file);
+    fclose(file);
+
+    if (numRead != len)
+    {
+        throw RunError("failed to read file \"" + fileName + "\"");
+    }
+
+    return data;
+}
+
+bool isBinImage(std::string fileName)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+
+    if (!file)
+        return false;
+
+    char magic[BIN_IMAGE_MAGIC_LEN];
+    auto numRead = fread(magic, 1, BIN_IMAGE_MAGIC_LEN, file);
+    fclose(file);
+
+    return (
+        numRead == BIN_IMAGE_MAGIC_LEN &&
+        memcmp(magic, BIN_IMAGE_MAGIC, BIN_IMAGE_MAGIC_LEN) == 0
+    );
+}
+
+void writeBinImage(Value root, std::string fileName, const ImageDefs* externs)
+{
+    BinWriter writer(externs);
+    auto& buf = writer.serialize(root);
+
+    FILE* file = fopen(fileName.c_str(), "wb");
+
+    if (!file)
+    {
+        throw RunError("failed to open file \"" + fileName + "\"");
+    }
+
+    auto numWritten = fwrite(buf.data(), 1, buf.size(), file);
+    fclose(file);
+
+    if (numWritten != buf.size())
+    {
+        throw RunError("failed to write file \"" + fileName + "\"");
+    }
+}
+
+Value readBinImage(std::string fileName, const ImageDefs* externs)
+{
+    auto data = readBinFile(fileName);
+    BinReader reader(data.data(), data.size(), fileName, externs);
+    return reader.load();
+}
+
+/// Test that an image survives a round trip through the binary format
+void testImageRoundTrip(std::string fileName)
+{
+    std::cout << "binary image round trip \"" << fileName << "\"" << std::endl;
+
+    auto tmpName = std::string("/tmp/zeta_image_test.zimb");
+
+    auto pkg = parseFile(fileName);
+    writeBinImage(pkg, tmpName);
+    assert (isBinImage(tmpName));
+    auto pkg2 = readBinImage(tmpName);
+    remove(tmpName.c_str());
+
+    // Serializing the loaded image should produce identical bytes
+    BinWriter w1;
+    BinWriter w2;
+    assert (w1.serialize(pkg) == w2.serialize(pkg2));
+}
+
+void testImage()
+{
+    std::cout << "binary image tests" << std::endl;
+
+    testImageRoundTrip("tests/vm/ex_image.zim");
+    testImageRoundTrip("tests/vm/ex_rec_fact.zim");
+    testImageRoundTrip("tests/vm/float_ops.zim");
+    testImageRoundTrip("tests/vm/closure.zim");
+
+    // Host functions are serialized by name
+    {
+        auto tmpName = std::string("/tmp/zeta_image_test.zimb");
+        auto ioPkg = Object(import("core/io"));
+        writeBinImage(ioPkg, tmpName);
+        auto ioPkg2 = Object(readBinImage(tmpName));
+        remove(tmpName.c_str());
+        assert (ioPkg2.getField("print_str") == ioPkg.getField("print_str"));
+    }
+
+    // Definitions of another image are referenced by name, not copied
+    {
+        auto tmpName = std::string("/tmp/zeta_image_test.zimb");
+
+        Input input("lib = { x:1 }; arr = [1, 2]; { lib:@lib };", "lib");
+        std::vector<std::string> imports;
+        ImageDefs defs;
+        auto libPkg = Object(parseInput(input, imports, &defs));
+        assert (defs.size() == 2);
+
+        auto pkg = Object::newObject();
+        pkg.setField("lib", libPkg.getField("lib"));
+        pkg.setField("arr", defs["arr"]);
+        pkg.setField("own", Object::newObject());
+        writeBinImage(pkg, tmpName, &defs);
+
+        auto pkg2 = Object(readBinImage(tmpName, &defs));
+        assert (pkg2.getField("lib") == defs["lib"]);
+        assert (pkg2.getField("arr") == defs["arr"]);
+        assert (pkg2.getField("own") != pkg.getField("own"));
+
+        // External references can't be resolved without the definitions
+        bool failed = false;
+        try
+        {
+            readBinImage(tmpName);
+        }
+        catch (ParseError& e)
+        {
+            failed = true;
+        }
+        assert (failed);
+
+        remove(tmpName.c_str());
+    }
+}
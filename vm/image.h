@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include "runtime.h"
+#include "parser.h"
+
+/// Magic bytes identifying binary image files
+const char BIN_IMAGE_MAGIC[] = "ZETAIMGB";
+const size_t BIN_IMAGE_MAGIC_LEN = 8;
+
+/// Version of the binary image format
+/// Version 2 adds host function references
+/// Version 3 adds references to definitions of another image
+const uint32_t BIN_IMAGE_VERSION = 3;
+
+/// Check if a file is a binary image
+bool isBinImage(std::string fileName);
+
+/// Serialize a value graph into a binary image file
+/// Objects and arrays which are definitions listed in externs are not
+/// serialized, but written as references to the definition name
+void writeBinImage(
+    Value root,
+    std::string fileName,
+    const ImageDefs* externs = nullptr
+);
+
+/// Load a binary image file
+/// References to definitions of another image are resolved in externs
+Value readBinImage(std::string fileName, const ImageDefs* externs = nullptr);
+
+void testImage();
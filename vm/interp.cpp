@@ -1,11 +1,26 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "core.h"
 #include <math.h>
+#ifdef ZETA_PROFILE_OPS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 /// Opcode enumeration
 enum Opcode : uint16_t
@@ -87,87 +102,102 @@ enum Opcode : uint16_t
     RET,
     THROW,
 
+    // Execution counters, emitted with --block-counts
+    COUNT_BLOCK,
+    COUNT_BRANCH,
+
     IMPORT,
     ABORT
 };
 
-/// Inline cache to speed up property lookups
-class ICache
+class CodeFragment
 {
-private:
-
-    // Cached slot index
-    size_t slotIdx = 0;
+public:
 
-    // Field name to look up
-    std::string fieldName;
+    /// Start index in the executable heap
+    uint8_t* startPtr = nullptr;
 
-public:
+    /// End index in the executable heap
+    uint8_t* endPtr = nullptr;
 
-    ICache(std::string fieldName)
-    : fieldName(fieldName)
+    /// Get the length of the code fragment
+    size_t length()
     {
+        assert (startPtr);
+        assert (endPtr);
+        return endPtr - startPtr;
     }
+};
 
-    Value getField(Object obj)
-    {
-        Value val;
+/**
+Packed source position
+Bits 48-63 hold the source name id plus one, bits 24-47 the line
+number and bits 0-23 the column number. Zero means no position.
+*/
+typedef uint64_t SrcPos;
 
-        if (!obj.getField(fieldName.c_str(), val, slotIdx))
-        {
-            throw RunError("missing field \"" + fieldName + "\"");
-        }
+/// Value indicating that no source position is available
+const SrcPos SRC_POS_NONE = 0;
 
-        return val;
-    }
+/// Source names referenced by packed source positions
+std::vector<std::string> srcNames;
 
-    int32_t getInt32(Object obj)
-    {
-        auto val = getField(obj);
-        assert (val.isInt32());
-        return (int32_t)val;
-    }
+/// Map of source names to source name ids
+std::unordered_map<std::string, size_t> srcNameIds;
 
-    String getStr(Object obj)
+/// Pack a source position object into an integer
+SrcPos packSrcPos(Value srcPos)
+{
+    if (!srcPos.isObject())
+        return SRC_POS_NONE;
+
+    auto srcPosObj = Object(srcPos);
+
+    static ICache lineNoIC("line_no");
+    static ICache colNoIC("col_no");
+    static ICache srcNameIC("src_name");
+    auto lineNo = (uint64_t)lineNoIC.getInt32(srcPosObj);
+    auto colNo = (uint64_t)colNoIC.getInt32(srcPosObj);
+    auto srcName = (std::string)srcNameIC.getStr(srcPosObj);
+
+    // Get an id for the source name
+    auto itr = srcNameIds.find(srcName);
+    size_t srcId;
+    if (itr != srcNameIds.end())
     {
-        auto val = getField(obj);
-        assert (val.isString());
-        return String(val);
+        srcId = itr->second;
     }
-
-    Object getObj(Object obj)
+    else
     {
-        auto val = getField(obj);
-        assert (val.isObject());
-        return Object(val);
+        srcId = srcNames.size();
+        srcNames.push_back(srcName);
+        srcNameIds[srcName] = srcId;
     }
 
-    Array getArr(Object obj)
-    {
-        auto val = getField(obj);
-        assert (val.isArray());
-        return Array(val);
-    }
-};
+    assert (srcId + 1 < (1 << 16));
+    lineNo = std::min(lineNo, (uint64_t)0xFFFFFF);
+    colNo = std::min(colNo, (uint64_t)0xFFFFFF);
 
-class CodeFragment
+    return ((srcId + 1) << 48) | (lineNo << 24) | colNo;
+}
+
+/// Get a string representation of a packed source position
+std::string srcPosToString(SrcPos pos)
 {
-public:
+    assert (pos != SRC_POS_NONE);
 
-    /// Start index in the executable heap
-    uint8_t* startPtr = nullptr;
+    auto srcId = (pos >> 48) - 1;
+    auto lineNo = (pos >> 24) & 0xFFFFFF;
+    auto colNo = pos & 0xFFFFFF;
 
-    /// End index in the executable heap
-    uint8_t* endPtr = nullptr;
+    assert (srcId < srcNames.size());
 
-    /// Get the length of the code fragment
-    size_t length()
-    {
-        assert (startPtr);
-        assert (endPtr);
-        return endPtr - startPtr;
-    }
-};
+    return (
+        srcNames[srcId] + "@" +
+        std::to_string(lineNo) + ":" +
+        std::to_string(colNo)
+    );
+}
 
 class BlockVersion : public CodeFragment
 {
@@ -179,13 +209,47 @@ public:
     /// Associated block
     Object block;
 
+    /// Sequence number, in order of creation
+    size_t id;
+
+    /// Source positions of instructions, sorted by code offset
+    /// Note: only instructions carrying a src_pos have an entry
+    std::vector<std::pair<uint32_t, SrcPos>> srcPosTable;
+
+    /// Number of times this version was entered, and times its
+    /// if_true went either way, when counting blocks
+    uint64_t numEntries = 0;
+    uint64_t numThen = 0;
+    uint64_t numElse = 0;
+
     /// Code generation context at block entry
     //CodeGenCtx ctx;
 
-    BlockVersion(Object fun, Object block)
+    BlockVersion(Object fun, Object block, size_t id)
     : fun(fun),
-      block(block)
+      block(block),
+      id(id)
+    {
+    }
+
+    /// Get the source position for an instruction in this version
+    SrcPos getSrcPos(uint8_t* instrPtr)
     {
+        if (srcPosTable.empty())
+            return SRC_POS_NONE;
+
+        assert (startPtr && instrPtr >= startPtr);
+        auto offset = (uint32_t)(instrPtr - startPtr);
+
+        // Find the last position at or before the instruction
+        for (size_t i = srcPosTable.size(); i > 0; --i)
+        {
+            if (srcPosTable[i-1].first <= offset)
+                return srcPosTable[i-1].second;
+        }
+
+        // Fall back to the last position in the block
+        return srcPosTable.back().second;
     }
 };
 
@@ -201,6 +265,28 @@ struct RetEntry
 
 typedef std::vector<BlockVersion*> VersionList;
 
+/// Branch target slot written by the compiler, patched once the
+/// target block version is compiled
+struct StubRef
+{
+    /// Opcode to turn into a direct jump (null for if_true targets)
+    Opcode* op;
+
+    /// Address slot to point to the target code
+    uint8_t** addr;
+
+    /// Target block version
+    BlockVersion* target;
+};
+
+/// State of an ahead-of-time compilation in progress
+/// Note: this is null when compiling lazily
+struct AOTState
+{
+    /// Branch slots written for the function being compiled
+    std::vector<StubRef> stubs;
+}* aotState = nullptr;
+
 /// Initial code heap size in bytes
 const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
 
@@ -216,13 +302,32 @@ uint8_t* codeHeapLimit = nullptr;
 /// Current allocation pointer in the code heap
 uint8_t* codeHeapAlloc = nullptr;
 
-/// Map of block objects to lists of versions
-std::unordered_map<refptr, VersionList> versionMap;
+/// VM-internal information associated with a block object
+struct BlockInfo
+{
+    /// Versions of this block
+    VersionList versions;
+
+    /// Number of locals the function starting at this block was
+    /// verified against, -1 if not verified as an entry block
+    int32_t verifiedLocals = -1;
+
+    /// Maximum operand stack depth of the verified function
+    size_t maxStackDepth = 0;
+};
+
+/// Information associated with each block object
+/// Note: blocks store their index in this table in their header,
+///       index zero is reserved to mean "no information yet"
+std::vector<BlockInfo> blockInfos(1);
 
 /// Map of instructions to block versions
 /// Note: this isn't defined for all instructions
 std::unordered_map<uint8_t*, BlockVersion*> instrMap;
 
+/// Map of code addresses to the block versions starting there
+std::map<uint8_t*, BlockVersion*> codeVersions;
+
 /// Map of return addresses to associated info
 std::unordered_map<BlockVersion*, RetEntry> retAddrMap;
 
@@ -255,18 +360,19 @@ template <typename T> void writeCode(T val)
 }
 
 /// Return a pointer to a value to read from the code stream
+/// Note: verified code cannot run past the end of its block
 template <typename T> __attribute__((always_inline)) T& readCode()
 {
-    assert (instrPtr + sizeof(T) <= codeHeapLimit);
     T* valPtr = (T*)instrPtr;
     instrPtr += sizeof(T);
     return *valPtr;
 }
 
 /// Push a value on the stack
+/// Note: stack bounds are not checked here, the verifier computes the
+///       maximum stack depth of functions, which is checked on calls
 __attribute__((always_inline)) void pushVal(Value val)
 {
-    assert (stackPtr > stackLimit);
     stackPtr--;
     stackPtr[0] = val;
 }
@@ -279,7 +385,6 @@ __attribute__((always_inline)) void pushBool(bool val)
 
 __attribute__((always_inline)) Value popVal()
 {
-    assert (stackPtr < stackBase);
     auto val = stackPtr[0];
     stackPtr++;
     return val;
@@ -342,6 +447,9 @@ __attribute__((always_inline)) size_t frameSize()
     return framePtr - stackPtr + 1;
 }
 
+// Forward declaration
+void initOpcodeTable();
+
 /// Initialize the interpreter
 void initInterp()
 {
@@ -354,8 +462,47 @@ void initInterp()
     stackLimit = new Value[STACK_INIT_SIZE];
     stackBase = stackLimit + STACK_INIT_SIZE;
     stackPtr = stackBase;
+
+    // Build the opcode name lookup table
+    initOpcodeTable();
 }
 
+/// Get the information associated with a block object
+BlockInfo& getBlockInfo(Object block)
+{
+    auto infoIdx = block.getAuxIdx();
+
+    if (infoIdx == 0)
+    {
+        infoIdx = blockInfos.size();
+        blockInfos.push_back(BlockInfo());
+        block.setAuxIdx(infoIdx);
+    }
+
+    return blockInfos[infoIdx];
+}
+
+/// Number of block versions created
+size_t numVersionsCreated = 0;
+
+/// Number of jump stubs and if_true targets patched to point
+/// to compiled code
+size_t numStubsPatched = 0;
+
+/// Number of jumps dropped by writing their target right after them
+size_t numJumpsElided = 0;
+
+/// Output file for compilation events, null if not logging
+FILE* jitLog = nullptr;
+
+/// Emit block entry and branch counters into compiled code
+bool countingBlocks = false;
+
+// Forward declarations
+std::string profFunName(Object fun);
+void logVersion(BlockVersion* version);
+uint8_t* versionEnd(BlockVersion* version);
+
 /// Get a version of a block. This version will be a stub
 /// until compiled
 BlockVersion* getBlockVersion(
@@ -363,665 +510,1154 @@ BlockVersion* getBlockVersion(
     Object block
 )
 {
-    auto blockPtr = (refptr)block;
-    auto versionItr = versionMap.find((refptr)block);
+    auto& versions = getBlockInfo(block).versions;
 
-    if (versionItr == versionMap.end())
-    {
-        versionMap[blockPtr] = VersionList();
-    }
-    else
+    for (auto version : versions)
     {
-        auto versions = versionItr->second;
-        assert (versions.size() > 0);
-        for (auto version : versions)
-        {
-            if (version->fun == fun)
-                return version;
-        }
+        if (version->fun == fun)
+            return version;
     }
 
-    auto& versionList = versionMap[blockPtr];
-    auto newVersion = new BlockVersion(fun, block);
-    versionList.push_back(newVersion);
+    auto newVersion = new BlockVersion(fun, block, numVersionsCreated++);
+    versions.push_back(newVersion);
+
+    if (jitLog)
+        logVersion(newVersion);
+
     return newVersion;
 }
 
-void compile(BlockVersion* version)
+/// Encoder callback for instructions which have operands
+typedef void (*EncodeFn)(
+    BlockVersion* version,
+    Object instr,
+    uint8_t* instrPtr
+);
+
+/// Opcode table entry, associating an opcode name with an encoding
+struct OpcodeEntry
 {
-    //std::cout << "compiling version" << std::endl;
+    /// Name of the opcode in the image format
+    const char* name;
 
-    auto block = version->block;
+    /// Opcode written for instructions without operands
+    Opcode opcode;
 
-    // Get the instructions array
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
+    /// Number of values popped from and pushed on the stack
+    /// Note: the call instruction's effect depends on its operands
+    uint8_t numPops;
+    uint8_t numPushes;
 
-    if (instrs.length() == 0)
-    {
-        throw RunError("empty basic block");
-    }
+    /// Encoder for instructions with operands (may be null)
+    EncodeFn encode;
+};
 
-    // Mark the block start
-    version->startPtr = codeHeapAlloc;
+void encodePush(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache valIC("val");
+    auto val = valIC.getField(instr);
+    writeCode(PUSH);
+    writeCode(val);
+}
 
-    // For each instruction
-    for (size_t i = 0; i < instrs.length(); ++i)
-    {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = (Object)instrVal;
+void encodeDup(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache idxIC("idx");
+    auto idx = (uint16_t)idxIC.getInt32(instr);
+    writeCode(DUP);
+    writeCode(idx);
+}
 
-        static ICache opIC("op");
-        auto op = (std::string)opIC.getStr(instr);
+void encodeGetLocal(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache idxIC("idx");
+    auto idx = (uint16_t)idxIC.getInt32(instr);
+    writeCode(GET_LOCAL);
+    writeCode(idx);
+}
 
-        //std::cout << "op: " << op << std::endl;
+void encodeSetLocal(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache idxIC("idx");
+    auto idx = (uint16_t)idxIC.getInt32(instr);
+    writeCode(SET_LOCAL);
+    writeCode(idx);
+}
 
-        // Store a pointer to the current instruction
-        auto instrPtr = codeHeapAlloc;
+void encodeHasTag(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache tagIC("tag");
+    auto tagStr = (std::string)tagIC.getStr(instr);
+    auto tag = strToTag(tagStr);
 
-        if (op == "push")
-        {
-            static ICache valIC("val");
-            auto val = valIC.getField(instr);
-            writeCode(PUSH);
-            writeCode(val);
-            continue;
-        }
+    writeCode(HAS_TAG);
+    writeCode(tag);
+}
 
-        if (op == "pop")
-        {
-            writeCode(POP);
-            continue;
-        }
+void encodeJump(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache toIC("to");
+    auto dstBB = toIC.getObj(instr);
+    auto dstVer = getBlockVersion(version->fun, dstBB);
 
-        if (op == "dup")
-        {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(DUP);
-            writeCode(idx);
-            continue;
-        }
+    auto opPtr = (Opcode*)codeHeapAlloc;
+    writeCode(JUMP_STUB);
 
-        if (op == "swap")
-        {
-            writeCode(SWAP);
-            continue;
-        }
+    if (aotState)
+        aotState->stubs.push_back({ opPtr, (uint8_t**)codeHeapAlloc, dstVer });
 
-        if (op == "get_local")
-        {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(GET_LOCAL);
-            writeCode(idx);
-            continue;
-        }
+    writeCode(dstVer);
+}
 
-        if (op == "set_local")
-        {
-            static ICache idxIC("idx");
-            auto idx = (uint16_t)idxIC.getInt32(instr);
-            writeCode(SET_LOCAL);
-            writeCode(idx);
-            continue;
-        }
+void encodeIfTrue(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    static ICache thenIC("then");
+    static ICache elseIC("else");
+    auto thenBB = thenIC.getObj(instr);
+    auto elseBB = elseIC.getObj(instr);
 
-        //
-        // Integer operations
-        //
+    auto thenVer = getBlockVersion(version->fun, thenBB);
+    auto elseVer = getBlockVersion(version->fun, elseBB);
 
-        if (op == "add_i32")
-        {
-            writeCode(ADD_I32);
-            continue;
-        }
+    if (countingBlocks)
+    {
+        writeCode(COUNT_BRANCH);
+        writeCode(version);
+    }
 
-        if (op == "sub_i32")
-        {
-            writeCode(SUB_I32);
-            continue;
-        }
+    writeCode(IF_TRUE);
 
-        if (op == "mul_i32")
-        {
-            writeCode(MUL_I32);
-            continue;
-        }
+    if (aotState)
+    {
+        auto addrPtr = (uint8_t**)codeHeapAlloc;
+        aotState->stubs.push_back({ nullptr, addrPtr, thenVer });
+        aotState->stubs.push_back({ nullptr, addrPtr + 1, elseVer });
+    }
 
-        if (op == "div_i32")
-        {
-            writeCode(DIV_I32);
-            continue;
-        }
+    writeCode(thenVer);
+    writeCode(elseVer);
+}
 
-        if (op == "mod_i32")
-        {
-            writeCode(MOD_I32);
-            continue;
-        }
+void encodeCall(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    // Store a mapping of this instruction to the block version
+    instrMap[instrPtr] = version;
 
-        if (op == "lt_i32")
-        {
-            writeCode(LT_I32);
-            continue;
-        }
+    static ICache numArgsCache("num_args");
+    auto numArgs = (int16_t)numArgsCache.getInt32(instr);
 
-        if (op == "le_i32")
-        {
-            writeCode(LE_I32);
-            continue;
-        }
+    // Get a version for the call continuation block
+    static ICache retToCache("ret_to");
+    auto retToBB = retToCache.getObj(instr);
+    auto retVer = getBlockVersion(version->fun, retToBB);
 
-        if (op == "gt_i32")
-        {
-            writeCode(GT_I32);
-            continue;
-        }
+    RetEntry retEntry;
+    retEntry.retVer = retVer;
 
-        if (op == "ge_i32")
+    static ICache throwIC("throw_to");
+    Value throwVal;
+    if (throwIC.tryGetField(instr, throwVal))
+    {
+        // Get a version for the exception catch block
+        if (!throwVal.isObject())
         {
-            writeCode(GE_I32);
-            continue;
+            throw RunError("throw_to must be a block object");
         }
 
-        if (op == "eq_i32")
-        {
-            writeCode(EQ_I32);
-            continue;
-        }
+        auto throwVer = getBlockVersion(version->fun, Object(throwVal));
+        retEntry.excVer = throwVer;
+    }
 
-        //
-        // Floating-point ops
-        //
+    // Create an entry for the return address
+    retAddrMap[retVer] = retEntry;
 
-        if (op == "add_f32")
-        {
-            writeCode(ADD_F32);
-            continue;
-        }
+    writeCode(CALL);
+    writeCode(numArgs);
+    writeCode(retVer);
+}
 
-        if (op == "sub_f32")
-        {
-            writeCode(SUB_F32);
-            continue;
-        }
+void encodeThrow(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    // Store a mapping of this instruction to the block version
+    // Needed to retrieve the identity of the current function
+    instrMap[instrPtr] = version;
 
-        if (op == "mul_f32")
-        {
-            writeCode(MUL_F32);
-            continue;
-        }
+    writeCode(THROW);
+}
 
-        if (op == "div_f32")
-        {
-            writeCode(DIV_F32);
-            continue;
-        }
+void encodeAbort(BlockVersion* version, Object instr, uint8_t* instrPtr)
+{
+    // Store a mapping of this instruction to the block version
+    // Needed to retrieve the source code position
+    instrMap[instrPtr] = version;
 
-        if (op == "lt_f32")
-        {
-            writeCode(LT_F32);
-            continue;
-        }
+    writeCode(ABORT);
+}
 
-        if (op == "le_f32")
-        {
-            writeCode(LE_F32);
-            continue;
-        }
+/// Table of all opcodes accepted in image files
+const OpcodeEntry opcodeEntries[] =
+{
+    { "push", PUSH, 0, 1, encodePush },
+    { "pop", POP, 1, 0, nullptr },
+    { "dup", DUP, 0, 1, encodeDup },
+    { "swap", SWAP, 2, 2, nullptr },
+    { "get_local", GET_LOCAL, 0, 1, encodeGetLocal },
+    { "set_local", SET_LOCAL, 1, 0, encodeSetLocal },
+
+    // Integer operations
+    { "add_i32", ADD_I32, 2, 1, nullptr },
+    { "sub_i32", SUB_I32, 2, 1, nullptr },
+    { "mul_i32", MUL_I32, 2, 1, nullptr },
+    { "div_i32", DIV_I32, 2, 1, nullptr },
+    { "mod_i32", MOD_I32, 2, 1, nullptr },
+    { "lt_i32", LT_I32, 2, 1, nullptr },
+    { "le_i32", LE_I32, 2, 1, nullptr },
+    { "gt_i32", GT_I32, 2, 1, nullptr },
+    { "ge_i32", GE_I32, 2, 1, nullptr },
+    { "eq_i32", EQ_I32, 2, 1, nullptr },
+
+    // Floating-point ops
+    { "add_f32", ADD_F32, 2, 1, nullptr },
+    { "sub_f32", SUB_F32, 2, 1, nullptr },
+    { "mul_f32", MUL_F32, 2, 1, nullptr },
+    { "div_f32", DIV_F32, 2, 1, nullptr },
+    { "lt_f32", LT_F32, 2, 1, nullptr },
+    { "le_f32", LE_F32, 2, 1, nullptr },
+    { "gt_f32", GT_F32, 2, 1, nullptr },
+    { "ge_f32", GE_F32, 2, 1, nullptr },
+    { "eq_f32", EQ_F32, 2, 1, nullptr },
+    { "sin_f32", SIN_F32, 1, 1, nullptr },
+    { "cos_f32", COS_F32, 1, 1, nullptr },
+    { "sqrt_f32", SQRT_F32, 1, 1, nullptr },
+
+    // Conversion ops
+    { "i32_to_f32", I32_TO_F32, 1, 1, nullptr },
+    { "f32_to_i32", F32_TO_I32, 1, 1, nullptr },
+    { "f32_to_str", F32_TO_STR, 1, 1, nullptr },
+    { "str_to_f32", STR_TO_F32, 1, 1, nullptr },
+
+    // Miscellaneous ops
+    { "eq_bool", EQ_BOOL, 2, 1, nullptr },
+    { "has_tag", HAS_TAG, 1, 1, encodeHasTag },
 
-        if (op == "gt_f32")
-        {
-            writeCode(GT_F32);
-            continue;
-        }
+    // String operations
+    { "str_len", STR_LEN, 1, 1, nullptr },
+    { "get_char", GET_CHAR, 2, 1, nullptr },
+    { "get_char_code", GET_CHAR_CODE, 2, 1, nullptr },
+    { "char_to_str", CHAR_TO_STR, 1, 1, nullptr },
+    { "str_cat", STR_CAT, 2, 1, nullptr },
+    { "eq_str", EQ_STR, 2, 1, nullptr },
 
-        if (op == "ge_f32")
-        {
-            writeCode(GE_F32);
-            continue;
-        }
+    // Object operations
+    { "new_object", NEW_OBJECT, 1, 1, nullptr },
+    { "has_field", HAS_FIELD, 2, 1, nullptr },
+    { "set_field", SET_FIELD, 3, 0, nullptr },
+    { "get_field", GET_FIELD, 2, 1, nullptr },
+    { "get_field_list", GET_FIELD_LIST, 1, 1, nullptr },
+    { "eq_obj", EQ_OBJ, 2, 1, nullptr },
 
-        if (op == "eq_f32")
-        {
-            writeCode(EQ_F32);
-            continue;
-        }
+    // Array operations
+    { "new_array", NEW_ARRAY, 1, 1, nullptr },
+    { "array_len", ARRAY_LEN, 1, 1, nullptr },
+    { "array_push", ARRAY_PUSH, 2, 0, nullptr },
+    { "set_elem", SET_ELEM, 3, 0, nullptr },
+    { "get_elem", GET_ELEM, 2, 1, nullptr },
 
-        if (op == "sin_f32")
-        {
-            writeCode(SIN_F32);
-            continue;
-        }
+    // Branch instructions
+    { "jump", JUMP_STUB, 0, 0, encodeJump },
+    { "if_true", IF_TRUE, 1, 0, encodeIfTrue },
+    { "call", CALL, 0, 0, encodeCall },
+    { "ret", RET, 1, 0, nullptr },
+    { "throw", THROW, 1, 0, encodeThrow },
+
+    { "import", IMPORT, 1, 1, nullptr },
+    { "abort", ABORT, 1, 0, encodeAbort },
+};
 
-        if (op == "cos_f32")
-        {
-            writeCode(COS_F32);
-            continue;
-        }
+/// Perfect hash table mapping opcode names to table entries
+/// Note: the table size is chosen at initialization so that
+///       no two opcode names collide
+std::vector<const OpcodeEntry*> opcodeTable;
 
-        if (op == "sqrt_f32")
-        {
-            writeCode(SQRT_F32);
-            continue;
-        }
+/// FNV-1a hash of an opcode name
+uint32_t hashOpName(const char* str)
+{
+    uint32_t hash = 2166136261u;
 
-        //
-        // Conversion ops
-        //
+    for (; *str != '\0'; ++str)
+    {
+        hash ^= (uint8_t)*str;
+        hash *= 16777619u;
+    }
 
-        if (op == "i32_to_f32")
-        {
-            writeCode(I32_TO_F32);
-            continue;
-        }
+    return hash;
+}
 
-        if (op == "f32_to_i32")
-        {
-            writeCode(F32_TO_I32);
-            continue;
-        }
+/// Build the opcode name hash table
+void initOpcodeTable()
+{
+    auto numEntries = sizeof(opcodeEntries) / sizeof(opcodeEntries[0]);
 
-        if (op == "f32_to_str")
-        {
-            writeCode(F32_TO_STR);
-            continue;
-        }
+    // Grow the table until there are no collisions
+    for (size_t size = 64;; size *= 2)
+    {
+        opcodeTable.assign(size, nullptr);
+        bool collision = false;
 
-        if (op == "str_to_f32")
+        for (size_t i = 0; i < numEntries; ++i)
         {
-            writeCode(STR_TO_F32);
-            continue;
-        }
+            auto hash = hashOpName(opcodeEntries[i].name);
+            auto& slot = opcodeTable[hash & (size - 1)];
 
-        //
-        // Miscellaneous ops
-        //
+            if (slot != nullptr)
+            {
+                collision = true;
+                break;
+            }
 
-        if (op == "eq_bool")
-        {
-            writeCode(EQ_BOOL);
-            continue;
+            slot = &opcodeEntries[i];
         }
 
-        if (op == "has_tag")
-        {
-            static ICache tagIC("tag");
-            auto tagStr = (std::string)tagIC.getStr(instr);
-            auto tag = strToTag(tagStr);
+        if (!collision)
+            break;
+    }
+}
 
-            writeCode(HAS_TAG);
-            writeCode(tag);
-            continue;
-        }
+/// Find the table entry for an opcode name, null if not found
+const OpcodeEntry* lookupOpcode(String opName)
+{
+    assert (opcodeTable.size() > 0);
 
-        //
-        // String operations
-        //
+    auto nameStr = opName.getDataPtr();
+    auto hash = hashOpName(nameStr);
+    auto entry = opcodeTable[hash & (opcodeTable.size() - 1)];
 
-        if (op == "str_len")
-        {
-            writeCode(STR_LEN);
-            continue;
-        }
+    if (entry && strcmp(entry->name, nameStr) == 0)
+        return entry;
 
-        if (op == "get_char")
-        {
-            writeCode(GET_CHAR);
-            continue;
-        }
+    return nullptr;
+}
 
-        if (op == "get_char_code")
-        {
-            writeCode(GET_CHAR_CODE);
-            continue;
-        }
+/// Get the name of an opcode for profile reports and code dumps
+std::string opName(size_t op)
+{
+    if (op == JUMP)
+        return "jump";
+    if (op == JUMP_STUB)
+        return "jump_stub";
+    if (op == COUNT_BLOCK)
+        return "count_block";
+    if (op == COUNT_BRANCH)
+        return "count_branch";
+
+    for (auto& entry : opcodeEntries)
+    {
+        if (entry.opcode == op)
+            return entry.name;
+    }
 
-        if (op == "char_to_str")
-        {
-            writeCode(CHAR_TO_STR);
-            continue;
-        }
+    return "op_" + std::to_string(op);
+}
 
-        if (op == "str_cat")
-        {
-            writeCode(STR_CAT);
-            continue;
-        }
+/// Number of functions checked by the verifier
+size_t numFunsVerified = 0;
+
+/**
+Verify the block graph of a function before it gets executed
+This checks that the operand stack depth is consistent at block
+boundaries, that local variable indices are within bounds and that
+branch targets are blocks. Returns the maximum operand stack depth
+reached by the function.
+*/
+size_t verifyFun(Object fun, Object entryBlock, int32_t numLocals)
+{
+    std::string funName = "<anonymous>";
+    static ICache nameIC("name");
+    Value nameVal;
+    if (nameIC.tryGetField(fun, nameVal) && nameVal.isString())
+        funName = (std::string)nameVal;
 
-        if (op == "eq_str")
-        {
-            writeCode(EQ_STR);
-            continue;
-        }
+    auto verifyError = [&funName](std::string msg)
+    {
+        throw RunError(
+            "verification failed in function \"" + funName + "\", " + msg
+        );
+    };
 
-        //
-        // Object operations
-        //
+    // Stack depth at the entry of each block
+    std::unordered_map<refptr, size_t> entryDepths;
 
-        if (op == "new_object")
-        {
-            writeCode(NEW_OBJECT);
-            continue;
-        }
+    // Blocks left to verify, with their entry stack depth
+    std::vector<std::pair<Object, size_t>> workList;
 
-        if (op == "has_field")
-        {
-            writeCode(HAS_FIELD);
-            continue;
-        }
+    size_t maxDepth = 0;
 
-        if (op == "set_field")
-        {
-            writeCode(SET_FIELD);
-            continue;
-        }
+    // Queue a branch target, checking that its entry depth is consistent
+    auto addTarget = [&](Value target, size_t depth)
+    {
+        if (!target.isObject())
+            verifyError("branch target is not a block object");
+
+        auto itr = entryDepths.find((refptr)target);
 
-        if (op == "get_field")
+        if (itr == entryDepths.end())
         {
-            writeCode(GET_FIELD);
-            continue;
+            entryDepths[(refptr)target] = depth;
+            workList.push_back({ Object(target), depth });
         }
-
-        if (op == "get_field_list")
+        else if (itr->second != depth)
         {
-            writeCode(GET_FIELD_LIST);
-            continue;
+            verifyError(
+                "inconsistent stack depth at block entry, " +
+                std::to_string(itr->second) + " and " +
+                std::to_string(depth)
+            );
         }
+    };
 
-        //
-        // Array operations
-        //
+    // Read an integer operand and check its range
+    auto getIntOperand = [&](Object instr, const char* name, int32_t max)
+    {
+        if (!instr.hasField(name) || !instr.getField(name).isInt32())
+            verifyError(std::string("missing int32 operand \"") + name + "\"");
 
-        if (op == "new_array")
-        {
-            writeCode(NEW_ARRAY);
-            continue;
-        }
+        auto val = (int32_t)instr.getField(name);
 
-        if (op == "array_len")
-        {
-            writeCode(ARRAY_LEN);
-            continue;
-        }
+        if (val < 0 || val >= max)
+            verifyError(std::string("operand \"") + name + "\" out of range");
 
-        if (op == "array_push")
-        {
-            writeCode(ARRAY_PUSH);
-            continue;
-        }
+        return val;
+    };
 
-        if (op == "set_elem")
-        {
-            writeCode(SET_ELEM);
-            continue;
-        }
+    addTarget(entryBlock, 0);
 
-        if (op == "get_elem")
-        {
-            writeCode(GET_ELEM);
-            continue;
-        }
+    while (!workList.empty())
+    {
+        auto block = workList.back().first;
+        auto depth = workList.back().second;
+        workList.pop_back();
 
-        if (op == "eq_obj")
-        {
-            writeCode(EQ_OBJ);
-            continue;
-        }
+        static ICache instrsIC("instrs");
+        Value instrsVal;
+        if (!instrsIC.tryGetField(block, instrsVal) || !instrsVal.isArray())
+            verifyError("block without instrs array");
 
-        //
-        // Branch instructions
-        //
+        auto instrs = Array(instrsVal);
+        bool terminated = false;
 
-        if (op == "jump")
+        // Code following a branch instruction is unreachable,
+        // so we stop verifying a block at its first branch
+        for (size_t i = 0; i < instrs.length() && !terminated; ++i)
         {
-            static ICache toIC("to");
-            auto dstBB = toIC.getObj(instr);
-            auto dstVer = getBlockVersion(version->fun, dstBB);
+            auto instrVal = instrs.getElem(i);
+            if (!instrVal.isObject())
+                verifyError("instruction is not an object");
+            auto instr = Object(instrVal);
+
+            static ICache opIC("op");
+            Value opVal;
+            if (!opIC.tryGetField(instr, opVal) || !opVal.isString())
+                verifyError("instruction without op field");
+
+            auto entry = lookupOpcode(opVal);
+            if (!entry)
+            {
+                verifyError(
+                    "unhandled opcode \"" + (std::string)opVal + "\""
+                );
+            }
 
-            writeCode(JUMP_STUB);
-            writeCode(dstVer);
-            continue;
-        }
+            if (depth < entry->numPops)
+            {
+                verifyError(
+                    "stack underflow at \"" + std::string(entry->name) + "\""
+                );
+            }
 
-        if (op == "if_true")
-        {
-            static ICache thenIC("then");
-            static ICache elseIC("else");
-            auto thenBB = thenIC.getObj(instr);
-            auto elseBB = elseIC.getObj(instr);
+            switch (entry->opcode)
+            {
+                case PUSH:
+                if (!instr.hasField("val"))
+                    verifyError("push without val operand");
+                break;
+
+                case DUP:
+                getIntOperand(instr, "idx", depth);
+                break;
+
+                case GET_LOCAL:
+                case SET_LOCAL:
+                getIntOperand(instr, "idx", numLocals);
+                break;
+
+                case HAS_TAG:
+                if (!instr.hasField("tag") || !instr.getField("tag").isString())
+                    verifyError("has_tag without tag operand");
+                strToTag(instr.getField("tag"));
+                break;
+
+                case JUMP_STUB:
+                if (!instr.hasField("to"))
+                    verifyError("jump without target");
+                addTarget(instr.getField("to"), depth);
+                terminated = true;
+                break;
+
+                case IF_TRUE:
+                if (!instr.hasField("then") || !instr.hasField("else"))
+                    verifyError("if_true without then and else targets");
+                addTarget(instr.getField("then"), depth - 1);
+                addTarget(instr.getField("else"), depth - 1);
+                terminated = true;
+                break;
+
+                case CALL:
+                {
+                    // Pops the callee and arguments, pushes the return value
+                    auto numArgs = getIntOperand(instr, "num_args", depth);
+                    if (!instr.hasField("ret_to"))
+                        verifyError("call without ret_to target");
+                    addTarget(instr.getField("ret_to"), depth - numArgs);
+                    if (instr.hasField("throw_to"))
+                        addTarget(instr.getField("throw_to"), depth - numArgs);
+                    terminated = true;
+                }
+                break;
+
+                case RET:
+                // The return value must be the only value on the stack,
+                // since the saved frame values are popped after it
+                if (depth != 1)
+                {
+                    verifyError(
+                        "stack depth at ret is " + std::to_string(depth) +
+                        ", expected 1"
+                    );
+                }
+                terminated = true;
+                break;
 
-            auto thenVer = getBlockVersion(version->fun, thenBB);
-            auto elseVer = getBlockVersion(version->fun, elseBB);
+                case THROW:
+                case ABORT:
+                terminated = true;
+                break;
 
-            writeCode(IF_TRUE);
-            writeCode(thenVer);
-            writeCode(elseVer);
+                default:
+                break;
+            }
 
-            continue;
+            depth = depth - entry->numPops + entry->numPushes;
+            maxDepth = std::max(maxDepth, depth);
         }
 
-        if (op == "call")
-        {
-            // Store a mapping of this instruction to the block version
-            instrMap[instrPtr] = version;
+        if (!terminated)
+            verifyError("block does not end with a branch instruction");
+    }
 
-            static ICache numArgsCache("num_args");
-            auto numArgs = (int16_t)numArgsCache.getInt32(instr);
+    numFunsVerified++;
 
-            // Get a version for the call continuation block
-            static ICache retToCache("ret_to");
-            auto retToBB = retToCache.getObj(instr);
-            auto retVer = getBlockVersion(version->fun, retToBB);
+    return maxDepth;
+}
 
-            RetEntry retEntry;
-            retEntry.retVer = retVer;
+/// Verify a function if needed, and get its maximum stack depth
+size_t getMaxStackDepth(Object fun, Object entryBlock, int32_t numLocals)
+{
+    auto& blockInfo = getBlockInfo(entryBlock);
 
-            if (instr.hasField("throw_to"))
-            {
-                // Get a version for the exception catch block
-                static ICache throwIC("throw_to");
-                auto throwBB = throwIC.getObj(instr);
-                auto throwVer = getBlockVersion(version->fun, throwBB);
-                retEntry.excVer = throwVer;
-            }
+    // Verification results are cached on the entry block, so that
+    // closures sharing the same code are only verified once
+    if (blockInfo.verifiedLocals != numLocals)
+    {
+        blockInfo.maxStackDepth = verifyFun(fun, entryBlock, numLocals);
+        blockInfo.verifiedLocals = numLocals;
+    }
 
-            // Create an entry for the return address
-            retAddrMap[retVer] = retEntry;
+    return blockInfo.maxStackDepth;
+}
 
-            writeCode(CALL);
-            writeCode(numArgs);
-            writeCode(retVer);
+/// Check that there is enough stack space for a call
+inline __attribute__((always_inline)) void checkStackSpace(size_t numSlots)
+{
+    if ((size_t)(stackPtr - stackLimit) < numSlots)
+    {
+        throw RunError("stack overflow");
+    }
+}
 
-            continue;
-        }
+/// Offset of a code address in the code heap, for logs and dumps
+size_t heapOffset(uint8_t* addr)
+{
+    return addr - codeHeap;
+}
 
-        if (op == "ret")
-        {
-            writeCode(RET);
-            continue;
-        }
+/// Log the creation of a block version
+void logVersion(BlockVersion* version)
+{
+    fprintf(
+        jitLog,
+        "{\"event\": \"version\", \"id\": %zu, \"fun\": \"%s\", \"block\": %u}\n",
+        version->id,
+        profFunName(version->fun).c_str(),
+        version->block.getAuxIdx()
+    );
+}
 
-        if (op == "throw")
-        {
-            // Store a mapping of this instruction to the block version
-            // Needed to retrieve the identity of the current function
-            instrMap[instrPtr] = version;
+/// Log the compilation of a block version
+void logCompile(BlockVersion* version, size_t numInstrs, double seconds)
+{
+    fprintf(
+        jitLog,
+        "{\"event\": \"compile\", \"id\": %zu, \"fun\": \"%s\", "
+        "\"offset\": %zu, \"bytes\": %zu, \"instrs\": %zu, \"us\": %.1f}\n",
+        version->id,
+        profFunName(version->fun).c_str(),
+        heapOffset(version->startPtr),
+        version->length(),
+        numInstrs,
+        seconds * 1e6
+    );
+}
 
-            writeCode(THROW);
-            continue;
-        }
+/**
+Log a branch patched to point to compiled code. The kind is "jump"
+for jump stubs, "then" or "else" for if_true targets, and "branch"
+for if_true targets patched ahead of time.
+*/
+void logPatch(const char* kind, void* slot, BlockVersion* target)
+{
+    fprintf(
+        jitLog,
+        "{\"event\": \"patch\", \"kind\": \"%s\", \"at\": %zu, \"target\": %zu}\n",
+        kind,
+        heapOffset((uint8_t*)slot),
+        target->id
+    );
+}
+
+/// Log a jump dropped so that its target is written in its place
+void logElide(uint8_t* jumpPtr, BlockVersion* target)
+{
+    fprintf(
+        jitLog,
+        "{\"event\": \"elide\", \"at\": %zu, \"target\": %zu}\n",
+        heapOffset(jumpPtr),
+        target->id
+    );
+}
+
+/// Total number of instructions compiled
+size_t numInstrsCompiled = 0;
+
+/// Total time spent compiling, in seconds
+double compileTime = 0;
+
+/// Whether compile times are measured, off by default to keep the
+/// clock reads out of the compile path
+bool timingCompile = false;
+
+void enableCompileTiming()
+{
+    timingCompile = true;
+}
+
+double getCompileTime()
+{
+    return compileTime;
+}
+
+void compile(BlockVersion* version)
+{
+    //std::cout << "compiling version" << std::endl;
+
+    std::chrono::steady_clock::time_point startTime;
+    if (timingCompile || jitLog)
+        startTime = std::chrono::steady_clock::now();
+
+    auto block = version->block;
 
-        if (op == "import")
+    // Get the instructions array
+    static ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+
+    if (instrs.length() == 0)
+    {
+        throw RunError("empty basic block");
+    }
+
+    // Mark the block start
+    version->startPtr = codeHeapAlloc;
+
+    if (countingBlocks)
+    {
+        writeCode(COUNT_BLOCK);
+        writeCode(version);
+    }
+
+    // For each instruction
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        auto instrVal = instrs.getElem(i);
+        assert (instrVal.isObject());
+        auto instr = (Object)instrVal;
+
+        static ICache opIC("op");
+        auto op = opIC.getStr(instr);
+
+        //std::cout << "op: " << op << std::endl;
+
+        // Store a pointer to the current instruction
+        auto instrPtr = codeHeapAlloc;
+
+        // Record the source position of the instruction, if present
+        static ICache srcPosIC("src_pos");
+        Value srcPos;
+        if (srcPosIC.tryGetField(instr, srcPos) && srcPos.isObject())
         {
-            writeCode(IMPORT);
-            continue;
+            version->srcPosTable.push_back({
+                (uint32_t)(instrPtr - version->startPtr),
+                packSrcPos(srcPos)
+            });
         }
 
-        if (op == "abort")
-        {
-            // Store a mapping of this instruction to the block version
-            // Needed to retrieve the source code position
-            instrMap[instrPtr] = version;
+        auto entry = lookupOpcode(op);
 
-            writeCode(ABORT);
-            continue;
+        if (!entry)
+        {
+            throw RunError(
+                "unhandled opcode in basic block \"" +
+                (std::string)op + "\""
+            );
         }
 
-        throw RunError("unhandled opcode in basic block \"" + op + "\"");
+        if (entry->encode)
+            entry->encode(version, instr, instrPtr);
+        else
+            writeCode(entry->opcode);
     }
 
     // Mark the block end
     version->endPtr = codeHeapAlloc;
+    codeVersions[version->startPtr] = version;
+
+    numInstrsCompiled += instrs.length();
+
+    if (timingCompile || jitLog)
+    {
+        std::chrono::duration<double> deltaTime =
+            std::chrono::steady_clock::now() - startTime;
+        compileTime += deltaTime.count();
+
+        if (jitLog)
+            logCompile(version, instrs.length(), deltaTime.count());
+    }
 
     //std::cout << "done compiling version" << std::endl;
     //std::cout << codeHeapSize() << std::endl;
 }
 
 /// Get the source position for a given instruction, if available
-Value getSrcPos(uint8_t* instrPtr)
+SrcPos getSrcPos(uint8_t* instrPtr)
 {
     auto itr = instrMap.find(instrPtr);
     if (itr == instrMap.end())
     {
         std::cout << "no instr to block mapping" << std::endl;
-        return Value::UNDEF;
-    }
-
-    auto block = itr->second->block;
-
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
-    assert (instrs.length() > 0);
-
-    // Traverse the instructions in reverse
-    for (int i = (int)instrs.length() - 1; i >= 0; --i)
-    {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = Object(instrVal);
-
-        if (instr.hasField("src_pos"))
-            return instr.getField("src_pos");
+        return SRC_POS_NONE;
     }
 
-    return Value::UNDEF;
+    return itr->second->getSrcPos(instrPtr);
 }
 
-void checkArgCount(
+/// Report an argument count mismatch at a call site
+/// Note: this is kept out of line since it is only called on errors
+__attribute__((noinline)) void argCountError(
     uint8_t* instrPtr,
     size_t numParams,
     size_t numArgs
 )
 {
-    Value srcPos = getSrcPos(instrPtr);
-
-    if (numArgs != numParams)
-    {
-        std::string srcPosStr = (
-            srcPos.isObject()?
-            (posToString(srcPos) + " - "):
-            std::string("")
-        );
-
-        throw RunError(
-            srcPosStr +
-            "incorrect argument count in call, received " +
-            std::to_string(numArgs) +
-            ", expected " +
-            std::to_string(numParams)
-        );
-    }
+    auto srcPos = getSrcPos(instrPtr);
+
+    std::string srcPosStr = (
+        (srcPos != SRC_POS_NONE)?
+        (srcPosToString(srcPos) + " - "):
+        std::string("")
+    );
+
+    throw RunError(
+        srcPosStr +
+        "incorrect argument count in call, received " +
+        std::to_string(numArgs) +
+        ", expected " +
+        std::to_string(numParams)
+    );
 }
 
-/// Perform a user function call
-__attribute__((always_inline)) void funCall(
-    uint8_t* callInstr,
-    Object fun,
-    size_t numArgs,
-    BlockVersion* retVer
-)
+/// Get the entry block of a function
+/// Functions loaded from lazy images get their entry block
+/// materialized on the first call
+Object getEntryBlock(Object fun)
 {
-    // TODO: we could inline cache some function
-    // information
-    // start with map of fn objs to structs
-    // TODO: move callFn into its own function
-
-    // Get a version for the function entry block
     static ICache entryIC("entry");
-    auto entryBB = entryIC.getObj(fun);
-    auto entryVer = getBlockVersion(fun, entryBB);
-
-    if (!entryVer->startPtr)
-    {
-        //std::cout << "compiling function entry block" << std::endl;
-        compile(entryVer);
-    }
-
-    static ICache localsIC("num_locals");
-    auto numLocals = localsIC.getInt32(fun);
-
-    static ICache paramsIC("num_params");
-    auto numParams = paramsIC.getInt32(fun);
+    auto entry = entryIC.getField(fun);
 
-    checkArgCount(callInstr, numParams, numArgs);
-
-    // Note: the hidden function/closure parameter is always present
-    if (numLocals < numParams + 1)
+    if (__builtin_expect(entry.getTag() == TAG_IMGREF, 0))
     {
-        throw RunError(
-            "not enough locals to store function parameters"
-        );
+        entry = resolveLazyRef(entry);
+        fun.setField("entry", entry);
     }
 
-    if (numArgs != numParams)
+    if (!entry.isObject())
     {
-        throw RunError("argument count mismatch");
+        throw RunError("function entry block is not an object");
     }
 
-    // Compute the stack pointer to restore after the call
-    auto prevStackPtr = stackPtr + numArgs;
-
-    // Save the current frame pointer
-    auto prevFramePtr = framePtr;
+    return Object(entry);
+}
 
-    // Point the frame pointer to the first argument
-    assert (stackPtr > stackLimit);
-    framePtr = stackPtr + numArgs - 1;
+/// Number of functions compiled ahead of time
+size_t numFunsPrecompiled = 0;
 
-    // Store the function/pointer argument
-    framePtr[-numArgs] = fun;
+/// Get the blocks a block may branch to, in the order they are named
+void getSuccBlocks(Object block, std::vector<Object>& succs)
+{
+    static ICache targetICs[] = {
+        ICache("to"),
+        ICache("then"),
+        ICache("else"),
+        ICache("ret_to"),
+        ICache("throw_to")
+    };
 
-    // Pop the arguments, push the callee locals
-    stackPtr -= numLocals - numArgs;
+    static ICache instrsIC("instrs");
+    auto instrs = instrsIC.getArr(block);
 
-    pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
-    pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
-    pushVal(Value((refptr)retVer, TAG_RAWPTR));
+    for (size_t i = 0; i < instrs.length(); ++i)
+    {
+        auto instr = Object(instrs.getElem(i));
 
-    // Jump to the entry block of the function
-    instrPtr = entryVer->startPtr;
+        for (auto& targetIC : targetICs)
+        {
+            Value target;
+            if (targetIC.tryGetField(instr, target) && target.isObject())
+                succs.push_back(Object(target));
+        }
+    }
 }
 
-/// Perform a host function call
-__attribute__((always_inline)) void hostCall(
-    uint8_t* callInstr,
-    Value fun,
-    size_t numArgs,
-    BlockVersion* retVer
-)
+/// Find the branch slots of a compiled version which still point
+/// to a stub, ie: branches that were never taken when run lazily
+void findStubs(BlockVersion* version, std::vector<StubRef>& stubs)
 {
-    auto hostFn = (HostFn*)fun.getWord().ptr;
-
-    // Pointer to the first argument
-    auto args = stackPtr + numArgs - 1;
+    auto isStub = [](uint8_t* addr)
+    {
+        return addr < codeHeap || addr >= codeHeapLimit;
+    };
 
-    Value retVal;
+    auto endPtr = versionEnd(version);
 
-    // Call the host function
-    switch (numArgs)
+    for (auto ptr = version->startPtr; ptr < endPtr;)
+    {
+        auto opPtr = (Opcode*)ptr;
+        ptr += sizeof(Opcode);
+
+        switch (*opPtr)
+        {
+            case PUSH:
+            ptr += sizeof(Value);
+            break;
+
+            case DUP:
+            case GET_LOCAL:
+            case SET_LOCAL:
+            ptr += sizeof(uint16_t);
+            break;
+
+            case HAS_TAG:
+            ptr += sizeof(Tag);
+            break;
+
+            case JUMP:
+            ptr += sizeof(uint8_t*);
+            break;
+
+            case JUMP_STUB:
+            {
+                auto addrPtr = (uint8_t**)ptr;
+                stubs.push_back({ opPtr, addrPtr, (BlockVersion*)*addrPtr });
+                ptr += sizeof(uint8_t*);
+            }
+            break;
+
+            case IF_TRUE:
+            for (size_t i = 0; i < 2; ++i)
+            {
+                auto addrPtr = (uint8_t**)ptr;
+                if (isStub(*addrPtr))
+                    stubs.push_back({ nullptr, addrPtr, (BlockVersion*)*addrPtr });
+                ptr += sizeof(uint8_t*);
+            }
+            break;
+
+            case COUNT_BLOCK:
+            case COUNT_BRANCH:
+            ptr += sizeof(BlockVersion*);
+            break;
+
+            case CALL:
+            ptr += sizeof(uint16_t) + sizeof(BlockVersion*);
+            break;
+
+            default:
+            break;
+        }
+    }
+}
+
+/**
+Compile all the blocks of a function ahead of time
+Blocks are laid out contiguously, with a block falling through into
+the target of its final jump when possible. Branches between the
+blocks are patched into direct jumps, so that running the function
+never goes through branch stubs or the compiler.
+*/
+void precompileFun(Object fun)
+{
+    static ICache localsIC("num_locals");
+    auto entryBB = getEntryBlock(fun);
+    getMaxStackDepth(fun, entryBB, localsIC.getInt32(fun));
+
+    AOTState state;
+    aotState = &state;
+
+    std::unordered_set<refptr> queued;
+    std::vector<Object> workList;
+    std::vector<Object> succs;
+
+    queued.insert((refptr)entryBB);
+    workList.push_back(entryBB);
+
+    while (!workList.empty())
+    {
+        auto block = workList.back();
+        workList.pop_back();
+
+        auto version = getBlockVersion(fun, block);
+
+        // Versions already run lazily keep their code, but their
+        // untaken branches still need to be compiled and patched
+        auto compiled = version->startPtr != nullptr;
+
+        auto numStubs = state.stubs.size();
+        if (compiled)
+            findStubs(version, state.stubs);
+        else
+            compile(version);
+
+        // If the block ends with a jump to a block that isn't compiled
+        // yet, drop the jump and compile the target right after
+        BlockVersion* fallVer = nullptr;
+        if (!compiled && state.stubs.size() > numStubs)
+        {
+            auto& last = state.stubs.back();
+            if (last.op &&
+                (uint8_t*)(last.addr + 1) == codeHeapAlloc &&
+                !last.target->startPtr)
+            {
+                fallVer = last.target;
+                codeHeapAlloc = (uint8_t*)last.op;
+                version->endPtr = codeHeapAlloc;
+                state.stubs.pop_back();
+
+                numJumpsElided++;
+                if (jitLog)
+                    logElide(codeHeapAlloc, fallVer);
+            }
+        }
+
+        succs.clear();
+        getSuccBlocks(block, succs);
+        for (auto itr = succs.rbegin(); itr != succs.rend(); ++itr)
+        {
+            if (queued.insert((refptr)*itr).second)
+                workList.push_back(*itr);
+        }
+
+        if (fallVer)
+            workList.push_back(fallVer->block);
+    }
+
+    aotState = nullptr;
+
+    for (auto& stub : state.stubs)
+    {
+        assert (stub.target->startPtr);
+        *stub.addr = stub.target->startPtr;
+        if (stub.op)
+            *stub.op = JUMP;
+
+        numStubsPatched++;
+        if (jitLog)
+            logPatch(stub.op? "jump":"branch", stub.addr, stub.target);
+    }
+
+    numFunsPrecompiled++;
+}
+
+/// Compile all functions reachable from a package ahead of time
+/// Functions which fail verification are left to fail when called
+void precompileAll(Object pkg)
+{
+    static ICache entryIC("entry");
+    static ICache localsIC("num_locals");
+
+    std::unordered_set<refptr> visited;
+    std::vector<Value> stack;
+    stack.push_back(pkg);
+
+    while (!stack.empty())
+    {
+        auto val = stack.back();
+        stack.pop_back();
+
+        if (!val.isObject() && !val.isArray())
+            continue;
+        if (!visited.insert((refptr)val).second)
+            continue;
+
+        if (val.isArray())
+        {
+            auto arr = Array(val);
+            for (size_t i = 0; i < arr.length(); ++i)
+                stack.push_back(arr.getElem(i));
+            continue;
+        }
+
+        auto obj = Object(val);
+        for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
+        {
+            auto fieldName = itr.get();
+            auto fieldVal = obj.getField(fieldName);
+
+            // Lazily loaded definitions are materialized, since all
+            // of their code is about to be compiled anyway
+            if (fieldVal.getTag() == TAG_IMGREF &&
+                ImgRef(fieldVal).getImgIdx() != 0)
+            {
+                fieldVal = resolveLazyRef(fieldVal);
+                obj.setField(fieldName, fieldVal);
+            }
+
+            stack.push_back(fieldVal);
+        }
+
+        // Function objects are recognized by their entry block
+        Value entry, numLocals;
+        if (!entryIC.tryGetField(obj, entry) ||
+            !localsIC.tryGetField(obj, numLocals) || !numLocals.isInt32())
+            continue;
+
+        try
+        {
+            precompileFun(obj);
+        }
+
+        catch (RunError& e)
+        {
+            aotState = nullptr;
+        }
+    }
+}
+
+/// Perform a user function call
+__attribute__((always_inline)) void funCall(
+    uint8_t* callInstr,
+    Object fun,
+    size_t numArgs,
+    BlockVersion* retVer
+)
+{
+    // TODO: we could inline cache some function
+    // information
+    // start with map of fn objs to structs
+    // TODO: move callFn into its own function
+
+    // Get a version for the function entry block
+    auto entryBB = getEntryBlock(fun);
+    auto entryVer = getBlockVersion(fun, entryBB);
+
+    static ICache localsIC("num_locals");
+    auto numLocals = localsIC.getInt32(fun);
+
+    static ICache paramsIC("num_params");
+    auto numParams = paramsIC.getInt32(fun);
+
+    if (numArgs != numParams)
+    {
+        argCountError(callInstr, numParams, numArgs);
+    }
+
+    // Note: the hidden function/closure parameter is always present
+    if (numLocals < numParams + 1)
+    {
+        throw RunError(
+            "not enough locals to store function parameters"
+        );
+    }
+
+    // Verify the function before its first execution
+    auto maxDepth = getMaxStackDepth(fun, entryBB, numLocals);
+
+    // Check for stack space once for the whole call, the verified
+    // code then runs without per-instruction bounds checks
+    checkStackSpace(numLocals - numArgs + 3 + maxDepth);
+
+    if (!entryVer->startPtr)
+    {
+        //std::cout << "compiling function entry block" << std::endl;
+        compile(entryVer);
+    }
+
+    // Compute the stack pointer to restore after the call
+    auto prevStackPtr = stackPtr + numArgs;
+
+    // Save the current frame pointer
+    auto prevFramePtr = framePtr;
+
+    // Point the frame pointer to the first argument
+    framePtr = stackPtr + numArgs - 1;
+
+    // Store the function/pointer argument
+    framePtr[-numArgs] = fun;
+
+    // Pop the arguments, push the callee locals
+    stackPtr -= numLocals - numArgs;
+
+    pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
+    pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
+    pushVal(Value((refptr)retVer, TAG_RAWPTR));
+
+    // Jump to the entry block of the function
+    instrPtr = entryVer->startPtr;
+}
+
+/// Perform a host function call
+__attribute__((always_inline)) void hostCall(
+    uint8_t* callInstr,
+    Value fun,
+    size_t numArgs,
+    BlockVersion* retVer
+)
+{
+    auto hostFn = (HostFn*)fun.getWord().ptr;
+
+    // Pointer to the first argument
+    auto args = stackPtr + numArgs - 1;
+
+    Value retVal;
+
+    // Call the host function
+    switch (numArgs)
     {
         case 0:
         retVal = hostFn->call0();
@@ -1150,818 +1786,2460 @@ void throwExc(
     }
 }
 
-/// Start/continue execution beginning at a current instruction
-Value execCode()
-{
-    assert (instrPtr >= codeHeap);
-    assert (instrPtr < codeHeapLimit);
+/// Set by the SIGPROF handler to request a profile sample
+/// Note: samples are taken by the interpreter at branch instructions,
+///       where the stack and frame pointers are consistent
+volatile sig_atomic_t profSampleReq = 0;
 
-    // For each instruction to execute
-    for (;;)
-    {
-        auto& op = readCode<Opcode>();
+/// Profile sample counts per folded guest stack
+std::unordered_map<std::string, size_t> profSamples;
 
-        //std::cout << "instr" << std::endl;
-        //std::cout << "op=" << (int)op << std::endl;
-        //std::cout << "  stack space: " << (stackBase - stackPtr) << std::endl;
+/// Profile sampling interval in microseconds
+const long PROF_INTERVAL_US = 1000;
 
-        switch (op)
-        {
-            case PUSH:
-            {
-                auto val = readCode<Value>();
-                pushVal(val);
-            }
-            break;
+/// Find the block version containing a code address
+BlockVersion* findVersion(uint8_t* addr)
+{
+    auto itr = codeVersions.upper_bound(addr);
+    if (itr == codeVersions.begin())
+        return nullptr;
 
-            case POP:
-            {
-                popVal();
-            }
-            break;
+    auto version = (--itr)->second;
+    return (addr < version->endPtr)? version:nullptr;
+}
 
-            case DUP:
-            {
-                // Read the index of the value to duplicate
-                auto idx = readCode<uint16_t>();
-                auto val = stackPtr[idx];
-                pushVal(val);
-            }
-            break;
+/// Get the name of a function for profile stacks
+std::string profFunName(Object fun)
+{
+    static ICache nameIC("name");
+    Value nameVal;
+    if (nameIC.tryGetField(fun, nameVal) && nameVal.isString())
+        return (std::string)nameVal;
+    return "<anonymous>";
+}
 
-            // Swap the topmost two stack elements
-            case SWAP:
-            {
-                auto v0 = popVal();
-                auto v1 = popVal();
-                pushVal(v0);
-                pushVal(v1);
-            }
-            break;
+/// Source positions of functions, for profile samples in versions
+/// without any positioned instruction
+std::unordered_map<refptr, SrcPos> profFunPositions;
 
-            // Set a local variable
-            case SET_LOCAL:
-            {
-                auto localIdx = readCode<uint16_t>();
-                //std::cout << "set localIdx=" << localIdx << std::endl;
-                assert (stackPtr > stackLimit);
-                framePtr[-localIdx] = popVal();
-            }
-            break;
+/// Get the first source position found in the versions of a function
+SrcPos profFunSrcPos(Object fun)
+{
+    auto itr = profFunPositions.find((refptr)fun);
+    if (itr != profFunPositions.end())
+        return itr->second;
 
-            case GET_LOCAL:
-            {
-                // Read the index of the value to push
-                auto localIdx = readCode<uint16_t>();
-                //std::cout << "get localIdx=" << localIdx << std::endl;
-                assert (stackPtr > stackLimit);
-                auto val = framePtr[-localIdx];
-                pushVal(val);
-            }
-            break;
+    BlockVersion* first = nullptr;
+    for (auto& pair : codeVersions)
+    {
+        auto version = pair.second;
+        if (version->fun != fun || version->srcPosTable.empty())
+            continue;
+        if (!first || version->id < first->id)
+            first = version;
+    }
 
-            //
-            // Integer operations
-            //
+    // Versions compiled later may still provide a position
+    if (!first)
+        return SRC_POS_NONE;
 
-            case ADD_I32:
-            {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushVal(Value::int32(arg0 + arg1));
-            }
-            break;
+    auto pos = first->srcPosTable.front().second;
+    profFunPositions[(refptr)fun] = pos;
+    return pos;
+}
+
+/**
+Record the guest stack at an instruction about to execute. The frame
+chain is walked using the saved frame pointers and return versions,
+continuing through host calls into the interpreter frames which made them.
+*/
+__attribute__((noinline)) void takeProfileSample(uint8_t* curInstr)
+{
+    profSampleReq = 0;
+
+    auto version = findVersion(curInstr);
+    if (!version)
+    {
+        profSamples["<unknown>"]++;
+        return;
+    }
+
+    // The innermost frame gets the source position of the nearest
+    // positioned instruction, or else of its function
+    std::vector<std::string> frames;
+    auto leaf = profFunName(version->fun);
+    auto srcPos = version->getSrcPos(curInstr);
+    if (srcPos == SRC_POS_NONE)
+        srcPos = profFunSrcPos(version->fun);
+    if (srcPos != SRC_POS_NONE)
+        leaf += " (" + srcPosToString(srcPos) + ")";
+    frames.push_back(leaf);
+
+    auto fun = version->fun;
+    auto curFramePtr = framePtr;
+
+    for (;;)
+    {
+        static ICache numLocalsIC("num_locals");
+        auto numLocals = numLocalsIC.getInt32(fun);
+
+        auto prevStackPtr = (Value*)curFramePtr[-(numLocals + 0)].getWord().ptr;
+        auto prevFramePtr = (Value*)curFramePtr[-(numLocals + 1)].getWord().ptr;
+        auto retVer = (BlockVersion*)curFramePtr[-(numLocals + 2)].getWord().ptr;
+
+        if (retVer)
+        {
+            fun = retVer->fun;
+        }
+        else
+        {
+            // This frame was entered through callFun, the caller's
+            // instruction pointer was saved above its stack pointer
+            if (!prevFramePtr)
+                break;
+
+            // The saved pointer is past the call instruction
+            auto callerInstr = (uint8_t*)prevStackPtr[0].getWord().ptr;
+            auto callerVer = findVersion(callerInstr - 1);
+            if (!callerVer)
+                break;
+
+            fun = callerVer->fun;
+        }
+
+        frames.push_back(profFunName(fun));
+        curFramePtr = prevFramePtr;
+    }
+
+    std::string stack;
+    for (auto itr = frames.rbegin(); itr != frames.rend(); ++itr)
+    {
+        if (itr != frames.rbegin())
+            stack += ";";
+        stack += *itr;
+    }
+
+    profSamples[stack]++;
+}
+
+/// Set by the SIGUSR1 handler to request a heap snapshot
+volatile sig_atomic_t heapSnapshotReq = 0;
+
+void writeRequestedSnapshot();
+
+/// Take a profile sample or heap snapshot if one was requested
+/// Note: this is checked at the branch instructions ending every block,
+///       which bounds the sampling delay without a check per instruction
+inline __attribute__((always_inline)) void profSafepoint(Opcode* op)
+{
+    if (__builtin_expect(profSampleReq, 0))
+        takeProfileSample((uint8_t*)op);
+
+    if (__builtin_expect(heapSnapshotReq, 0))
+        writeRequestedSnapshot();
+}
+
+/// Start sampling the guest stack on a CPU time interval
+void startProfiler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) { profSampleReq = 1; };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROF_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+/// Stop sampling and write the samples as folded stacks
+void writeProfile(std::string fileName)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    std::vector<std::pair<std::string, size_t>> stacks(
+        profSamples.begin(),
+        profSamples.end()
+    );
+
+    std::sort(
+        stacks.begin(),
+        stacks.end(),
+        [](const std::pair<std::string, size_t>& a,
+           const std::pair<std::string, size_t>& b)
+        {
+            return a.second > b.second;
+        }
+    );
+
+    FILE* file = fopen(fileName.c_str(), "w");
+
+    if (!file)
+    {
+        throw RunError("failed to open file \"" + fileName + "\"");
+    }
+
+    for (auto& stack : stacks)
+    {
+        fprintf(file, "%s %zu\n", stack.first.c_str(), stack.second);
+    }
+
+    fclose(file);
+}
+
+/// Allocation counts attributed to a site
+struct AllocStats
+{
+    size_t count = 0;
+    size_t bytes = 0;
+};
+
+/// Allocation site, a function and the source position of
+/// the allocating instruction
+typedef std::pair<refptr, SrcPos> AllocSite;
+
+struct AllocSiteHash
+{
+    size_t operator () (const AllocSite& site) const
+    {
+        return std::hash<refptr>()(site.first) ^ std::hash<SrcPos>()(site.second);
+    }
+};
+
+/// Allocations per site
+/// Note: allocations made outside of guest code, including those of
+///       image parsing threads, go to the site with a null function
+std::unordered_map<AllocSite, AllocStats, AllocSiteHash> allocSites;
+
+/// Size classes of the allocation histogram, powers of two up to 4KB
+const size_t NUM_SIZE_CLASSES = 10;
+const size_t MIN_SIZE_CLASS_LOG2 = 4;
+
+/// Allocations per tag and size class
+AllocStats allocHistogram[NUM_TAGS][NUM_SIZE_CLASSES];
+
+/// Lock for the allocation profile, allocations may happen
+/// on image parsing threads
+std::mutex allocProfileLock;
+
+/// Thread running the interpreter
+std::thread::id interpThread;
+
+/// Allocation site and size of a heap block
+struct BlockAllocInfo
+{
+    AllocSite site;
+    uint32_t size;
+};
+
+/// Allocation info per heap block, recorded for heap snapshots
+std::unordered_map<refptr, BlockAllocInfo> blockAllocs;
+
+/// Count allocations per site, for --alloc-profile
+bool profilingAllocs = false;
+
+/// Record the site of every heap block, for heap snapshots
+bool trackingAllocs = false;
+
+/// Record an allocation made by the current instruction
+void profileAlloc(refptr ptr, uint32_t size, Tag tag)
+{
+    AllocSite site(nullptr, SRC_POS_NONE);
+
+    if (instrPtr && std::this_thread::get_id() == interpThread)
+    {
+        // The instruction pointer is past the opcode being executed
+        auto version = findVersion(instrPtr - 1);
+        if (version)
+        {
+            site.first = (refptr)version->fun;
+            site.second = version->getSrcPos(instrPtr - 1);
+        }
+    }
+
+    size_t sizeClass = 0;
+    while (sizeClass + 1 < NUM_SIZE_CLASSES &&
+           size > (1u << (MIN_SIZE_CLASS_LOG2 + sizeClass)))
+        sizeClass++;
+
+    std::lock_guard<std::mutex> lock(allocProfileLock);
+
+    if (trackingAllocs)
+    {
+        blockAllocs[ptr] = { site, size };
+    }
+
+    if (!profilingAllocs)
+    {
+        return;
+    }
+
+    auto& siteStats = allocSites[site];
+    siteStats.count++;
+    siteStats.bytes += size;
+
+    auto& classStats = allocHistogram[tag][sizeClass];
+    classStats.count++;
+    classStats.bytes += size;
+}
+
+/// Install the allocation hook while allocations are profiled or tracked
+void updateAllocHook()
+{
+    interpThread = std::this_thread::get_id();
+    vm.allocHook = (profilingAllocs || trackingAllocs)? profileAlloc:nullptr;
+}
+
+/// Start attributing heap allocations to instructions
+void startAllocProfile()
+{
+    profilingAllocs = true;
+    updateAllocHook();
+}
+
+/// Print the top allocation sites and the allocation histogram
+void printAllocProfile(size_t numSites)
+{
+    profilingAllocs = false;
+    updateAllocHook();
+
+    std::vector<std::pair<AllocSite, AllocStats>> sites(
+        allocSites.begin(),
+        allocSites.end()
+    );
+
+    auto siteName = [](AllocSite site)
+    {
+        if (!site.first)
+            return std::string("<outside guest code>");
+
+        auto name = profFunName(Object(Value(site.first, TAG_OBJECT)));
+        if (site.second != SRC_POS_NONE)
+            name += " (" + srcPosToString(site.second) + ")";
+        return name;
+    };
+
+    for (auto byBytes : { true, false })
+    {
+        std::sort(
+            sites.begin(),
+            sites.end(),
+            [byBytes](
+                const std::pair<AllocSite, AllocStats>& a,
+                const std::pair<AllocSite, AllocStats>& b
+            )
+            {
+                return (
+                    byBytes?
+                    (a.second.bytes > b.second.bytes):
+                    (a.second.count > b.second.count)
+                );
+            }
+        );
+
+        std::cout << "top allocation sites by ";
+        std::cout << (byBytes? "bytes":"count") << ":" << std::endl;
+
+        for (size_t i = 0; i < sites.size() && i < numSites; ++i)
+        {
+            std::cout << "  " << siteName(sites[i].first) << ": ";
+            std::cout << sites[i].second.bytes << " bytes, ";
+            std::cout << sites[i].second.count << " allocs" << std::endl;
+        }
+    }
+
+    std::cout << "allocations by tag and size:" << std::endl;
+
+    for (size_t tag = 0; tag < NUM_TAGS; ++tag)
+    {
+        for (size_t sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; ++sizeClass)
+        {
+            auto& stats = allocHistogram[tag][sizeClass];
+            if (stats.count == 0)
+                continue;
+
+            auto limit = 1u << (MIN_SIZE_CLASS_LOG2 + sizeClass);
+            std::cout << "  " << tagToStr(tag);
+            std::cout << ((sizeClass + 1 < NUM_SIZE_CLASSES)? " <= ":" > ");
+            std::cout << ((sizeClass + 1 < NUM_SIZE_CLASSES)? limit:limit / 2);
+            std::cout << ": " << stats.bytes << " bytes, ";
+            std::cout << stats.count << " allocs" << std::endl;
+        }
+    }
+}
+
+#ifdef ZETA_PROFILE_OPS
+
+/// Number of opcodes, also used as the "no opcode" index
+/// in the pair and triple tables
+const size_t NUM_OPCODES = ABORT + 1;
+
+/// Cycles are sampled on one in this many dispatches, since reading
+/// the cycle counter on every instruction would dwarf simple opcodes
+const uint64_t OP_SAMPLE_RATE = 64;
+
+/// Execution counts per opcode, opcode pair and opcode triple
+uint64_t opCounts[NUM_OPCODES];
+uint64_t opPairCounts[(NUM_OPCODES + 1) * (NUM_OPCODES + 1)];
+uint64_t opTripleCounts[(NUM_OPCODES + 1) * (NUM_OPCODES + 1) * (NUM_OPCODES + 1)];
+
+/// Sampled cycle totals and sample counts per opcode
+uint64_t opCycles[NUM_OPCODES];
+uint64_t opSamples[NUM_OPCODES];
+
+/// Previously executed opcodes
+size_t prevOp1 = NUM_OPCODES;
+size_t prevOp2 = NUM_OPCODES;
+
+/// Opcode being sampled, and the cycle count at its dispatch
+size_t sampledOp = NUM_OPCODES;
+uint64_t sampleStart = 0;
+uint64_t numDispatches = 0;
+
+/// Read the cycle counter
+__attribute__((always_inline)) uint64_t readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/// Record the dispatch of an opcode
+__attribute__((always_inline)) void profileOp(Opcode op)
+{
+    // The cycles elapsed since the sampled dispatch belong
+    // to the previous instruction
+    if (sampledOp != NUM_OPCODES)
+    {
+        opCycles[sampledOp] += readCycles() - sampleStart;
+        opSamples[sampledOp]++;
+        sampledOp = NUM_OPCODES;
+    }
+
+    opCounts[op]++;
+    opPairCounts[prevOp1 * (NUM_OPCODES + 1) + op]++;
+    opTripleCounts[
+        (prevOp2 * (NUM_OPCODES + 1) + prevOp1) * (NUM_OPCODES + 1) + op
+    ]++;
+    prevOp2 = prevOp1;
+    prevOp1 = op;
+
+    if (++numDispatches % OP_SAMPLE_RATE == 0)
+    {
+        sampledOp = op;
+        sampleStart = readCycles();
+    }
+}
+
+/// Profile entry, a sequence of opcodes with its execution count
+struct OpSeqCount
+{
+    std::vector<size_t> ops;
+    uint64_t count;
+};
+
+/// Get the most frequent opcode sequences of a given length
+std::vector<OpSeqCount> topOpSeqs(size_t seqLen, size_t maxCount)
+{
+    auto table = (seqLen == 2)? opPairCounts:opTripleCounts;
+    auto tableSize = (seqLen == 2)? (NUM_OPCODES + 1) * (NUM_OPCODES + 1):
+        (NUM_OPCODES + 1) * (NUM_OPCODES + 1) * (NUM_OPCODES + 1);
+
+    std::vector<OpSeqCount> seqs;
+
+    for (size_t idx = 0; idx < tableSize; ++idx)
+    {
+        if (table[idx] == 0)
+            continue;
+
+        // Decode the opcodes, skipping sequences which
+        // start before the first instruction
+        std::vector<size_t> ops(seqLen);
+        auto rem = idx;
+        for (size_t i = seqLen; i > 0; --i)
+        {
+            ops[i-1] = rem % (NUM_OPCODES + 1);
+            rem /= (NUM_OPCODES + 1);
+        }
+        if (ops[0] == NUM_OPCODES)
+            continue;
+
+        seqs.push_back({ ops, table[idx] });
+    }
+
+    std::sort(
+        seqs.begin(),
+        seqs.end(),
+        [](const OpSeqCount& a, const OpSeqCount& b) { return a.count > b.count; }
+    );
+
+    if (seqs.size() > maxCount)
+        seqs.resize(maxCount);
+
+    return seqs;
+}
+
+/// Get the executed opcodes, sorted by decreasing count
+std::vector<size_t> sortedOps()
+{
+    std::vector<size_t> ops;
+    for (size_t op = 0; op < NUM_OPCODES; ++op)
+    {
+        if (opCounts[op] > 0)
+            ops.push_back(op);
+    }
+
+    std::sort(
+        ops.begin(),
+        ops.end(),
+        [](size_t a, size_t b) { return opCounts[a] > opCounts[b]; }
+    );
+
+    return ops;
+}
+
+/// Get the average sampled cycle count of an opcode
+double avgOpCycles(size_t op)
+{
+    return opSamples[op]? (double)opCycles[op] / opSamples[op]:0;
+}
+
+#endif
+
+/// Number of opcode sequences listed in profile reports
+const size_t NUM_TOP_OP_SEQS = 20;
+
+bool opProfilingEnabled()
+{
+#ifdef ZETA_PROFILE_OPS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void printOpProfile()
+{
+#ifdef ZETA_PROFILE_OPS
+    uint64_t total = 0;
+    for (size_t op = 0; op < NUM_OPCODES; ++op)
+        total += opCounts[op];
+
+    auto percent = [total](uint64_t count)
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%.2f%%", total? 100.0 * count / total:0);
+        return std::string(buf);
+    };
+
+    std::cout << "instrs executed: " << total << std::endl;
+    std::cout << "opcodes (count, share, avg cycles):" << std::endl;
+    for (auto op : sortedOps())
+    {
+        std::cout << "  " << opName(op) << ": " << opCounts[op] << ", ";
+        std::cout << percent(opCounts[op]) << ", ";
+        std::cout << (size_t)avgOpCycles(op) << std::endl;
+    }
+
+    for (size_t seqLen = 2; seqLen <= 3; ++seqLen)
+    {
+        std::cout << "top opcode " << (seqLen == 2? "pairs":"triples");
+        std::cout << " (count, share):" << std::endl;
+
+        for (auto& seq : topOpSeqs(seqLen, NUM_TOP_OP_SEQS))
+        {
+            std::cout << "  ";
+            for (size_t i = 0; i < seq.ops.size(); ++i)
+                std::cout << (i? " ":"") << opName(seq.ops[i]);
+            std::cout << ": " << seq.count << ", " << percent(seq.count);
+            std::cout << std::endl;
+        }
+    }
+#endif
+}
+
+void writeOpProfile(std::string fileName)
+{
+#ifdef ZETA_PROFILE_OPS
+    std::string out = "{\n  \"opcodes\": [";
+
+    bool first = true;
+    for (auto op : sortedOps())
+    {
+        out += first? "\n":",\n";
+        first = false;
+        out += "    { \"op\": \"" + opName(op) + "\"";
+        out += ", \"count\": " + std::to_string(opCounts[op]);
+        out += ", \"avg_cycles\": " + std::to_string(avgOpCycles(op));
+        out += ", \"samples\": " + std::to_string(opSamples[op]) + " }";
+    }
+    out += "\n  ]";
+
+    for (size_t seqLen = 2; seqLen <= 3; ++seqLen)
+    {
+        out += (seqLen == 2)? ",\n  \"pairs\": [":",\n  \"triples\": [";
+
+        first = true;
+        for (auto& seq : topOpSeqs(seqLen, NUM_TOP_OP_SEQS))
+        {
+            out += first? "\n":",\n";
+            first = false;
+            out += "    { \"ops\": [";
+            for (size_t i = 0; i < seq.ops.size(); ++i)
+                out += (i? ", \"":"\"") + opName(seq.ops[i]) + "\"";
+            out += "], \"count\": " + std::to_string(seq.count) + " }";
+        }
+        out += "\n  ]";
+    }
+    out += "\n}\n";
+
+    FILE* file = fopen(fileName.c_str(), "w");
+
+    if (!file)
+    {
+        throw RunError("failed to open file \"" + fileName + "\"");
+    }
+
+    auto numWritten = fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+
+    if (numWritten != out.size())
+    {
+        throw RunError("failed to write file \"" + fileName + "\"");
+    }
+#endif
+}
+
+/// Minimum number of executions for a branch to be reported as biased
+const uint64_t MIN_BIASED_BRANCH_EXECS = 100;
+
+/// Minimum share of executions going one way for a branch to be biased
+const double BIASED_BRANCH_RATIO = 0.9;
+
+void startBlockCounts()
+{
+    countingBlocks = true;
+}
+
+void resetBlockCounts()
+{
+    for (size_t i = 1; i < blockInfos.size(); ++i)
+    {
+        for (auto version : blockInfos[i].versions)
+        {
+            version->numEntries = 0;
+            version->numThen = 0;
+            version->numElse = 0;
+        }
+    }
+}
+
+/// Get all block versions, in order of creation
+std::vector<BlockVersion*> getAllVersions()
+{
+    std::vector<BlockVersion*> versions;
+
+    for (size_t i = 1; i < blockInfos.size(); ++i)
+    {
+        for (auto version : blockInfos[i].versions)
+            versions.push_back(version);
+    }
+
+    std::sort(
+        versions.begin(),
+        versions.end(),
+        [](BlockVersion* a, BlockVersion* b) { return a->id < b->id; }
+    );
+
+    return versions;
+}
+
+/// Source position of a counted block or of the branch ending it
+struct CountedPos
+{
+    SrcPos pos = SRC_POS_NONE;
+
+    /// Set when the position is borrowed from another version
+    bool inferred = false;
+};
+
+/// Source positions of counted blocks and of the branches ending them
+typedef std::unordered_map<BlockVersion*, CountedPos> CountedPosMap;
+
+/**
+Get the source positions of block versions, or of the branches ending
+them. Versions without any positioned instruction, ie: a block with
+only a return, take the position of the version created before them
+in the same function, which is usually the block that branched to
+them, or else of the one created after them. Such positions are marked
+as inferred. Versions must be given in order of creation.
+*/
+CountedPosMap countedPositions(
+    const std::vector<BlockVersion*>& versions,
+    bool branch
+)
+{
+    CountedPosMap positions;
+
+    // Last known position in each function
+    std::unordered_map<refptr, SrcPos> lastPos;
+
+    for (auto version : versions)
+    {
+        auto pos = SRC_POS_NONE;
+
+        // The if_true is the last instruction of its block
+        if (version->startPtr)
+        {
+            pos = version->getSrcPos(
+                branch? (version->endPtr - 1):version->startPtr
+            );
+        }
+
+        auto funPtr = (refptr)version->fun;
+        auto& counted = positions[version];
+
+        if (pos != SRC_POS_NONE)
+        {
+            lastPos[funPtr] = pos;
+            counted.pos = pos;
+        }
+        else if (lastPos.find(funPtr) != lastPos.end())
+        {
+            counted.pos = lastPos[funPtr];
+            counted.inferred = true;
+        }
+    }
+
+    // Versions created before any positioned one in their function
+    lastPos.clear();
+    for (auto itr = versions.rbegin(); itr != versions.rend(); ++itr)
+    {
+        auto version = *itr;
+        auto funPtr = (refptr)version->fun;
+        auto& counted = positions[version];
+
+        if (counted.pos != SRC_POS_NONE && !counted.inferred)
+        {
+            lastPos[funPtr] = counted.pos;
+        }
+        else if (counted.pos == SRC_POS_NONE &&
+                 lastPos.find(funPtr) != lastPos.end())
+        {
+            counted.pos = lastPos[funPtr];
+            counted.inferred = true;
+        }
+    }
+
+    return positions;
+}
+
+/// Describe a counted block with its function and source position
+/// Inferred positions are prefixed with a tilde
+std::string countedName(BlockVersion* version, CountedPos counted)
+{
+    auto name = "v" + std::to_string(version->id) + " " + profFunName(version->fun);
+
+    if (counted.pos != SRC_POS_NONE)
+    {
+        name += counted.inferred? " (~":" (";
+        name += srcPosToString(counted.pos) + ")";
+    }
+
+    return name;
+}
+
+bool isBiased(BlockVersion* version)
+{
+    auto numExecs = version->numThen + version->numElse;
+    auto numMajor = std::max(version->numThen, version->numElse);
+
+    return (
+        numExecs >= MIN_BIASED_BRANCH_EXECS &&
+        numMajor >= BIASED_BRANCH_RATIO * numExecs
+    );
+}
+
+void printBlockCounts(size_t numRows)
+{
+    auto versions = getAllVersions();
+    auto blockPositions = countedPositions(versions, false);
+    auto branchPositions = countedPositions(versions, true);
+
+    uint64_t totalEntries = 0;
+    size_t numBranches = 0;
+    size_t numBiased = 0;
+    std::vector<BlockVersion*> branches;
+
+    for (auto version : versions)
+    {
+        totalEntries += version->numEntries;
+
+        if (version->numThen + version->numElse == 0)
+            continue;
+
+        numBranches++;
+        if (isBiased(version))
+        {
+            numBiased++;
+            branches.push_back(version);
+        }
+    }
+
+    std::sort(
+        versions.begin(),
+        versions.end(),
+        [](BlockVersion* a, BlockVersion* b)
+        {
+            return a->numEntries > b->numEntries;
+        }
+    );
+
+    std::sort(
+        branches.begin(),
+        branches.end(),
+        [](BlockVersion* a, BlockVersion* b)
+        {
+            return a->numThen + a->numElse > b->numThen + b->numElse;
+        }
+    );
+
+    printf("block entries: %llu\n", (unsigned long long)totalEntries);
+    printf("hot blocks:\n");
+    printf("  %14s %7s  %s\n", "entries", "share", "block");
+
+    for (size_t i = 0; i < versions.size() && i < numRows; ++i)
+    {
+        auto version = versions[i];
+        if (version->numEntries == 0)
+            break;
+
+        printf(
+            "  %14llu %6.2f%%  %s\n",
+            (unsigned long long)version->numEntries,
+            100.0 * version->numEntries / totalEntries,
+            countedName(version, blockPositions[version]).c_str()
+        );
+    }
+
+    printf(
+        "branches executed: %zu, biased over %.0f%%: %zu\n",
+        numBranches,
+        100 * BIASED_BRANCH_RATIO,
+        numBiased
+    );
+    printf("biased branches:\n");
+    printf("  %14s %7s  %s\n", "executions", "then", "branch");
+
+    for (size_t i = 0; i < branches.size() && i < numRows; ++i)
+    {
+        auto version = branches[i];
+        auto numExecs = version->numThen + version->numElse;
+
+        printf(
+            "  %14llu %6.2f%%  %s\n",
+            (unsigned long long)numExecs,
+            100.0 * version->numThen / numExecs,
+            countedName(version, branchPositions[version]).c_str()
+        );
+    }
+}
+
+void writeBlockCounts(std::string fileName)
+{
+    FILE* file = fopen(fileName.c_str(), "w");
+
+    if (!file)
+    {
+        throw RunError("failed to open file \"" + fileName + "\"");
+    }
+
+    auto posFields = [](CountedPos counted)
+    {
+        std::string out = "\"pos\": null";
+        if (counted.pos != SRC_POS_NONE)
+            out = "\"pos\": \"" + srcPosToString(counted.pos) + "\"";
+        out += ", \"pos_inferred\": ";
+        out += counted.inferred? "true":"false";
+        return out;
+    };
+
+    auto versions = getAllVersions();
+    auto blockPositions = countedPositions(versions, false);
+    auto branchPositions = countedPositions(versions, true);
+
+    fprintf(file, "{\n  \"blocks\": [");
+
+    bool first = true;
+    for (auto version : versions)
+    {
+        if (version->numEntries == 0)
+            continue;
+
+        fprintf(
+            file,
+            "%s\n    { \"id\": %zu, \"fun\": \"%s\", %s, \"entries\": %llu }",
+            first? "":",",
+            version->id,
+            profFunName(version->fun).c_str(),
+            posFields(blockPositions[version]).c_str(),
+            (unsigned long long)version->numEntries
+        );
+        first = false;
+    }
+
+    fprintf(file, "\n  ],\n  \"branches\": [");
+
+    first = true;
+    for (auto version : versions)
+    {
+        if (version->numThen + version->numElse == 0)
+            continue;
+
+        fprintf(
+            file,
+            "%s\n    { \"id\": %zu, \"fun\": \"%s\", %s, "
+            "\"then\": %llu, \"else\": %llu }",
+            first? "":",",
+            version->id,
+            profFunName(version->fun).c_str(),
+            posFields(branchPositions[version]).c_str(),
+            (unsigned long long)version->numThen,
+            (unsigned long long)version->numElse
+        );
+        first = false;
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
+
+/// Start/continue execution beginning at a current instruction
+Value execCode()
+{
+    assert (instrPtr >= codeHeap);
+    assert (instrPtr < codeHeapLimit);
+
+    // For each instruction to execute
+    for (;;)
+    {
+        auto& op = readCode<Opcode>();
+
+#ifdef ZETA_PROFILE_OPS
+        profileOp(op);
+#endif
+
+        //std::cout << "instr" << std::endl;
+        //std::cout << "op=" << (int)op << std::endl;
+        //std::cout << "  stack space: " << (stackBase - stackPtr) << std::endl;
+
+        switch (op)
+        {
+            case PUSH:
+            {
+                auto val = readCode<Value>();
+                pushVal(val);
+            }
+            break;
+
+            case POP:
+            {
+                popVal();
+            }
+            break;
+
+            case DUP:
+            {
+                // Read the index of the value to duplicate
+                auto idx = readCode<uint16_t>();
+                auto val = stackPtr[idx];
+                pushVal(val);
+            }
+            break;
+
+            // Swap the topmost two stack elements
+            case SWAP:
+            {
+                auto v0 = popVal();
+                auto v1 = popVal();
+                pushVal(v0);
+                pushVal(v1);
+            }
+            break;
+
+            // Set a local variable
+            case SET_LOCAL:
+            {
+                auto localIdx = readCode<uint16_t>();
+                //std::cout << "set localIdx=" << localIdx << std::endl;
+                framePtr[-localIdx] = popVal();
+            }
+            break;
+
+            case GET_LOCAL:
+            {
+                // Read the index of the value to push
+                auto localIdx = readCode<uint16_t>();
+                //std::cout << "get localIdx=" << localIdx << std::endl;
+                auto val = framePtr[-localIdx];
+                pushVal(val);
+            }
+            break;
+
+            //
+            // Integer operations
+            //
+
+            case ADD_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushVal(Value::int32(arg0 + arg1));
+            }
+            break;
 
             case SUB_I32:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushVal(Value::int32(arg0 - arg1));
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushVal(Value::int32(arg0 - arg1));
+            }
+            break;
+
+            case MUL_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushVal(Value::int32(arg0 * arg1));
+            }
+            break;
+
+            case DIV_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushVal(Value::int32(arg0 / arg1));
+            }
+            break;
+
+            case MOD_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushVal(Value::int32(arg0 % arg1));
+            }
+            break;
+
+            case LT_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushBool(arg0 < arg1);
+            }
+            break;
+
+            case LE_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushBool(arg0 <= arg1);
+            }
+            break;
+
+            case GT_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushBool(arg0 > arg1);
+            }
+            break;
+
+            case GE_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushBool(arg0 >= arg1);
+            }
+            break;
+
+            case EQ_I32:
+            {
+                auto arg1 = popInt32();
+                auto arg0 = popInt32();
+                pushBool(arg0 == arg1);
+            }
+            break;
+
+            //
+            // Floating-point operations
+            //
+
+            case ADD_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushVal(Value::float32(arg0 + arg1));
+            }
+            break;
+
+            case SUB_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushVal(Value::float32(arg0 - arg1));
+            }
+            break;
+
+            case MUL_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushVal(Value::float32(arg0 * arg1));
+            }
+            break;
+
+            case DIV_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushVal(Value::float32(arg0 / arg1));
+            }
+            break;
+
+            case LT_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushBool(arg0 < arg1);
+            }
+            break;
+
+            case LE_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushBool(arg0 <= arg1);
+            }
+            break;
+
+            case GT_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushBool(arg0 > arg1);
+            }
+            break;
+
+            case GE_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushBool(arg0 >= arg1);
+            }
+            break;
+
+            case EQ_F32:
+            {
+                auto arg1 = popFloat32();
+                auto arg0 = popFloat32();
+                pushBool(arg0 == arg1);
+            }
+            break;
+
+            case SIN_F32:
+            {
+                float arg = popFloat32();
+                pushVal(Value::float32(sin(arg)));
+            }
+            break;
+
+            case COS_F32:
+            {
+                float arg = popFloat32();
+                pushVal(Value::float32(cos(arg)));
+            }
+            break;
+
+            case SQRT_F32:
+            {
+                float arg = popFloat32();
+                pushVal(Value::float32(sqrt(arg)));
+            }
+            break;
+
+            //
+            // Conversion operations
+            //
+
+            case I32_TO_F32:
+            {
+                auto arg0 = popInt32();
+                pushVal(Value::float32(arg0));
+            }
+            break;
+
+            case F32_TO_I32:
+            {
+                auto arg0 = popFloat32();
+                pushVal(Value::int32(arg0));
+            }
+            break;
+
+            case F32_TO_STR:
+            {
+                auto arg0 = popFloat32();
+                String str = std::to_string(arg0);
+                pushVal(str);
+            }
+            break;
+
+            case STR_TO_F32:
+            {
+                auto arg0 = popStr();
+                pushVal(Value::float32(std::stof(arg0)));
+            }
+            break;
+
+            //
+            // Misc operations
+            //
+
+            case EQ_BOOL:
+            {
+                auto arg1 = popBool();
+                auto arg0 = popBool();
+                pushBool(arg0 == arg1);
+            }
+            break;
+
+            // Test if a value has a given tag
+            case HAS_TAG:
+            {
+                auto testTag = readCode<Tag>();
+                auto valTag = popVal().getTag();
+                pushBool(valTag == testTag);
+            }
+            break;
+
+            //
+            // String operations
+            //
+
+            case STR_LEN:
+            {
+                auto str = popStr();
+                pushVal(Value::int32(str.length()));
+            }
+            break;
+
+            case GET_CHAR:
+            {
+                auto idx = (size_t)popInt32();
+                auto str = popStr();
+
+                if (idx >= str.length())
+                {
+                    throw RunError(
+                        "get_char, index out of bounds"
+                    );
+                }
+
+                auto ch = str[idx];
+                // Cache single-character strings
+                if (charStrings[ch] == Value::UNDEF)
+                {
+                    char buf[2] = { (char)str[idx], '\0' };
+                    charStrings[ch] = String(buf);
+                }
+
+                pushVal(charStrings[ch]);
+            }
+            break;
+
+            case GET_CHAR_CODE:
+            {
+                auto idx = (size_t)popInt32();
+                auto str = popStr();
+
+                if (idx >= str.length())
+                {
+                    throw RunError(
+                        "get_char_code, index out of bounds"
+                    );
+                }
+
+                pushVal(Value::int32(str[idx]));
+            }
+            break;
+
+            case CHAR_TO_STR:
+            {
+                auto charCode = (char)popInt32();
+                char buf[2] = { (char)charCode, '\0' };
+                pushVal(String(buf));
+            }
+            break;
+
+            case STR_CAT:
+            {
+                auto a = popStr();
+                auto b = popStr();
+                auto c = String::concat(b, a);
+                pushVal(c);
+            }
+            break;
+
+            case EQ_STR:
+            {
+                auto arg1 = popStr();
+                auto arg0 = popStr();
+                pushBool(arg0 == arg1);
+            }
+            break;
+
+            //
+            // Object operations
+            //
+
+            case NEW_OBJECT:
+            {
+                auto capacity = popInt32();
+                auto obj = Object::newObject(capacity);
+                pushVal(obj);
+            }
+            break;
+
+            case HAS_FIELD:
+            {
+                auto fieldName = popStr();
+                auto obj = popObj();
+                pushBool(obj.hasField(fieldName));
+            }
+            break;
+
+            case SET_FIELD:
+            {
+                auto val = popVal();
+                auto fieldName = popStr();
+                auto obj = popObj();
+
+                if (!isValidIdent(fieldName))
+                {
+                    throw RunError(
+                        "invalid identifier in set_field \"" +
+                        (std::string)fieldName + "\""
+                    );
+                }
+
+                obj.setField(fieldName, val);
+            }
+            break;
+
+            // This instruction will abort execution if trying to
+            // access a field that is not present on an object.
+            // The running program is responsible for testing that
+            // fields exist before attempting to read them.
+            case GET_FIELD:
+            {
+                auto fieldName = popStr();
+                auto obj = popObj();
+
+                if (!obj.hasField(fieldName))
+                {
+                    throw RunError(
+                        "get_field failed, missing field \"" +
+                        (std::string)fieldName + "\""
+                    );
+                }
+
+                pushVal(obj.getField(fieldName));
             }
             break;
 
-            case MUL_I32:
+            case GET_FIELD_LIST:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushVal(Value::int32(arg0 * arg1));
+                Value arg0 = popVal();
+                Array array = Array(0);
+                for (auto itr = ObjFieldItr(arg0); itr.valid(); itr.next())
+                {
+                    auto fieldName = (String)itr.get();
+                    array.push(fieldName);
+                }
+                pushVal(array);
             }
             break;
 
-            case DIV_I32:
+            case EQ_OBJ:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushVal(Value::int32(arg0 / arg1));
+                Value arg1 = popVal();
+                Value arg0 = popVal();
+                pushBool(arg0 == arg1);
             }
             break;
 
-            case MOD_I32:
+            //
+            // Array operations
+            //
+
+            case NEW_ARRAY:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushVal(Value::int32(arg0 % arg1));
+                auto len = popInt32();
+                auto array = Array(len);
+                pushVal(array);
             }
             break;
 
-            case LT_I32:
+            case ARRAY_LEN:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushBool(arg0 < arg1);
+                auto arr = Array(popVal());
+                pushVal(Value::int32(arr.length()));
             }
             break;
 
-            case LE_I32:
+            case ARRAY_PUSH:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushBool(arg0 <= arg1);
+                auto val = popVal();
+                auto arr = Array(popVal());
+                arr.push(val);
             }
             break;
 
-            case GT_I32:
+            case SET_ELEM:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushBool(arg0 > arg1);
+                auto val = popVal();
+                auto idx = (size_t)popInt32();
+                auto arr = Array(popVal());
+
+                if (idx >= arr.length())
+                {
+                    throw RunError(
+                        "set_elem, index out of bounds"
+                    );
+                }
+
+                arr.setElem(idx, val);
             }
             break;
 
-            case GE_I32:
+            case GET_ELEM:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushBool(arg0 >= arg1);
+                auto idx = (size_t)popInt32();
+                auto arr = Array(popVal());
+
+                if (idx >= arr.length())
+                {
+                    throw RunError(
+                        "get_elem, index out of bounds"
+                    );
+                }
+
+                pushVal(arr.getElem(idx));
             }
             break;
 
-            case EQ_I32:
+            //
+            // Branch instructions
+            //
+
+            case JUMP_STUB:
             {
-                auto arg1 = popInt32();
-                auto arg0 = popInt32();
-                pushBool(arg0 == arg1);
+                profSafepoint(&op);
+
+                auto& dstAddr = readCode<uint8_t*>();
+
+                //std::cout << "Patching jump" << std::endl;
+
+                auto dstVer = (BlockVersion*)dstAddr;
+
+                if (!dstVer->startPtr)
+                {
+                    // If the heap allocation pointer is right
+                    // after the jump instruction
+                    if (instrPtr == codeHeapAlloc)
+                    {
+                        // The jump is redundant, so we will write the
+                        // next block over this jump instruction
+                        instrPtr = codeHeapAlloc = (uint8_t*)&op;
+
+                        numJumpsElided++;
+                        if (jitLog)
+                            logElide(instrPtr, dstVer);
+                    }
+
+                    compile(dstVer);
+                }
+                else
+                {
+                    // Patch the jump
+                    op = JUMP;
+                    dstAddr = dstVer->startPtr;
+
+                    numStubsPatched++;
+                    if (jitLog)
+                        logPatch("jump", &dstAddr, dstVer);
+
+                    // Jump to the target
+                    instrPtr = dstVer->startPtr;
+                }
             }
             break;
 
-            //
-            // Floating-point operations
-            //
+            case JUMP:
+            {
+                profSafepoint(&op);
 
-            case ADD_F32:
+                auto& dstAddr = readCode<uint8_t*>();
+                instrPtr = dstAddr;
+            }
+            break;
+
+            case IF_TRUE:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushVal(Value::float32(arg0 + arg1));
+                profSafepoint(&op);
+
+                auto& thenAddr = readCode<uint8_t*>();
+                auto& elseAddr = readCode<uint8_t*>();
+
+                auto arg0 = popVal();
+
+                if (arg0 == Value::TRUE)
+                {
+                    if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
+                    {
+                        //std::cout << "Patching then target" << std::endl;
+
+                        auto thenVer = (BlockVersion*)thenAddr;
+                        if (!thenVer->startPtr)
+                           compile(thenVer);
+
+                        // Patch the jump
+                        thenAddr = thenVer->startPtr;
+
+                        numStubsPatched++;
+                        if (jitLog)
+                            logPatch("then", &thenAddr, thenVer);
+                    }
+
+                    instrPtr = thenAddr;
+                }
+                else
+                {
+                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
+                    {
+                       //std::cout << "Patching else target" << std::endl;
+
+                       auto elseVer = (BlockVersion*)elseAddr;
+                       if (!elseVer->startPtr)
+                           compile(elseVer);
+
+                       // Patch the jump
+                       elseAddr = elseVer->startPtr;
+
+                       numStubsPatched++;
+                       if (jitLog)
+                           logPatch("else", &elseAddr, elseVer);
+                    }
+
+                    instrPtr = elseAddr;
+                }
+            }
+            break;
+
+            // Regular function call
+            case CALL:
+            {
+                profSafepoint(&op);
+
+                auto numArgs = readCode<uint16_t>();
+                auto retVer = readCode<BlockVersion*>();
+
+                auto callee = popVal();
+
+                if (callee.isObject())
+                {
+                    funCall((uint8_t*)&op, callee, numArgs, retVer);
+                }
+                else if (callee.isHostFn())
+                {
+                    hostCall((uint8_t*)&op, callee, numArgs, retVer);
+                }
+                else
+                {
+                  throw RunError("invalid callee at call site");
+                }
             }
             break;
 
-            case SUB_F32:
-            {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushVal(Value::float32(arg0 - arg1));
+            case RET:
+            {
+                profSafepoint(&op);
+
+                // TODO: figure out callee identity from version,
+                // caller identity from return address
+                //
+                // We want args to have been consumed
+                // We pop all our locals (or the caller does)
+                //
+                // The thing is... The caller can't pop our locals,
+                // because the call continuation doesn't know
+
+                // Pop the return value
+                auto retVal = popVal();
+
+                // Pop the return address
+                auto retVer = (BlockVersion*)popVal().getWord().ptr;
+
+                // Pop the previous frame pointer
+                auto prevFramePtr = popVal().getWord().ptr;
+
+                // Pop the previous stack pointer
+                auto prevStackPtr = popVal().getWord().ptr;
+
+                // Restore the previous frame pointer
+                framePtr = (Value*)prevFramePtr;
+
+                // Restore the stack pointer
+                stackPtr = (Value*)prevStackPtr;
+
+                // If this is a top-level return
+                if (retVer == nullptr)
+                {
+                    return retVal;
+                }
+                else
+                {
+                    // Push the return value on the stack
+                    pushVal(retVal);
+
+                    if (!retVer->startPtr)
+                        compile(retVer);
+
+                    instrPtr = retVer->startPtr;
+                }
             }
             break;
 
-            case MUL_F32:
+            // Throw an exception
+            case THROW:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushVal(Value::float32(arg0 * arg1));
+                // Pop the exception value
+                auto excVal = popVal();
+                throwExc((uint8_t*)&op, excVal);
             }
             break;
 
-            case DIV_F32:
+            case COUNT_BLOCK:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushVal(Value::float32(arg0 / arg1));
+                auto version = readCode<BlockVersion*>();
+                version->numEntries++;
             }
             break;
 
-            case LT_F32:
+            // Count the branch taken by the if_true which follows
+            case COUNT_BRANCH:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushBool(arg0 < arg1);
+                auto version = readCode<BlockVersion*>();
+                if (stackPtr[0] == Value::TRUE)
+                    version->numThen++;
+                else
+                    version->numElse++;
             }
             break;
 
-            case LE_F32:
+            case IMPORT:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushBool(arg0 <= arg1);
+                auto pkgName = (std::string)popVal();
+                auto pkg = import(pkgName);
+                pushVal(pkg);
             }
             break;
 
-            case GT_F32:
+            case ABORT:
             {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushBool(arg0 > arg1);
-            }
-            break;
+                auto errMsg = (std::string)popStr();
 
-            case GE_F32:
-            {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushBool(arg0 >= arg1);
-            }
-            break;
+                auto srcPos = getSrcPos((uint8_t*)&op);
+                if (srcPos != SRC_POS_NONE)
+                    std::cout << srcPosToString(srcPos) << " - ";
 
-            case EQ_F32:
-            {
-                auto arg1 = popFloat32();
-                auto arg0 = popFloat32();
-                pushBool(arg0 == arg1);
-            }
-            break;
+                if (errMsg != "")
+                {
+                    std::cout << "aborting execution due to error: ";
+                    std::cout << errMsg << std::endl;
+                }
+                else
+                {
+                    std::cout << "aborting execution due to error" << std::endl;
+                }
 
-            case SIN_F32:
-            {
-                float arg = popFloat32();
-                pushVal(Value::float32(sin(arg)));
+                exit(-1);
             }
             break;
 
-            case COS_F32:
-            {
-                float arg = popFloat32();
-                pushVal(Value::float32(cos(arg)));
-            }
-            break;
+            default:
+            assert (false && "unhandled instruction in interpreter loop");
+        }
 
-            case SQRT_F32:
-            {
-                float arg = popFloat32();
-                pushVal(Value::float32(sqrt(arg)));
-            }
-            break;
+    }
 
-            //
-            // Conversion operations
-            //
+    assert (false);
+}
 
-            case I32_TO_F32:
-            {
-                auto arg0 = popInt32();
-                pushVal(Value::float32(arg0));
-            }
-            break;
+/// Begin the execution of a function
+/// Note: this may be indirectly called from within a running interpreter
+Value callFun(Object fun, ValueVec args)
+{
+    static ICache numParamsIC("num_params");
+    static ICache numLocalsIC("num_locals");
+    auto numParams = numParamsIC.getInt32(fun);
+    auto numLocals = numLocalsIC.getInt32(fun);
 
-            case F32_TO_I32:
-            {
-                auto arg0 = popFloat32();
-                pushVal(Value::int32(arg0));
-            }
-            break;
+    if (args.size() != numParams)
+    {
+        throw RunError(
+            "argument count mismatch in top-level call"
+        );
+    }
 
-            case F32_TO_STR:
-            {
-                auto arg0 = popFloat32();
-                String str = std::to_string(arg0);
-                pushVal(str);
-            }
-            break;
+    if (numLocals < numParams + 1)
+    {
+        throw RunError(
+            "not enough locals to store function parameters in top-level call"
+        );
+    }
 
-            case STR_TO_F32:
-            {
-                auto arg0 = popStr();
-                pushVal(Value::float32(std::stof(arg0)));
-            }
-            break;
+    // Get the function entry block
+    auto entryBlock = getEntryBlock(fun);
+    auto entryVer = getBlockVersion(fun, entryBlock);
 
-            //
-            // Misc operations
-            //
+    // Verify the function and check for stack space
+    auto maxDepth = getMaxStackDepth(fun, entryBlock, numLocals);
+    checkStackSpace(1 + numLocals + 3 + maxDepth);
 
-            case EQ_BOOL:
-            {
-                auto arg1 = popBool();
-                auto arg0 = popBool();
-                pushBool(arg0 == arg1);
-            }
-            break;
+    // Store the stack size before the call
+    auto preCallSz = stackSize();
 
-            // Test if a value has a given tag
-            case HAS_TAG:
-            {
-                auto testTag = readCode<Tag>();
-                auto valTag = popVal().getTag();
-                pushBool(valTag == testTag);
-            }
-            break;
+    // Save the previous instruction pointer
+    pushVal(Value((refptr)instrPtr, TAG_RAWPTR));
 
-            //
-            // String operations
-            //
+    // Save the previous stack and frame pointers
+    auto prevStackPtr = stackPtr;
+    auto prevFramePtr = framePtr;
 
-            case STR_LEN:
-            {
-                auto str = popStr();
-                pushVal(Value::int32(str.length()));
-            }
-            break;
+    // Initialize the frame pointer (used to access locals)
+    framePtr = stackPtr - 1;
 
-            case GET_CHAR:
-            {
-                auto idx = (size_t)popInt32();
-                auto str = popStr();
+    // Push space for the local variables
+    stackPtr -= numLocals;
+    assert (stackPtr >= stackLimit);
 
-                if (idx >= str.length())
-                {
-                    throw RunError(
-                        "get_char, index out of bounds"
-                    );
-                }
+    // Push the previous stack pointer, previous
+    // frame pointer and return address
+    pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
+    pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
+    pushVal(Value(nullptr, TAG_RAWPTR));
 
-                auto ch = str[idx];
-                // Cache single-character strings
-                if (charStrings[ch] == Value::UNDEF)
-                {
-                    char buf[2] = { (char)str[idx], '\0' };
-                    charStrings[ch] = String(buf);
-                }
+    // Copy the arguments into the locals
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        //std::cout << "  " << args[i].toString() << std::endl;
+        framePtr[-i] = args[i];
+    }
 
-                pushVal(charStrings[ch]);
-            }
-            break;
+    // Store the function/closure parameter
+    framePtr[-numParams] = fun;
+
+    // Generate code for the entry block version
+    if (!entryVer->startPtr)
+        compile(entryVer);
+    assert (entryVer->length() > 0);
+
+    // Begin execution at the entry block
+    instrPtr = entryVer->startPtr;
+    auto retVal = execCode();
+
+    // Restore the previous instruction pointer
+    instrPtr = (uint8_t*)popVal().getWord().ptr;
+
+    // Check that the stack size matches what it was before the call
+    if (stackSize() != preCallSz)
+    {
+        throw RunError("stack size does not match after call termination");
+    }
+
+    return retVal;
+}
+
+/// Describe a value pushed by an instruction, for code dumps
+std::string disasmValue(Value val)
+{
+    switch (val.getTag())
+    {
+        case TAG_UNDEF:
+        case TAG_BOOL:
+        case TAG_INT32:
+        case TAG_FLOAT32:
+        case TAG_ARRAY:
+        return val.toString();
+
+        case TAG_STRING:
+        return "\"" + (std::string)val + "\"";
+
+        case TAG_OBJECT:
+        {
+            auto obj = Object(val);
+            if (obj.hasField("entry"))
+                return "<fun " + profFunName(obj) + ">";
+            return val.toString();
+        }
+
+        default:
+        return "<" + tagToStr(val.getTag()) + ">";
+    }
+}
+
+/**
+Describe a branch target. Targets not compiled yet are block version
+pointers, which lie outside of the code heap.
+*/
+std::string disasmTarget(uint8_t* addr)
+{
+    if (addr < codeHeap || addr >= codeHeapLimit)
+    {
+        auto version = (BlockVersion*)addr;
+        return "v" + std::to_string(version->id) + " (stub)";
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%04zx", heapOffset(addr));
+
+    auto version = findVersion(addr);
+    if (!version)
+        return buf;
+
+    return "v" + std::to_string(version->id) + " @" + buf;
+}
+
+/**
+Get the end of the code belonging to a compiled version. When a jump
+gets elided, the next version is written over it, and the code from
+its start on belongs to that version.
+*/
+uint8_t* versionEnd(BlockVersion* version)
+{
+    auto next = codeVersions.upper_bound(version->startPtr);
+
+    if (next != codeVersions.end() && next->first < version->endPtr)
+        return next->first;
+
+    return version->endPtr;
+}
 
-            case GET_CHAR_CODE:
-            {
-                auto idx = (size_t)popInt32();
-                auto str = popStr();
+/// Decode the instructions of a compiled block version
+std::string disasmVersion(BlockVersion* version)
+{
+    assert (version->startPtr);
+
+    auto endPtr = versionEnd(version);
+
+    char buf[128];
+    snprintf(
+        buf,
+        sizeof(buf),
+        "v%zu %s, block %u, 0x%04zx, %zu bytes\n",
+        version->id,
+        profFunName(version->fun).c_str(),
+        version->block.getAuxIdx(),
+        heapOffset(version->startPtr),
+        (size_t)(endPtr - version->startPtr)
+    );
+    std::string out = buf;
+
+    for (auto ptr = version->startPtr; ptr < endPtr;)
+    {
+        snprintf(buf, sizeof(buf), "  0x%04zx  ", heapOffset(ptr));
+        out += buf;
 
-                if (idx >= str.length())
-                {
-                    throw RunError(
-                        "get_char_code, index out of bounds"
-                    );
-                }
+        auto op = *(Opcode*)ptr;
+        ptr += sizeof(Opcode);
+        out += opName(op);
 
-                pushVal(Value::int32(str[idx]));
-            }
+        switch (op)
+        {
+            case PUSH:
+            out += " " + disasmValue(*(Value*)ptr);
+            ptr += sizeof(Value);
             break;
 
-            case CHAR_TO_STR:
-            {
-                auto charCode = (char)popInt32();
-                char buf[2] = { (char)charCode, '\0' };
-                pushVal(String(buf));
-            }
+            case DUP:
+            case GET_LOCAL:
+            case SET_LOCAL:
+            out += " " + std::to_string(*(uint16_t*)ptr);
+            ptr += sizeof(uint16_t);
             break;
 
-            case STR_CAT:
-            {
-                auto a = popStr();
-                auto b = popStr();
-                auto c = String::concat(b, a);
-                pushVal(c);
-            }
+            case HAS_TAG:
+            out += " " + tagToStr(*(Tag*)ptr);
+            ptr += sizeof(Tag);
             break;
 
-            case EQ_STR:
-            {
-                auto arg1 = popStr();
-                auto arg0 = popStr();
-                pushBool(arg0 == arg1);
-            }
+            case JUMP:
+            case JUMP_STUB:
+            out += " " + disasmTarget(*(uint8_t**)ptr);
+            ptr += sizeof(uint8_t*);
             break;
 
-            //
-            // Object operations
-            //
+            case IF_TRUE:
+            out += " then:" + disasmTarget(*(uint8_t**)ptr);
+            ptr += sizeof(uint8_t*);
+            out += " else:" + disasmTarget(*(uint8_t**)ptr);
+            ptr += sizeof(uint8_t*);
+            break;
 
-            case NEW_OBJECT:
-            {
-                auto capacity = popInt32();
-                auto obj = Object::newObject(capacity);
-                pushVal(obj);
-            }
+            case COUNT_BLOCK:
+            case COUNT_BRANCH:
+            out += " v" + std::to_string((*(BlockVersion**)ptr)->id);
+            ptr += sizeof(BlockVersion*);
             break;
 
-            case HAS_FIELD:
+            case CALL:
             {
-                auto fieldName = popStr();
-                auto obj = popObj();
-                pushBool(obj.hasField(fieldName));
+                out += " num_args:" + std::to_string(*(uint16_t*)ptr);
+                ptr += sizeof(uint16_t);
+                auto retVer = *(BlockVersion**)ptr;
+                out += " ret_to:v" + std::to_string(retVer->id);
+                ptr += sizeof(BlockVersion*);
             }
             break;
 
-            case SET_FIELD:
-            {
-                auto val = popVal();
-                auto fieldName = popStr();
-                auto obj = popObj();
+            default:
+            break;
+        }
 
-                if (!isValidIdent(fieldName))
-                {
-                    throw RunError(
-                        "invalid identifier in set_field \"" +
-                        (std::string)fieldName + "\""
-                    );
-                }
+        out += "\n";
+    }
 
-                obj.setField(fieldName, val);
-            }
-            break;
+    if (endPtr < version->endPtr)
+    {
+        auto next = codeVersions[endPtr];
+        out += "  (falls through to v" + std::to_string(next->id) + ")\n";
+    }
 
-            // This instruction will abort execution if trying to
-            // access a field that is not present on an object.
-            // The running program is responsible for testing that
-            // fields exist before attempting to read them.
-            case GET_FIELD:
-            {
-                auto fieldName = popStr();
-                auto obj = popObj();
+    return out;
+}
 
-                if (!obj.hasField(fieldName))
-                {
-                    throw RunError(
-                        "get_field failed, missing field \"" +
-                        (std::string)fieldName + "\""
-                    );
-                }
+void writeCodeDump(std::string fileName)
+{
+    auto file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        throw RunError("could not open code dump file \"" + fileName + "\"");
+    }
 
-                auto val = obj.getField(fieldName);
-                pushVal(val);
-            }
-            break;
+    for (auto& pair : codeVersions)
+    {
+        fputs(disasmVersion(pair.second).c_str(), file);
+        fputs("\n", file);
+    }
 
-            case GET_FIELD_LIST:
-            {
-                Value arg0 = popVal();
-                Array array = Array(0);
-                for (auto itr = ObjFieldItr(arg0); itr.valid(); itr.next())
-                {
-                    auto fieldName = (String)itr.get();
-                    array.push(fieldName);
-                }
-                pushVal(array);
-            }
-            break;
+    fclose(file);
+}
 
-            case EQ_OBJ:
-            {
-                Value arg1 = popVal();
-                Value arg0 = popVal();
-                pushBool(arg0 == arg1);
-            }
-            break;
+void startJitLog(std::string fileName)
+{
+    jitLog = fopen(fileName.c_str(), "w");
+    if (!jitLog)
+    {
+        throw RunError("could not open JIT log file \"" + fileName + "\"");
+    }
+}
 
-            //
-            // Array operations
-            //
+/// Versions and code size of a function, for JIT summaries
+struct FunCodeStats
+{
+    std::string name;
+    size_t numVersions = 0;
+    size_t numCompiled = 0;
+    size_t numBytes = 0;
+};
 
-            case NEW_ARRAY:
-            {
-                auto len = popInt32();
-                auto array = Array(len);
-                pushVal(array);
-            }
-            break;
+void stopJitLog(size_t numFuns)
+{
+    assert (jitLog);
 
-            case ARRAY_LEN:
-            {
-                auto arr = Array(popVal());
-                pushVal(Value::int32(arr.length()));
-            }
-            break;
+    // Aggregate the versions of each function
+    std::unordered_map<refptr, FunCodeStats> funMap;
+    size_t numCompiled = 0;
 
-            case ARRAY_PUSH:
+    for (size_t i = 1; i < blockInfos.size(); ++i)
+    {
+        for (auto version : blockInfos[i].versions)
+        {
+            auto& stats = funMap[(refptr)version->fun];
+            stats.numVersions++;
+
+            if (version->startPtr)
             {
-                auto val = popVal();
-                auto arr = Array(popVal());
-                arr.push(val);
+                auto endPtr = versionEnd(version);
+                stats.numCompiled++;
+                stats.numBytes += endPtr - version->startPtr;
+                numCompiled++;
             }
-            break;
+        }
+    }
 
-            case SET_ELEM:
-            {
-                auto val = popVal();
-                auto idx = (size_t)popInt32();
-                auto arr = Array(popVal());
+    std::vector<FunCodeStats> funStats;
+    for (auto& pair : funMap)
+    {
+        pair.second.name = profFunName(Object(Value(pair.first, TAG_OBJECT)));
+        funStats.push_back(pair.second);
+    }
 
-                if (idx >= arr.length())
-                {
-                    throw RunError(
-                        "set_elem, index out of bounds"
-                    );
-                }
+    std::sort(
+        funStats.begin(),
+        funStats.end(),
+        [](const FunCodeStats& a, const FunCodeStats& b)
+        {
+            return a.numBytes > b.numBytes;
+        }
+    );
 
-                arr.setElem(idx, val);
-            }
-            break;
+    for (auto& stats : funStats)
+    {
+        fprintf(
+            jitLog,
+            "{\"event\": \"function\", \"fun\": \"%s\", \"versions\": %zu, "
+            "\"compiled\": %zu, \"bytes\": %zu}\n",
+            stats.name.c_str(),
+            stats.numVersions,
+            stats.numCompiled,
+            stats.numBytes
+        );
+    }
 
-            case GET_ELEM:
-            {
-                auto idx = (size_t)popInt32();
-                auto arr = Array(popVal());
+    fclose(jitLog);
+    jitLog = nullptr;
 
-                if (idx >= arr.length())
-                {
-                    throw RunError(
-                        "get_elem, index out of bounds"
-                    );
-                }
+    printf("jit summary:\n");
+    printf("  versions created: %zu\n", numVersionsCreated);
+    printf("  versions compiled: %zu\n", numCompiled);
+    printf("  functions with versions: %zu\n", funStats.size());
+    printf("  code heap: %zu / %zu bytes\n", codeHeapSize(), CODE_HEAP_INIT_SIZE);
+    printf("  stubs patched: %zu\n", numStubsPatched);
+    printf("  jumps elided: %zu\n", numJumpsElided);
+    printf("  largest functions:\n");
+    printf("    %-32s %10s %10s\n", "function", "versions", "bytes");
 
-                pushVal(arr.getElem(idx));
-            }
-            break;
+    for (size_t i = 0; i < funStats.size() && i < numFuns; ++i)
+    {
+        printf(
+            "    %-32s %10zu %10zu\n",
+            funStats[i].name.c_str(),
+            funStats[i].numVersions,
+            funStats[i].numBytes
+        );
+    }
+}
 
-            //
-            // Branch instructions
-            //
+/// Get the size of the operands following an opcode in the code heap
+size_t operandSize(Opcode op)
+{
+    switch (op)
+    {
+        case PUSH:
+        return sizeof(Value);
 
-            case JUMP_STUB:
-            {
-                auto& dstAddr = readCode<uint8_t*>();
+        case DUP:
+        case GET_LOCAL:
+        case SET_LOCAL:
+        return sizeof(uint16_t);
 
-                //std::cout << "Patching jump" << std::endl;
+        case HAS_TAG:
+        return sizeof(Tag);
 
-                auto dstVer = (BlockVersion*)dstAddr;
+        case JUMP:
+        case JUMP_STUB:
+        return sizeof(uint8_t*);
 
-                if (!dstVer->startPtr)
-                {
-                    // If the heap allocation pointer is right
-                    // after the jump instruction
-                    if (instrPtr == codeHeapAlloc)
-                    {
-                        // The jump is redundant, so we will write the
-                        // next block over this jump instruction
-                        instrPtr = codeHeapAlloc = (uint8_t*)&op;
-                    }
+        case IF_TRUE:
+        return 2 * sizeof(uint8_t*);
 
-                    compile(dstVer);
-                }
-                else
-                {
-                    // Patch the jump
-                    op = JUMP;
-                    dstAddr = dstVer->startPtr;
+        case CALL:
+        return sizeof(uint16_t) + sizeof(BlockVersion*);
 
-                    // Jump to the target
-                    instrPtr = dstVer->startPtr;
-                }
-            }
-            break;
+        case COUNT_BLOCK:
+        case COUNT_BRANCH:
+        return sizeof(BlockVersion*);
 
-            case JUMP:
-            {
-                auto& dstAddr = readCode<uint8_t*>();
-                instrPtr = dstAddr;
-            }
-            break;
+        default:
+        return 0;
+    }
+}
+
+/// Path signal-triggered heap snapshots are written to
+std::string heapSnapshotPath;
+
+/// Number of heap snapshots written on SIGUSR1
+size_t numSignalSnapshots = 0;
+
+/// Maximum number of bytes of text written per string
+const size_t SNAPSHOT_TEXT_LEN = 64;
+
+/// Escape text for a heap snapshot, so that it contains no spaces
+std::string snapshotEscape(const char* str, size_t len)
+{
+    std::string out;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        auto ch = (uint8_t)str[i];
+
+        if (ch <= ' ' || ch == '%' || ch >= 0x7F)
+        {
+            char buf[4];
+            snprintf(buf, sizeof(buf), "%%%02X", ch);
+            out += buf;
+            continue;
+        }
+
+        out += ch;
+    }
+
+    return out;
+}
+
+std::string snapshotEscape(const std::string& str)
+{
+    return snapshotEscape(str.data(), str.length());
+}
+
+/// Look up the allocation info of a heap block, if it was tracked
+bool findBlockAlloc(refptr ptr, BlockAllocInfo& info)
+{
+    std::lock_guard<std::mutex> lock(allocProfileLock);
 
-            case IF_TRUE:
-            {
-                auto& thenAddr = readCode<uint8_t*>();
-                auto& elseAddr = readCode<uint8_t*>();
+    auto itr = blockAllocs.find(ptr);
+    if (itr == blockAllocs.end())
+        return false;
 
-                auto arg0 = popVal();
+    info = itr->second;
+    return true;
+}
 
-                if (arg0 == Value::TRUE)
-                {
-                    if (thenAddr < codeHeap || thenAddr >= codeHeapLimit)
-                    {
-                        //std::cout << "Patching then target" << std::endl;
+/**
+Heap snapshot writer. Blocks are numbered as they are first
+referenced, and written in the format described in heapsnap.h.
+*/
+class HeapSnapshotWriter
+{
+private:
 
-                        auto thenVer = (BlockVersion*)thenAddr;
-                        if (!thenVer->startPtr)
-                           compile(thenVer);
+    FILE* file;
 
-                        // Patch the jump
-                        thenAddr = thenVer->startPtr;
-                    }
+    /// Ids of the blocks referenced so far
+    std::unordered_map<refptr, size_t> nodeIds;
 
-                    instrPtr = thenAddr;
-                }
-                else
-                {
-                    if (elseAddr < codeHeap || elseAddr >= codeHeapLimit)
-                    {
-                       //std::cout << "Patching else target" << std::endl;
+    /// Blocks referenced but not written yet
+    std::vector<Value> pending;
 
-                       auto elseVer = (BlockVersion*)elseAddr;
-                       if (!elseVer->startPtr)
-                           compile(elseVer);
+    /// Ids of the allocation sites of the blocks written
+    std::unordered_map<AllocSite, size_t, AllocSiteHash> siteIds;
 
-                       // Patch the jump
-                       elseAddr = elseVer->startPtr;
-                    }
+    /// Root references written, to skip duplicates
+    std::unordered_set<std::string> roots;
 
-                    instrPtr = elseAddr;
-                }
-            }
-            break;
+    bool isHeapVal(Value val)
+    {
+        return val.isString() || val.isArray() || val.isObject();
+    }
 
-            // Regular function call
-            case CALL:
-            {
-                auto numArgs = readCode<uint16_t>();
-                auto retVer = readCode<BlockVersion*>();
+    /// Get the id of a referenced block, or "-" for other values
+    std::string ref(Value val)
+    {
+        if (!isHeapVal(val))
+            return "-";
+
+        auto ptr = (refptr)val;
+        auto itr = nodeIds.find(ptr);
+        if (itr != nodeIds.end())
+            return std::to_string(itr->second);
+
+        auto id = nodeIds.size() + 1;
+        nodeIds[ptr] = id;
+        pending.push_back(val);
+        return std::to_string(id);
+    }
 
-                auto callee = popVal();
+    /// Get the size of a block and the id of its allocation site.
+    /// The sizes of untracked blocks are those of their contents.
+    std::string sizeAndSite(Value val)
+    {
+        auto ptr = (refptr)val;
+        auto contentsPtr = getContentsPtr(val);
 
-                if (stackSize() < numArgs)
-                {
-                    throw RunError(
-                        "stack underflow at call"
-                    );
-                }
+        BlockAllocInfo info;
+        if (!findBlockAlloc(ptr, info))
+            return std::to_string(getContentsSize(val)) + " 0";
 
-                if (callee.isObject())
-                {
-                    funCall((uint8_t*)&op, callee, numArgs, retVer);
-                }
-                else if (callee.isHostFn())
-                {
-                    hostCall((uint8_t*)&op, callee, numArgs, retVer);
-                }
-                else
-                {
-                  throw RunError("invalid callee at call site");
-                }
-            }
-            break;
+        size_t size = info.size;
 
-            case RET:
-            {
-                // TODO: figure out callee identity from version,
-                // caller identity from return address
-                //
-                // We want args to have been consumed
-                // We pop all our locals (or the caller does)
-                //
-                // The thing is... The caller can't pop our locals,
-                // because the call continuation doesn't know
+        // Grown arrays and objects also hold the block of their contents
+        BlockAllocInfo contentsInfo;
+        if (contentsPtr != ptr)
+        {
+            bool found = findBlockAlloc(contentsPtr, contentsInfo);
+            size += found? contentsInfo.size:getContentsSize(val);
+        }
 
-                // Pop the return value
-                auto retVal = popVal();
+        auto itr = siteIds.find(info.site);
+        auto siteId = siteIds.size() + 1;
+        if (itr != siteIds.end())
+            siteId = itr->second;
+        else
+            siteIds[info.site] = siteId;
 
-                // Pop the return address
-                auto retVer = (BlockVersion*)popVal().getWord().ptr;
+        return std::to_string(size) + " " + std::to_string(siteId);
+    }
 
-                // Pop the previous frame pointer
-                auto prevFramePtr = popVal().getWord().ptr;
+    void writeNode(Value val)
+    {
+        auto id = nodeIds[(refptr)val];
+        auto line = std::to_string(id) + " " + sizeAndSite(val);
 
-                // Pop the previous stack pointer
-                auto prevStackPtr = popVal().getWord().ptr;
+        if (val.isString())
+        {
+            auto str = String(val);
+            auto data = str.getDataPtr();
+            auto len = str.length();
 
-                // Restore the previous frame pointer
-                framePtr = (Value*)prevFramePtr;
+            // 64-bit FNV-1a hash of the contents
+            uint64_t hash = 0xCBF29CE484222325;
+            for (size_t i = 0; i < len; ++i)
+                hash = (hash ^ (uint8_t)data[i]) * 0x100000001B3;
 
-                // Restore the stack pointer
-                stackPtr = (Value*)prevStackPtr;
+            char hashStr[32];
+            snprintf(hashStr, sizeof(hashStr), "%016llx", (unsigned long long)hash);
 
-                // If this is a top-level return
-                if (retVer == nullptr)
-                {
-                    return retVal;
-                }
-                else
-                {
-                    // Push the return value on the stack
-                    pushVal(retVal);
+            auto text = snapshotEscape(data, std::min(len, (uint32_t)SNAPSHOT_TEXT_LEN));
+            fprintf(file, "str %s %u %s %s\n", line.c_str(), len, hashStr, text.c_str());
+        }
+        else if (val.isArray())
+        {
+            auto arr = Array(val);
+            auto len = arr.length();
+            line += " " + std::to_string(len);
 
-                    if (!retVer->startPtr)
-                        compile(retVer);
+            for (size_t i = 0; i < len; ++i)
+                line += " " + ref(arr.getElem(i));
 
-                    instrPtr = retVer->startPtr;
-                }
-            }
-            break;
+            fprintf(file, "arr %s\n", line.c_str());
+        }
+        else
+        {
+            std::string fields;
+            size_t numFields = 0;
 
-            // Throw an exception
-            case THROW:
+            for (auto itr = ObjFieldItr(Object(val)); itr.valid(); itr.next())
             {
-                // Pop the exception value
-                auto excVal = popVal();
-                throwExc((uint8_t*)&op, excVal);
+                fields += " " + ref(itr.getName()) + " " + ref(itr.getVal());
+                numFields++;
             }
-            break;
 
-            case IMPORT:
-            {
-                auto pkgName = (std::string)popVal();
-                auto pkg = import(pkgName);
-                pushVal(pkg);
-            }
-            break;
+            fprintf(file, "obj %s %zu%s\n", line.c_str(), numFields, fields.c_str());
+        }
+    }
 
-            case ABORT:
-            {
-                auto errMsg = (std::string)popStr();
+public:
 
-                auto srcPos = getSrcPos((uint8_t*)&op);
-                if (srcPos != Value::UNDEF)
-                    std::cout << posToString(srcPos) << " - ";
+    HeapSnapshotWriter(FILE* file)
+    : file(file)
+    {
+        fprintf(file, "zeta-heap-snapshot 1\n");
+    }
 
-                if (errMsg != "")
-                {
-                    std::cout << "aborting execution due to error: ";
-                    std::cout << errMsg << std::endl;
-                }
-                else
-                {
-                    std::cout << "aborting execution due to error" << std::endl;
-                }
+    void addRoot(std::string label, Value val)
+    {
+        if (!isHeapVal(val))
+            return;
 
-                exit(-1);
-            }
-            break;
+        auto line = "root " + snapshotEscape(label) + " " + ref(val);
+        if (roots.insert(line).second)
+            fprintf(file, "%s\n", line.c_str());
+    }
 
-            default:
-            assert (false && "unhandled instruction in interpreter loop");
+    /// Write the blocks reachable from the roots and their sites
+    void finish()
+    {
+        while (!pending.empty())
+        {
+            auto val = pending.back();
+            pending.pop_back();
+            writeNode(val);
         }
 
+        for (auto& pair : siteIds)
+        {
+            auto site = pair.first;
+            auto fun = (
+                site.first?
+                profFunName(Object(Value(site.first, TAG_OBJECT))):
+                std::string("<outside guest code>")
+            );
+            auto pos = (
+                (site.second != SRC_POS_NONE)?
+                snapshotEscape(srcPosToString(site.second)):
+                std::string("-")
+            );
+
+            fprintf(
+                file,
+                "site %zu %s %s\n",
+                pair.second,
+                snapshotEscape(fun).c_str(),
+                pos.c_str()
+            );
+        }
     }
+};
 
-    assert (false);
-}
-
-/// Begin the execution of a function
-/// Note: this may be indirectly called from within a running interpreter
-Value callFun(Object fun, ValueVec args)
+void writeHeapSnapshot(std::string fileName)
 {
-    static ICache numParamsIC("num_params");
-    static ICache numLocalsIC("num_locals");
-    auto numParams = numParamsIC.getInt32(fun);
-    auto numLocals = numLocalsIC.getInt32(fun);
+    auto file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        throw RunError("could not open heap snapshot file \"" + fileName + "\"");
+    }
 
-    if (args.size() != numParams)
+    HeapSnapshotWriter writer(file);
+
+    // Arguments, locals and temporaries of all frames on the stack
+    for (auto valPtr = stackPtr; valPtr < stackBase; ++valPtr)
+        writer.addRoot("stack", *valPtr);
+
+    for (auto& pkg : getLoadedPkgs())
+        writer.addRoot("pkg:" + pkg.first, pkg.second);
+
+    // Functions and blocks with versions, kept alive by the code heap
+    for (size_t i = 1; i < blockInfos.size(); ++i)
     {
-        throw RunError(
-            "argument count mismatch in top-level call"
-        );
+        for (auto version : blockInfos[i].versions)
+        {
+            writer.addRoot("code", version->fun);
+            writer.addRoot("code", version->block);
+        }
     }
 
-    if (numLocals < numParams + 1)
+    // Constants pushed by compiled code
+    for (auto& pair : codeVersions)
     {
-        throw RunError(
-            "not enough locals to store function parameters in top-level call"
-        );
+        auto endPtr = versionEnd(pair.second);
+
+        for (auto ptr = pair.first; ptr < endPtr;)
+        {
+            auto op = *(Opcode*)ptr;
+            ptr += sizeof(Opcode);
+
+            if (op == PUSH)
+                writer.addRoot("code", *(Value*)ptr);
+
+            ptr += operandSize(op);
+        }
     }
 
-    // Store the stack size before the call
-    auto preCallSz = stackSize();
+    writer.finish();
+    fclose(file);
+}
 
-    // Save the previous instruction pointer
-    pushVal(Value((refptr)instrPtr, TAG_RAWPTR));
+/// Write a heap snapshot requested with SIGUSR1
+void writeRequestedSnapshot()
+{
+    heapSnapshotReq = 0;
 
-    // Save the previous stack and frame pointers
-    auto prevStackPtr = stackPtr;
-    auto prevFramePtr = framePtr;
+    auto fileName = heapSnapshotPath + "." + std::to_string(++numSignalSnapshots);
+    writeHeapSnapshot(fileName);
 
-    // Initialize the frame pointer (used to access locals)
-    framePtr = stackPtr - 1;
+    std::cerr << "heap snapshot written to " << fileName << std::endl;
+}
 
-    // Push space for the local variables
-    stackPtr -= numLocals;
-    assert (stackPtr >= stackLimit);
+void startHeapSnapshots(std::string fileName)
+{
+    heapSnapshotPath = fileName;
 
-    // Push the previous stack pointer, previous
-    // frame pointer and return address
-    pushVal(Value((refptr)prevStackPtr, TAG_RAWPTR));
-    pushVal(Value((refptr)prevFramePtr, TAG_RAWPTR));
-    pushVal(Value(nullptr, TAG_RAWPTR));
+    trackingAllocs = true;
+    updateAllocHook();
 
-    // Copy the arguments into the locals
-    for (size_t i = 0; i < args.size(); ++i)
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) { heapSnapshotReq = 1; };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+}
+
+/// Print statistics about the interpreter and compiled code
+void printInterpStats()
+{
+    // Histogram of the number of versions per block
+    std::vector<size_t> histogram;
+    size_t numVersions = 0;
+
+    for (size_t i = 1; i < blockInfos.size(); ++i)
     {
-        //std::cout << "  " << args[i].toString() << std::endl;
-        framePtr[-i] = args[i];
+        auto count = blockInfos[i].versions.size();
+        if (count >= histogram.size())
+            histogram.resize(count + 1, 0);
+        histogram[count]++;
+        numVersions += count;
     }
 
-    // Store the function/closure parameter
-    framePtr[-numParams] = fun;
-
-    // Get the function entry block
-    static ICache entryIC("entry");
-    auto entryBlock = entryIC.getObj(fun);
-    auto entryVer = getBlockVersion(fun, entryBlock);
+    auto numBlocks = blockInfos.size() - 1;
 
-    // Generate code for the entry block version
-    compile(entryVer);
-    assert (entryVer->length() > 0);
+    std::cout << "num blocks: " << numBlocks << std::endl;
+    std::cout << "num versions: " << numVersions << std::endl;
+    std::cout << "max versions per block: ";
+    std::cout << (histogram.empty()? 0:histogram.size() - 1) << std::endl;
 
-    // Begin execution at the entry block
-    instrPtr = entryVer->startPtr;
-    auto retVal = execCode();
+    for (size_t count = 1; count < histogram.size(); ++count)
+    {
+        if (histogram[count] == 0)
+            continue;
 
-    // Restore the previous instruction pointer
-    instrPtr = (uint8_t*)popVal().getWord().ptr;
+        std::cout << "  blocks with " << count << " version(s): ";
+        std::cout << histogram[count] << std::endl;
+    }
 
-    // Check that the stack size matches what it was before the call
-    if (stackSize() != preCallSz)
+    std::cout << "code heap size: " << codeHeapSize() << " bytes" << std::endl;
+    std::cout << "stubs patched: " << numStubsPatched << std::endl;
+    std::cout << "jumps elided: " << numJumpsElided << std::endl;
+
+    std::cout << "functions verified: " << numFunsVerified << std::endl;
+    std::cout << "functions precompiled: " << numFunsPrecompiled << std::endl;
+    std::cout << "instrs compiled: " << numInstrsCompiled << std::endl;
+    std::cout << "compile time: " << (compileTime * 1000) << " ms" << std::endl;
+    std::cout << "instrs compiled per second: ";
+    std::cout << (size_t)(compileTime > 0? numInstrsCompiled / compileTime:0);
+    std::cout << std::endl;
+
+    size_t numParsed;
+    auto numDefs = numLazyDefs(numParsed);
+    if (numDefs > 0)
     {
-        throw RunError("stack size does not match after call termination");
+        std::cout << "lazy image defs parsed: " << numParsed;
+        std::cout << " / " << numDefs << std::endl;
     }
 
-    return retVal;
+    // Note: ru_maxrss is in kilobytes on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "peak RSS: " << usage.ru_maxrss << " KB" << std::endl;
 }
 
 /// Call a function exported by a package
@@ -2003,6 +4281,27 @@ Value testRunImage(std::string fileName)
     return callExportFn(pkg, "main");
 }
 
+/// Test that a function fails verification
+void testVerifyFail(std::string imageStr)
+{
+    std::cout << imageStr << std::endl;
+
+    auto pkg = Object(parseString(imageStr, "verify_fail_test"));
+
+    try
+    {
+        callExportFn(pkg, "main");
+    }
+
+    catch (RunError& e)
+    {
+        return;
+    }
+
+    std::cout << "verification did not fail" << std::endl;
+    exit(-1);
+}
+
 void testInterp()
 {
     assert (testRunImage("tests/vm/ex_ret_cst.zim") == Value::int32(777));
@@ -2011,4 +4310,78 @@ void testInterp()
     assert (testRunImage("tests/vm/ex_rec_fact.zim") == Value::int32(5040));
     assert (testRunImage("tests/vm/ex_fibonacci.zim") == Value::int32(377));
     assert (testRunImage("tests/vm/float_ops.zim").toString() == "10.500000");
+
+    // Precompiled code runs without invoking the compiler
+    {
+        auto pkg = Object(parseFile("tests/vm/ex_fibonacci.zim"));
+        precompileAll(pkg);
+        auto heapSize = codeHeapSize();
+        assert (callExportFn(pkg, "main") == Value::int32(377));
+        assert (codeHeapSize() == heapSize);
+    }
+
+    // Compiled versions decode back to their instructions
+    {
+        auto pkg = Object(parseFile("tests/vm/ex_fibonacci.zim"));
+        precompileAll(pkg);
+        auto fun = Object(pkg.getField("main"));
+        auto version = getBlockVersion(fun, Object(fun.getField("entry")));
+        auto code = disasmVersion(version);
+        assert (code.find("push \"core/io\"") != std::string::npos);
+        assert (code.find("set_local 1") != std::string::npos);
+    }
+
+    // Block entries and branch directions are counted
+    {
+        countingBlocks = true;
+        auto pkg = Object(parseFile("tests/vm/ex_fibonacci.zim"));
+        assert (callExportFn(pkg, "main") == Value::int32(377));
+        countingBlocks = false;
+
+        // fib(14) makes 1219 calls, of which 610 reach the base case
+        BlockVersion* fibVer = nullptr;
+        for (auto version : getAllVersions())
+        {
+            if (version->numThen + version->numElse > 0 &&
+                profFunName(version->fun) == "fib")
+                fibVer = version;
+        }
+        assert (fibVer);
+        assert (fibVer->numEntries == 1219);
+        assert (fibVer->numThen == 610);
+        assert (fibVer->numElse == 609);
+        assert (disasmVersion(fibVer).find("count_branch") != std::string::npos);
+    }
+
+    // Stack underflow
+    testVerifyFail(
+        "b = { instrs: [{ op:'pop' }, { op:'ret' }] };"
+        "{ main: { num_params:0, num_locals:1, entry:@b } };"
+    );
+
+    // Extra values on the stack at return
+    testVerifyFail(
+        "b = { instrs: [{ op:'push', val:1 }, { op:'push', val:2 }, { op:'ret' }] };"
+        "{ main: { num_params:0, num_locals:1, entry:@b } };"
+    );
+
+    // Local index out of range
+    testVerifyFail(
+        "b = { instrs: [{ op:'get_local', idx:1 }, { op:'ret' }] };"
+        "{ main: { num_params:0, num_locals:1, entry:@b } };"
+    );
+
+    // Block falling through its end
+    testVerifyFail(
+        "b = { instrs: [{ op:'push', val:1 }] };"
+        "{ main: { num_params:0, num_locals:1, entry:@b } };"
+    );
+
+    // Inconsistent stack depth at a block entry
+    testVerifyFail(
+        "r = { instrs: [{ op:'ret' }] };"
+        "e = { instrs: [{ op:'push', val:1 }, { op:'push', val:2 }, { op:'jump', to:@r }] };"
+        "b = { instrs: [{ op:'push', val:$true }, { op:'if_true', then:@r, else:@e }] };"
+        "{ main: { num_params:0, num_locals:1, entry:@b } };"
+    );
 }
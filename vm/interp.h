@@ -1,13 +1,154 @@
 #pragma once
 
+#include <cassert>
+#include <string>
 #include <vector>
 #include "runtime.h"
 
 typedef std::vector<Value> ValueVec;
 
+/// Inline cache to speed up property lookups
+class ICache
+{
+private:
+
+    // Cached slot index
+    size_t slotIdx = 0;
+
+    // Field name to look up
+    std::string fieldName;
+
+public:
+
+    ICache(std::string fieldName)
+    : fieldName(fieldName)
+    {
+    }
+
+    Value getField(Object obj)
+    {
+        Value val;
+
+        if (!obj.getField(fieldName.c_str(), val, slotIdx))
+        {
+            throw RunError("missing field \"" + fieldName + "\"");
+        }
+
+        return val;
+    }
+
+    /// Look up a field which may be absent, without throwing
+    bool tryGetField(Object obj, Value& val)
+    {
+        return obj.getField(fieldName.c_str(), val, slotIdx);
+    }
+
+    int32_t getInt32(Object obj)
+    {
+        auto val = getField(obj);
+        assert (val.isInt32());
+        return (int32_t)val;
+    }
+
+    String getStr(Object obj)
+    {
+        auto val = getField(obj);
+        assert (val.isString());
+        return String(val);
+    }
+
+    Object getObj(Object obj)
+    {
+        auto val = getField(obj);
+        assert (val.isObject());
+        return Object(val);
+    }
+
+    Array getArr(Object obj)
+    {
+        auto val = getField(obj);
+        assert (val.isArray());
+        return Array(val);
+    }
+};
+
+class BlockVersion;
+
 /// Initialize the interpreter
 void initInterp();
 
+/// Print statistics about the interpreter and compiled code
+void printInterpStats();
+
+/// Get the number of bytes of code compiled so far
+size_t codeHeapSize();
+
+/// Get the total time spent compiling, in seconds
+double getCompileTime();
+
+/// Measure compile times, needed by --stats and --bench
+void enableCompileTiming();
+
+/// Start sampling guest-level stacks
+void startProfiler();
+
+/// Stop sampling and write the samples as folded stacks,
+/// the input format of flame graph tools
+void writeProfile(std::string fileName);
+
+/// Start attributing heap allocations to functions and source positions
+void startAllocProfile();
+
+/// Print the top allocation sites and a histogram by tag and size
+void printAllocProfile(size_t numSites);
+
+/// Check if the opcode profiler was compiled in
+/// (configure with --enable-profile-ops)
+bool opProfilingEnabled();
+
+/// Print the opcode execution profile
+void printOpProfile();
+
+/// Write the opcode execution profile to a JSON file
+void writeOpProfile(std::string fileName);
+
+/// Start streaming JIT events (versions created, compiled, stubs patched)
+/// to a file, one JSON object per line
+void startJitLog(std::string fileName);
+
+/// Log per-function code statistics, close the JIT log and print a summary
+void stopJitLog(size_t numFuns);
+
+/// Decode the instructions of a compiled block version
+std::string disasmVersion(BlockVersion* version);
+
+/// Write the decoded contents of the code heap, one block version at a time
+void writeCodeDump(std::string fileName);
+
+/// Record the allocation site of every heap block, and write a heap
+/// snapshot to numbered files after the given path on SIGUSR1
+void startHeapSnapshots(std::string fileName);
+
+/// Write a snapshot of the heap reachable from the stack, loaded
+/// packages and compiled code, in the format described in heapsnap.h
+void writeHeapSnapshot(std::string fileName);
+
+/// Count block entries and if_true directions in code compiled from now on
+void startBlockCounts();
+
+/// Zero the counts gathered so far, ie: while the language package
+/// was parsing the program
+void resetBlockCounts();
+
+/// Print the most executed blocks and the most biased branches
+void printBlockCounts(size_t numRows);
+
+/// Write block entry and branch counts to a JSON file
+void writeBlockCounts(std::string fileName);
+
+/// Compile all functions reachable from a package ahead of time
+void precompileAll(Object pkg);
+
 /// Call a function exported by a package
 Value callExportFn(
     Object pkg,
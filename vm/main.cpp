@@ -1,10 +1,483 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <cmath>
 #include <iostream>
 #include <exception>
 #include "parser.h"
+#include "image.h"
 #include "interp.h"
 #include "core.h"
+#include "perf.h"
+#include "heapsnap.h"
+
+/// Number of allocation sites listed by --alloc-profile
+const size_t NUM_ALLOC_SITES = 20;
+
+/// Number of rows per table of the --block-counts report
+const size_t NUM_BLOCK_COUNT_ROWS = 20;
+
+/// Number of rows per table of --heap-summary
+const size_t NUM_HEAP_SUMMARY_ROWS = 20;
+
+/// Number of functions listed in the --jit-log summary
+const size_t NUM_JIT_FUNS = 10;
+
+/// Command-line options
+struct Options
+{
+    /// Print statistics on exit
+    bool stats = false;
+
+    /// Print heap allocation statistics on exit
+    bool heapStats = false;
+
+    /// Parse image files lazily
+    bool lazyLoad = false;
+
+    /// Cache language package parse results on disk
+    bool parseCache = true;
+
+    /// Compile the whole package before running its main function
+    bool aot = false;
+
+    /// Print the top allocation sites on exit
+    bool allocProfile = false;
+
+    /// Output path for sampled guest stacks in folded format
+    std::string profilePath;
+
+    /// Print the opcode execution profile on exit
+    bool profileOps = false;
+
+    /// Output path for the opcode execution profile in JSON format
+    std::string opProfilePath;
+
+    /// Print the most executed blocks and biased branches on exit
+    bool blockCounts = false;
+
+    /// Output path for block and branch counts in JSON format
+    std::string blockCountsPath;
+
+    /// Output path for the JIT event log
+    std::string jitLogPath;
+
+    /// Output path for the decoded code heap
+    std::string jitDisasmPath;
+
+    /// Output path for heap snapshots, written on SIGUSR1 and on exit
+    std::string heapSnapshotPath;
+
+    /// Heap snapshot file to summarize
+    std::string heapSummaryPath;
+
+    /// Report hardware performance counters per phase
+    bool perfCounters = false;
+
+    /// Output path when converting a package to a binary image
+    std::string binImagePath;
+
+    /// Output path when snapshotting a package after initialization
+    std::string snapshotPath;
+
+    /// Run a package from a snapshot file
+    bool fromSnapshot = false;
+
+    /// Run the package as a benchmark, reporting timings as JSON
+    bool bench = false;
+
+    /// Number of timed and warmup benchmark iterations
+    int benchIters = 10;
+    int benchWarmup = 2;
+
+    /// Path of the package to run
+    std::string pkgPath;
+};
+
+/// Parse the command-line arguments
+/// Returns false if the arguments are invalid
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        auto arg = std::string(argv[i]);
+
+        if (arg == "--stats")
+        {
+            opts.stats = true;
+            continue;
+        }
+
+        if (arg == "--heap-stats")
+        {
+            opts.heapStats = true;
+            continue;
+        }
+
+        if (arg == "--lazy-load")
+        {
+            opts.lazyLoad = true;
+            continue;
+        }
+
+        if (arg == "--no-parse-cache")
+        {
+            opts.parseCache = false;
+            continue;
+        }
+
+        if (arg == "--aot")
+        {
+            opts.aot = true;
+            continue;
+        }
+
+        if (arg == "--alloc-profile")
+        {
+            opts.allocProfile = true;
+            continue;
+        }
+
+        if (arg == "--perf-counters")
+        {
+            opts.perfCounters = true;
+            continue;
+        }
+
+        // Benchmark a package, ie: --bench pkg --iters 20 --warmup 5
+        if (arg == "--bench")
+        {
+            opts.bench = true;
+            continue;
+        }
+
+        if (arg == "--iters" || arg == "--warmup")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            auto count = atoi(argv[++i]);
+            if (count < 0 || (arg == "--iters" && count < 1))
+                return false;
+
+            (arg == "--iters"? opts.benchIters:opts.benchWarmup) = count;
+            continue;
+        }
+
+        // Sample guest stacks and write them for flame graphs
+        // ie: --profile out.folded
+        if (arg == "--profile")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.profilePath = argv[++i];
+            continue;
+        }
+
+        if (arg == "--profile-ops")
+        {
+            opts.profileOps = true;
+            continue;
+        }
+
+        // Write the opcode execution profile as JSON
+        // ie: --profile-ops-json out.json
+        if (arg == "--profile-ops-json")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.opProfilePath = argv[++i];
+            continue;
+        }
+
+        if (arg == "--block-counts")
+        {
+            opts.blockCounts = true;
+            continue;
+        }
+
+        // Write block and branch counts as JSON
+        // ie: --block-counts-json counts.json
+        if (arg == "--block-counts-json")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.blockCountsPath = argv[++i];
+            continue;
+        }
+
+        // Stream JIT events as JSON lines and print a summary
+        // ie: --jit-log jit.jsonl
+        if (arg == "--jit-log")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.jitLogPath = argv[++i];
+            continue;
+        }
+
+        // Dump the decoded code heap on exit
+        // ie: --jit-disasm code.txt
+        if (arg == "--jit-disasm")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.jitDisasmPath = argv[++i];
+            continue;
+        }
+
+        // Track allocation sites and write heap snapshots
+        // ie: --heap-snapshot out.heap
+        if (arg == "--heap-snapshot")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.heapSnapshotPath = argv[++i];
+            continue;
+        }
+
+        // Summarize a heap snapshot file
+        // ie: --heap-summary out.heap
+        if (arg == "--heap-summary")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.heapSummaryPath = argv[++i];
+            continue;
+        }
+
+        // Convert a package into a binary image
+        // ie: --compile-image in.zim out.zimb
+        if (arg == "--compile-image")
+        {
+            if (i + 2 >= argc || opts.pkgPath != "")
+                return false;
+
+            opts.pkgPath = argv[++i];
+            opts.binImagePath = argv[++i];
+            continue;
+        }
+
+        // Snapshot a package after initialization
+        // ie: --snapshot out.snap pkg
+        if (arg == "--snapshot")
+        {
+            if (i + 1 >= argc)
+                return false;
+
+            opts.snapshotPath = argv[++i];
+            continue;
+        }
+
+        // Run the main function of a snapshotted package
+        // ie: --from-snapshot pkg.snap
+        if (arg == "--from-snapshot")
+        {
+            opts.fromSnapshot = true;
+            continue;
+        }
+
+        // Unknown option
+        if (arg.substr(0, 2) == "--")
+        {
+            return false;
+        }
+
+        // Only one package path may be specified
+        if (opts.pkgPath != "")
+        {
+            return false;
+        }
+
+        opts.pkgPath = arg;
+    }
+
+    return opts.pkgPath != "" || opts.heapSummaryPath != "";
+}
+
+/// Initialize a loaded package
+void runInit(Object pkg)
+{
+    if (pkg.hasField("init"))
+    {
+        callExportFn(pkg, "init");
+    }
+}
+
+/// Load and initialize a package
+Object initPkg(std::string pkgPath)
+{
+    auto pkg = load(pkgPath);
+    runInit(pkg);
+    return pkg;
+}
+
+/// Run the main function of an initialized package
+int runMain(Object pkg)
+{
+    // Call the main function, if present
+    if (pkg.hasField("main"))
+    {
+        auto retVal = callExportFn(pkg, "main");
+
+        if (!retVal.isInt32())
+        {
+            throw RunError(
+                "main function should return an int64 value"
+            );
+        }
+
+        return (int32_t)retVal;
+    }
+
+    return 0;
+}
+
+/// Time a function call, in milliseconds
+template <typename Fn> double timeMs(Fn fn)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> deltaTime =
+        std::chrono::steady_clock::now() - startTime;
+    return deltaTime.count();
+}
+
+/**
+Run a package repeatedly in-process and print timings as a JSON line
+The package is loaded once, then its main function is called for the
+warmup and timed iterations. Packages without a main function do their
+work in init, which is then the function being called repeatedly.
+*/
+int runBench(const Options& opts)
+{
+    // Counters read after each phase, ending with the timed iterations
+    std::vector<PerfCounts> perfCounts;
+    auto readPerf = [&]()
+    {
+        if (opts.perfCounters)
+            perfCounts.push_back(readPerfCounters());
+    };
+
+    if (opts.jitLogPath != "")
+    {
+        startJitLog(opts.jitLogPath);
+    }
+
+    readPerf();
+    auto resolveStart = resolveRefsNanos;
+    Value pkgVal;
+    auto loadMs = timeMs([&]() { pkgVal = load(opts.pkgPath); });
+    readPerf();
+    auto pkg = Object(pkgVal);
+
+    // Only counts images parsed on this thread, packages preloaded on
+    // worker threads are part of parse_ms
+    auto resolveMs = (resolveRefsNanos - resolveStart) / 1e6;
+    auto heapLoad = codeHeapSize();
+
+    auto hasMain = pkg.hasField("main");
+    if (!hasMain && !pkg.hasField("init"))
+    {
+        throw RunError("package exports neither main nor init");
+    }
+    std::string fnName = hasMain? "main":"init";
+
+    double initMs = 0;
+    if (hasMain && pkg.hasField("init"))
+    {
+        initMs = timeMs([&]() { callExportFn(pkg, "init"); });
+    }
+    auto heapInit = codeHeapSize();
+    readPerf();
+
+    auto compileStart = getCompileTime();
+    auto firstMs = timeMs([&]() { callExportFn(pkg, fnName); });
+    auto firstCompileMs = (getCompileTime() - compileStart) * 1000;
+    auto heapFirst = codeHeapSize();
+    readPerf();
+
+    for (int i = 0; i < opts.benchWarmup; ++i)
+    {
+        callExportFn(pkg, fnName);
+    }
+
+    // Counts summed over the timed iterations only
+    PerfCounts iterCounts;
+
+    std::vector<double> iterMs;
+    for (int i = 0; i < opts.benchIters; ++i)
+    {
+        auto perfStart = readPerfCounters();
+        iterMs.push_back(timeMs([&]() { callExportFn(pkg, fnName); }));
+
+        if (opts.perfCounters)
+        {
+            auto delta = readPerfCounters() - perfStart;
+            if (i == 0)
+                iterCounts = delta;
+            else
+                iterCounts += delta;
+        }
+    }
+
+    std::sort(iterMs.begin(), iterMs.end());
+    auto n = iterMs.size();
+    double sum = 0;
+    for (auto t : iterMs)
+        sum += t;
+
+    auto median = (n % 2)? iterMs[n/2]:(iterMs[n/2 - 1] + iterMs[n/2]) / 2;
+    auto p99 = iterMs[(size_t)std::ceil(0.99 * n) - 1];
+
+    // The JIT summary is printed before the report, which comes last
+    if (opts.jitLogPath != "")
+    {
+        stopJitLog(NUM_JIT_FUNS);
+    }
+
+    if (opts.jitDisasmPath != "")
+    {
+        writeCodeDump(opts.jitDisasmPath);
+    }
+
+    // The report is a single line, so that it can be told apart
+    // from the output of the benchmark itself
+    printf("{\"pkg\": \"%s\", \"bench_fn\": \"%s\", ", opts.pkgPath.c_str(), fnName.c_str());
+    printf("\"iters\": %d, \"warmup\": %d, ", opts.benchIters, opts.benchWarmup);
+    printf("\"parse_ms\": %.3f, \"resolve_refs_ms\": %.3f, ", loadMs - resolveMs, resolveMs);
+    printf("\"init_ms\": %.3f, \"first_call_ms\": %.3f, ", initMs, firstMs);
+    printf("\"first_call_compile_ms\": %.3f, ", firstCompileMs);
+    printf("\"iter_ms\": {\"min\": %.3f, \"median\": %.3f, ", iterMs[0], median);
+    printf("\"p99\": %.3f, \"mean\": %.3f}, ", p99, sum / n);
+    printf("\"code_heap_bytes\": {\"load\": %zu, \"init\": %zu, ", heapLoad, heapInit);
+    printf("\"first_call\": %zu, \"final\": %zu}", heapFirst, codeHeapSize());
+
+    if (opts.perfCounters)
+    {
+        const char* phaseNames[] = { "load", "init", "first_call" };
+
+        printf(", \"perf\": {");
+        for (size_t i = 0; i < 3; ++i)
+        {
+            auto counts = perfCounts[i + 1] - perfCounts[i];
+            printf("\"%s\": %s, ", phaseNames[i], counts.toJSON().c_str());
+        }
+        printf("\"iters\": %s}", iterCounts.toJSON().c_str());
+    }
+
+    printf("}\n");
+
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
@@ -19,40 +492,194 @@ int main(int argc, char** argv)
         {
             testRuntime();
             testParser();
+            testImage();
+            testCore();
             testInterp();
             return 0;
         }
 
-        if (argc == 2)
+        Options opts;
+
+        if (!parseArgs(argc, argv, opts))
+        {
+            std::cout << "Invalid command-line arguments" << std::endl;
+            return 0;
+        }
+
+        if ((opts.profileOps || opts.opProfilePath != "") &&
+            !opProfilingEnabled())
+        {
+            std::cout << "Opcode profiling requires a build configured ";
+            std::cout << "with --enable-profile-ops" << std::endl;
+            return -1;
+        }
+
+        lazyLoad = opts.lazyLoad;
+        parseCache = opts.parseCache;
+
+        if (opts.profilePath != "")
+        {
+            startProfiler();
+        }
+
+        if (opts.allocProfile)
+        {
+            startAllocProfile();
+        }
+
+        if (opts.heapStats)
+        {
+            vm.countingAllocs = true;
+        }
+
+        // Without counters, run as if they had not been requested
+        if (opts.perfCounters && !openPerfCounters())
+        {
+            std::cerr << "Performance counters unavailable (";
+            std::cerr << perfCountersError() << ")" << std::endl;
+            opts.perfCounters = false;
+        }
+
+        if (opts.heapSummaryPath != "")
+        {
+            printHeapSummary(opts.heapSummaryPath, NUM_HEAP_SUMMARY_ROWS);
+            return 0;
+        }
+
+        if (opts.heapSnapshotPath != "")
         {
-            auto fileName = argv[1];
-            auto pkg = load(fileName);
+            startHeapSnapshots(opts.heapSnapshotPath);
+        }
 
-            // Initialize the package
-            if (pkg.hasField("init"))
-            {
-                callExportFn(pkg, "init");
-            }
+        if (opts.blockCounts || opts.blockCountsPath != "")
+        {
+            startBlockCounts();
+        }
 
-            // Call the main function, if present
-            if (pkg.hasField("main"))
-            {
-                auto retVal = callExportFn(pkg, "main");
+        // The benchmark report includes the first call compile time
+        if (opts.stats || opts.bench)
+        {
+            enableCompileTiming();
+        }
 
-                if (!retVal.isInt32())
-                {
-                    throw RunError(
-                        "main function should return an int64 value"
-                    );
-                }
+        if (opts.bench)
+        {
+            return runBench(opts);
+        }
 
-                return (int32_t)retVal;
-            }
+        if (opts.binImagePath != "")
+        {
+            auto pkg = load(opts.pkgPath);
+            writeBinImage(pkg, opts.binImagePath);
+            return 0;
+        }
 
+        if (opts.snapshotPath != "")
+        {
+            auto pkg = initPkg(opts.pkgPath);
+            writeSnapshot(pkg, opts.snapshotPath);
             return 0;
         }
 
-        std::cout << "Invalid command-line arguments" << std::endl;
+        if (opts.jitLogPath != "")
+        {
+            startJitLog(opts.jitLogPath);
+        }
+
+        auto perfStart = readPerfCounters();
+
+        auto pkg = (
+            opts.fromSnapshot?
+            readSnapshot(opts.pkgPath):
+            load(opts.pkgPath)
+        );
+
+        auto perfLoaded = readPerfCounters();
+
+        // Blocks run while parsing would crowd out those of the program
+        if (opts.blockCounts || opts.blockCountsPath != "")
+        {
+            resetBlockCounts();
+        }
+
+        if (!opts.fromSnapshot)
+        {
+            runInit(pkg);
+        }
+
+        if (opts.aot)
+        {
+            precompileAll(pkg);
+        }
+
+        auto retVal = runMain(pkg);
+
+        auto perfDone = readPerfCounters();
+
+        if (opts.stats)
+        {
+            printInterpStats();
+        }
+
+        if (opts.heapStats)
+        {
+            vm.printHeapStats();
+        }
+
+        if (opts.profilePath != "")
+        {
+            writeProfile(opts.profilePath);
+        }
+
+        if (opts.allocProfile)
+        {
+            printAllocProfile(NUM_ALLOC_SITES);
+        }
+
+        if (opts.profileOps)
+        {
+            printOpProfile();
+        }
+
+        if (opts.opProfilePath != "")
+        {
+            writeOpProfile(opts.opProfilePath);
+        }
+
+        if (opts.blockCounts)
+        {
+            printBlockCounts(NUM_BLOCK_COUNT_ROWS);
+        }
+
+        if (opts.blockCountsPath != "")
+        {
+            writeBlockCounts(opts.blockCountsPath);
+        }
+
+        if (opts.jitLogPath != "")
+        {
+            stopJitLog(NUM_JIT_FUNS);
+        }
+
+        if (opts.heapSnapshotPath != "")
+        {
+            writeHeapSnapshot(opts.heapSnapshotPath);
+        }
+
+        if (opts.jitDisasmPath != "")
+        {
+            writeCodeDump(opts.jitDisasmPath);
+        }
+
+        if (opts.perfCounters)
+        {
+            printPerfCounters({
+                { "load", perfLoaded - perfStart },
+                { "execute", perfDone - perfLoaded }
+            });
+        }
+
+        return retVal;
     }
 
     catch (RunError& e)
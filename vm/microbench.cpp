@@ -0,0 +1,452 @@
+/**
+Microbenchmarks for the core runtime data structures
+
+Times object field accesses, inline caches, arrays, strings and heap
+allocation directly, without going through the interpreter, and
+reports nanoseconds per operation. Each benchmark is calibrated so
+that a sample lasts a few milliseconds, and is repeated when the
+spread between samples is too large to trust the median.
+*/
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "runtime.h"
+#include "interp.h"
+
+/// Function running a given number of operations
+typedef std::function<void(size_t numOps)> BenchFn;
+
+struct Bench
+{
+    std::string name;
+    BenchFn fn;
+};
+
+/// Statistics over the samples of one benchmark, in ns/op
+struct BenchResult
+{
+    std::string name;
+    double median;
+    double min;
+
+    /// Median absolute deviation, relative to the median
+    double spread;
+
+    /// Number of runs needed to get a stable measurement
+    size_t numRuns;
+    bool stable;
+};
+
+/// Microbenchmark options
+struct Options
+{
+    /// Only run benchmarks whose name contains this string
+    std::string filter;
+
+    /// Number of timed samples per run
+    size_t numSamples = 21;
+
+    /// Target duration of a sample, in milliseconds
+    double sampleMs = 2;
+
+    /// Maximum spread, in percent, for a measurement to be stable
+    double maxSpread = 3;
+
+    /// Maximum number of runs of an unstable benchmark
+    size_t maxRuns = 3;
+
+    /// Print results as JSON lines
+    bool json = false;
+};
+
+/// Keep the compiler from optimizing away a computed value
+template <typename T> inline void keep(const T& val)
+{
+    asm volatile("" : : "r,m"(val) : "memory");
+}
+
+/**
+Release a heap block directly. The heap is not garbage collected
+yet, and blocks are allocated with calloc, so benchmarks which
+allocate free their blocks to keep memory usage bounded.
+*/
+void freeBlock(Value val)
+{
+    free((refptr)val);
+}
+
+double timeNs(const BenchFn& fn, size_t numOps)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn(numOps);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+double median(std::vector<double> vals)
+{
+    std::sort(vals.begin(), vals.end());
+    auto n = vals.size();
+    return (n % 2)? vals[n/2]:(vals[n/2 - 1] + vals[n/2]) / 2;
+}
+
+/// Time one benchmark, rerunning it while its samples are too noisy
+BenchResult runBench(const Bench& bench, const Options& opts)
+{
+    // Double the batch size until a batch lasts one sample
+    size_t numOps = 1;
+    while (timeNs(bench.fn, numOps) < opts.sampleMs * 1e6 && numOps < (1 << 30))
+        numOps *= 2;
+
+    BenchResult best;
+    best.name = bench.name;
+
+    for (size_t run = 1; run <= opts.maxRuns; ++run)
+    {
+        // Warm up caches and the branch predictor
+        timeNs(bench.fn, numOps);
+
+        std::vector<double> samples;
+        for (size_t i = 0; i < opts.numSamples; ++i)
+            samples.push_back(timeNs(bench.fn, numOps) / numOps);
+
+        auto med = median(samples);
+
+        std::vector<double> devs;
+        for (auto sample : samples)
+            devs.push_back(std::fabs(sample - med));
+
+        BenchResult result;
+        result.name = bench.name;
+        result.median = med;
+        result.min = *std::min_element(samples.begin(), samples.end());
+        result.spread = 100 * median(devs) / med;
+        result.numRuns = run;
+        result.stable = result.spread <= opts.maxSpread;
+
+        if (run == 1 || result.spread < best.spread)
+            best = result;
+
+        best.numRuns = run;
+
+        if (best.stable)
+            break;
+    }
+
+    return best;
+}
+
+/// Create a name for the ith field of an object
+std::string fieldName(size_t i)
+{
+    return "field" + std::to_string(i);
+}
+
+/// Create an object with a given number of fields
+Object makeObject(size_t numFields)
+{
+    auto obj = Object::newObject(numFields);
+
+    for (size_t i = 0; i < numFields; ++i)
+        obj.setField(fieldName(i), Value::int32(i));
+
+    return obj;
+}
+
+std::vector<Bench> makeBenches()
+{
+    std::vector<Bench> benches;
+
+    // Lookups and updates of the last field added, by number of fields
+    for (size_t numFields : { 1, 4, 16, 64 })
+    {
+        auto obj = makeObject(numFields);
+        auto name = String(fieldName(numFields - 1));
+        auto suffix = "/" + std::to_string(numFields);
+
+        benches.push_back({ "obj_get_field" + suffix, [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                keep(obj.getField(name));
+        }});
+
+        benches.push_back({ "obj_set_field" + suffix, [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                obj.setField(name, Value::int32(i));
+            keep(obj);
+        }});
+
+        // Add fields to an empty object, ns per field
+        std::vector<String> names;
+        for (size_t i = 0; i < numFields; ++i)
+            names.push_back(String(fieldName(i)));
+
+        benches.push_back({ "obj_add_field" + suffix, [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; i += numFields)
+            {
+                auto newObj = Object::newObject(numFields);
+                for (size_t j = 0; j < numFields; ++j)
+                    newObj.setField(names[j], Value::int32(j));
+                freeBlock(newObj);
+            }
+        }});
+    }
+
+    // Inline cache lookups on a single object layout
+    {
+        auto obj = makeObject(16);
+        ICache ic(fieldName(15));
+
+        benches.push_back({ "icache_hit", [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                keep(ic.getField(obj));
+        }});
+    }
+
+    // Alternate between two objects storing the field in different
+    // slots, so that every lookup misses the cached slot index
+    {
+        auto obj0 = makeObject(16);
+        auto obj1 = Object::newObject(16);
+        obj1.setField(fieldName(15), Value::int32(0));
+        for (size_t i = 0; i < 15; ++i)
+            obj1.setField(fieldName(i), Value::int32(i));
+        ICache ic(fieldName(15));
+
+        benches.push_back({ "icache_miss", [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; i += 2)
+            {
+                keep(ic.getField(obj0));
+                keep(ic.getField(obj1));
+            }
+        }});
+    }
+
+    // Push onto an empty array, including capacity growth, ns per push
+    for (size_t arrLen : { 16, 1024 })
+    {
+        benches.push_back({ "arr_push/" + std::to_string(arrLen), [=](size_t numOps)
+        {
+            for (size_t i = 0; i < numOps; i += arrLen)
+            {
+                auto arr = Array(0);
+                auto contents = getContentsPtr(arr);
+
+                for (size_t j = 0; j < arrLen; ++j)
+                {
+                    arr.push(Value::int32(j));
+
+                    // Growing moves the contents to a new block, and the
+                    // previous one is no longer referenced
+                    auto newContents = getContentsPtr(arr);
+                    if (newContents != contents && contents != (refptr)arr)
+                        free(contents);
+                    contents = newContents;
+                }
+
+                keep(arr);
+                if (contents != (refptr)arr)
+                    free(contents);
+                freeBlock(arr);
+            }
+        }});
+    }
+
+    {
+        const size_t ARR_LEN = 1024;
+        auto arr = Array(ARR_LEN);
+        for (size_t i = 0; i < ARR_LEN; ++i)
+            arr.push(Value::int32(i));
+
+        benches.push_back({ "arr_get_elem", [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                keep(arr.getElem(i % ARR_LEN));
+        }});
+
+        benches.push_back({ "arr_set_elem", [=](size_t numOps) mutable
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                arr.setElem(i % ARR_LEN, Value::int32(i));
+            keep(arr);
+        }});
+    }
+
+    for (size_t strLen : { 8, 256 })
+    {
+        auto a = String(std::string(strLen, 'a'));
+        auto b = String(std::string(strLen, 'b'));
+
+        benches.push_back({ "str_concat/" + std::to_string(strLen), [=](size_t numOps)
+        {
+            for (size_t i = 0; i < numOps; ++i)
+            {
+                auto str = String::concat(a, b);
+                keep(str);
+                freeBlock(str);
+            }
+        }});
+
+        // Distinct strings with the same contents must be compared fully
+        auto a2 = String(std::string(strLen, 'a'));
+
+        benches.push_back({ "str_eq_same/" + std::to_string(strLen), [=](size_t numOps)
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                keep(a == a2);
+        }});
+
+        benches.push_back({ "str_eq_diff/" + std::to_string(strLen), [=](size_t numOps)
+        {
+            for (size_t i = 0; i < numOps; ++i)
+                keep(a == b);
+        }});
+    }
+
+    for (uint32_t size : { 16, 256, 4096 })
+    {
+        benches.push_back({ "vm_alloc/" + std::to_string(size), [=](size_t numOps)
+        {
+            for (size_t i = 0; i < numOps; ++i)
+            {
+                auto val = vm.alloc(size, TAG_OBJECT);
+                keep(val);
+                freeBlock(val);
+            }
+        }});
+    }
+
+    return benches;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        auto arg = std::string(argv[i]);
+
+        if (arg == "--json")
+        {
+            opts.json = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            return false;
+
+        // ie: --filter obj_get
+        if (arg == "--filter")
+        {
+            opts.filter = argv[++i];
+            continue;
+        }
+
+        if (arg == "--samples")
+        {
+            opts.numSamples = std::max(1, atoi(argv[++i]));
+            continue;
+        }
+
+        if (arg == "--sample-ms")
+        {
+            opts.sampleMs = atof(argv[++i]);
+            continue;
+        }
+
+        // Spread above which a benchmark is rerun, in percent
+        if (arg == "--max-spread")
+        {
+            opts.maxSpread = atof(argv[++i]);
+            continue;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+void printResult(const BenchResult& result, const Options& opts)
+{
+    if (opts.json)
+    {
+        printf(
+            "{\"name\": \"%s\", \"ns_per_op\": %.3f, \"min_ns\": %.3f, "
+            "\"spread_pct\": %.2f, \"runs\": %zu, \"stable\": %s}\n",
+            result.name.c_str(),
+            result.median,
+            result.min,
+            result.spread,
+            result.numRuns,
+            result.stable? "true":"false"
+        );
+        return;
+    }
+
+    printf(
+        "%-24s %10.2f %10.2f %8.2f%% %5zu  %s\n",
+        result.name.c_str(),
+        result.median,
+        result.min,
+        result.spread,
+        result.numRuns,
+        result.stable? "":"UNSTABLE"
+    );
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+
+    if (!parseArgs(argc, argv, opts))
+    {
+        std::cout << "usage: zeta-microbench [--filter NAME] [--samples N] ";
+        std::cout << "[--sample-ms MS] [--max-spread PCT] [--json]" << std::endl;
+        return -1;
+    }
+
+    if (!opts.json)
+    {
+        printf(
+            "%-24s %10s %10s %9s %5s\n",
+            "benchmark", "ns/op", "min", "spread", "runs"
+        );
+    }
+
+    size_t numUnstable = 0;
+
+    for (auto& bench : makeBenches())
+    {
+        if (bench.name.find(opts.filter) == std::string::npos)
+            continue;
+
+        auto result = runBench(bench, opts);
+        printResult(result, opts);
+        fflush(stdout);
+
+        if (!result.stable)
+            numUnstable++;
+    }
+
+    if (numUnstable > 0)
+    {
+        std::cerr << numUnstable << " benchmark(s) above ";
+        std::cerr << opts.maxSpread << "% spread, results may be noisy";
+        std::cerr << std::endl;
+    }
+
+    return 0;
+}
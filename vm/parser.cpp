@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <cinttypes>
 #include <string>
@@ -7,66 +9,109 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "runtime.h"
 #include "parser.h"
 
-/// Read an entire file at once
-std::string readFile(std::string fileName)
+const char* mapFile(std::string fileName, size_t& len)
 {
-    FILE* file = fopen(fileName.c_str(), "rb");
+    auto fd = open(fileName.c_str(), O_RDONLY);
 
-    if (!file)
+    if (fd < 0)
     {
-        fprintf(stderr, "failed to open file \"%s\"\n", fileName.c_str());
-        exit(-1);
+        throw RunError("failed to open file \"" + fileName + "\"");
     }
 
-    // Get the file size in bytes
-    fseek(file, 0, SEEK_END);
-    size_t len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    //printf("%ld bytes\n", len);
+    struct stat st;
+    fstat(fd, &st);
+    len = st.st_size;
 
-    char* buf = (char*)malloc(len+1);
+    // Empty files cannot be mapped
+    if (len == 0)
+    {
+        close(fd);
+        return "";
+    }
 
-    // Read into the allocated buffer
-    int read = fread(buf, 1, len, file);
+    auto ptr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    if (read != len)
+    if (ptr == MAP_FAILED)
     {
-        printf("failed to read file");
-        assert (false);
+        throw RunError("failed to map file \"" + fileName + "\"");
     }
 
-    // Add a null terminator to the string
-    buf[len] = '\0';
-
-    // Close the input file
-    fclose(file);
+    return (const char*)ptr;
+}
 
-    return std::string(buf);
+void unmapFile(const char* data, size_t len)
+{
+    // Empty files are not mapped
+    if (len > 0)
+        munmap((void*)data, len);
 }
 
 Input::Input(std::string fileName)
-: Input(readFile(fileName), fileName)
 {
-    // Note: if we ever need/want to implement parallel
-    // parsing, we could mmap the file instead of
-    // reading it into memory all at once
+    this->srcName = fileName;
+    this->mapData = mapFile(fileName, this->mapLen);
+    this->data = this->mapData;
+    this->dataLen = this->mapLen;
+    this->strIdx = 0;
+    this->lineNo = 1;
+    this->colNo = 1;
+
+    // The file is read front to back
+    if (mapLen > 0)
+        madvise((void*)mapData, mapLen, MADV_SEQUENTIAL);
 }
 
 Input::Input(std::string str, std::string srcName)
 {
     this->srcName = srcName;
     this->inStr = str;
+    this->data = this->inStr.c_str();
+    this->dataLen = this->inStr.length();
     this->strIdx = 0;
     this->lineNo = 1;
     this->colNo = 1;
 }
 
+Input::Input(
+    const char* data,
+    size_t dataLen,
+    std::string srcName,
+    size_t strIdx,
+    size_t lineNo,
+    size_t colNo
+)
+{
+    this->srcName = srcName;
+    this->data = data;
+    this->dataLen = dataLen;
+    this->strIdx = strIdx;
+    this->lineNo = lineNo;
+    this->colNo = colNo;
+}
+
 Input::~Input()
 {
+    unmapFile(mapData, mapLen);
+}
+
+void Input::releaseConsumed()
+{
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    // Keep the page being read from
+    auto endIdx = (strIdx / pageSize) * pageSize;
+
+    // The data is reloaded from the file if accessed again
+    madvise((void*)(mapData + releasedIdx), endIdx - releasedIdx, MADV_DONTNEED);
+    releasedIdx = endIdx;
 }
 
 /// Read a character from the input
@@ -88,6 +133,9 @@ char Input::readCh()
 
     this->strIdx++;
 
+    if (mapLen > 0 && strIdx >= releasedIdx + RELEASE_CHUNK)
+        releaseConsumed();
+
     if (ch == '\n')
     {
         lineNo++;
@@ -110,10 +158,10 @@ bool Input::eof()
 /// Peek at a character from the input
 char Input::peek()
 {
-    if (strIdx >= inStr.length())
+    if (strIdx >= dataLen)
         return '\0';
 
-    return inStr[strIdx];
+    return data[strIdx];
 }
 
 /// Peek to see if a specific character is next in the input
@@ -129,10 +177,10 @@ bool Input::peek(const std::string& str)
 
     for (; idx < str.length(); idx++)
     {
-        if (this->strIdx + idx >= this->inStr.length())
+        if (this->strIdx + idx >= this->dataLen)
             return false;
 
-        if (str[idx] != this->inStr[this->strIdx + idx])
+        if (str[idx] != this->data[this->strIdx + idx])
             return false;
     }
 
@@ -218,8 +266,47 @@ void Input::eatWS()
     }
 }
 
+/**
+Reference to a global definition, to be patched in place once
+all the global definitions of an image are known
+*/
+struct RefFixup
+{
+    /// Object or array containing the reference
+    Value node;
+
+    /// Field name (objects only)
+    Value field;
+
+    /// Slot index (objects) or element index (arrays)
+    size_t idx;
+
+    /// Name of the global definition referenced
+    std::string name;
+};
+
+typedef std::vector<RefFixup> FixupList;
+
+/**
+Information recorded while parsing an image
+*/
+struct ParseState
+{
+    /// References to be patched
+    FixupList fixups;
+
+    /// Number of import instructions parsed
+    size_t numImportOps = 0;
+
+    /// Names of the packages imported with a constant name
+    std::vector<std::string> imports;
+
+    /// Field name strings, shared between objects
+    std::unordered_map<std::string, Value> fieldNames;
+};
+
 // Forward declaration
-Value parseExpr(Input& input);
+Value parseExpr(Input& input, ParseState& state);
 
 Value parseFloatingPart(Input& input, bool neg, char literal[64]);
 
@@ -414,7 +501,7 @@ std::string parseIdentStr(Input& input)
 /**
 Parse a list of expressions
 */
-std::vector<Value> parseExprList(Input& input, char endCh)
+std::vector<Value> parseExprList(Input& input, char endCh, ParseState& state)
 {
     std::vector<Value> exprs;
 
@@ -431,7 +518,7 @@ std::vector<Value> parseExprList(Input& input, char endCh)
         }
 
         // Parse an expression
-        auto expr = parseExpr(input);
+        auto expr = parseExpr(input, state);
 
         // Add the expression to the array
         exprs.push_back(expr);
@@ -455,9 +542,11 @@ std::vector<Value> parseExprList(Input& input, char endCh)
 /**
 Parse an array literal
 */
-Value parseArray(Input& input)
+Value parseArray(Input& input, ParseState& state)
 {
-    auto exprVals = parseExprList(input, ']');
+    auto numImportOps = state.numImportOps;
+
+    auto exprVals = parseExprList(input, ']', state);
 
     // Allocate an array
     auto array = Array(exprVals.size());
@@ -466,16 +555,56 @@ Value parseArray(Input& input)
     for (auto exprVal : exprVals)
         array.push(exprVal);
 
+    // Record the elements which are references
+    for (size_t i = 0; i < exprVals.size(); ++i)
+    {
+        if (exprVals[i].getTag() == TAG_IMGREF)
+        {
+            state.fixups.push_back({
+                array, Value::UNDEF, i, ImgRef(exprVals[i]).getName()
+            });
+        }
+    }
+
+    // If this array directly contains import instructions, record
+    // the package names pushed by the instructions preceding them
+    // ie: { op:'push', val:'core/io' }, { op:'import' }
+    if (state.numImportOps != numImportOps)
+    {
+        size_t idxCache = 0;
+
+        for (size_t i = 1; i < exprVals.size(); ++i)
+        {
+            Value op;
+            if (!exprVals[i].isObject() ||
+                !Object(exprVals[i]).getField("op", op, idxCache) ||
+                !op.isString() || (std::string)op != "import")
+                continue;
+
+            Value prevOp;
+            Value pkgName;
+            if (exprVals[i-1].isObject() &&
+                Object(exprVals[i-1]).getField("op", prevOp, idxCache) &&
+                prevOp.isString() && (std::string)prevOp == "push" &&
+                Object(exprVals[i-1]).getField("val", pkgName, idxCache) &&
+                pkgName.isString())
+            {
+                state.imports.push_back((std::string)pkgName);
+            }
+        }
+    }
+
     return array;
 }
 
 /**
 Parse an object literal
 */
-Value parseObject(Input& input)
+Value parseObject(Input& input, ParseState& state)
 {
-    // Allocate an empty object
-    Object obj = Object::newObject();
+    // Fields are collected first, so that the object
+    // can be allocated with its exact capacity
+    std::vector<std::pair<String, Value>> fields;
 
     // Until the end of the list
     for (;;)
@@ -490,18 +619,26 @@ Value parseObject(Input& input)
         }
 
         // Parse the property name
-        auto ident = parseIdentStr(input);
+        auto identStr = parseIdentStr(input);
+
+        // Field names are shared between the objects of an image
+        auto& ident = state.fieldNames[identStr];
+        if (ident == Value::UNDEF)
+            ident = String(identStr);
 
         input.eatWS();
         input.expect(":");
 
         // Parse an expression
-        auto expr = parseExpr(input);
+        auto expr = parseExpr(input, state);
 
-        // Set the property on the object
-        obj.setField(ident, expr);
+        fields.push_back({ String(ident), expr });
 
-        assert (obj.hasField(ident));
+        // Count import instructions, see parseArray()
+        if (identStr == "op" && expr.isString() && (std::string)expr == "import")
+        {
+            state.numImportOps++;
+        }
 
         // If this is the end of the list
         input.eatWS();
@@ -514,13 +651,37 @@ Value parseObject(Input& input)
         input.expect(",");
     }
 
+    // Allocate the object
+    // Note: empty objects need a nonzero capacity to be extended
+    auto obj = Object::newObjectExact(std::max<size_t>(2 * fields.size(), 2));
+
+    for (auto& field : fields)
+    {
+        // Set the property on the object
+        obj.setField(field.first, field.second);
+
+        assert (obj.hasField(field.first));
+
+        // Record references, to be patched once the image is parsed
+        if (field.second.getTag() == TAG_IMGREF)
+        {
+            Value val;
+            size_t slotIdx = 0;
+            obj.getField(String(field.first).getDataPtr(), val, slotIdx);
+
+            state.fixups.push_back({
+                obj, field.first, slotIdx, ImgRef(field.second).getName()
+            });
+        }
+    }
+
     return obj;
 }
 
 /**
 Parse a top-level expression
 */
-Value parseExpr(Input& input)
+Value parseExpr(Input& input, ParseState& state)
 {
     //std::cout << "parseExpr" << std::endl;
 
@@ -555,13 +716,13 @@ Value parseExpr(Input& input)
     // Array expression
     if (input.match('['))
     {
-        return parseArray(input);
+        return parseArray(input, state);
     }
 
     // Object literal
     if (input.match('{'))
     {
-        return parseObject(input);
+        return parseObject(input, state);
     }
 
     // Global value reference
@@ -615,207 +776,409 @@ Value parseExpr(Input& input)
     );
 }
 
+thread_local uint64_t resolveRefsNanos = 0;
+
 /**
-Process a value which is potentially a reference
+Patch the references recorded while parsing an image
 */
-Value processRef(
+void patchRefs(
     std::unordered_map<std::string, Value>& globalDefs,
-    std::vector<Value>& visitStack,
-    Value val
+    FixupList& fixups
 )
 {
-    // If this is a reference
-    if (val.getTag() == TAG_IMGREF)
+    for (auto& fixup : fixups)
     {
-        auto ref = ImgRef(val);
-        auto varName = ref.getName();
-
-        // Get the value of this reference
-        auto refVal = globalDefs.find(varName);
+        auto refVal = globalDefs.find(fixup.name);
 
         if (refVal == globalDefs.end())
         {
             throw ParseError(
-                "unresolved reference to \"" + varName + "\""
+                "unresolved reference to \"" + fixup.name + "\""
             );
         }
 
         assert (refVal->second.getTag() != TAG_IMGREF);
 
-        // Visit the value being reffered to
-        visitStack.push_back(refVal->second);
+        if (fixup.node.isArray())
+            Array(fixup.node).setElem(fixup.idx, refVal->second);
+        else
+            Object(fixup.node).setSlotVal(fixup.idx, refVal->second);
+    }
+}
+
+Value parseInput(
+    Input& input,
+    std::vector<std::string>& imports,
+    ImageDefs* defs
+)
+{
+    // Global definitions
+    ImageDefs globalDefs;
+
+    // References to global definitions to be patched
+    ParseState state;
 
-        return refVal->second;
+    // Until done parsing all expressions
+    for (;;)
+    {
+        input.eatWS();
+
+        // If this is not an identifier, we are done parsing
+        // global definitions (ie: foo = 1)
+        if (input.peek() != '_' && !isalpha(input.peek()))
+            break;
+
+        std::string ident = parseIdentStr(input);
+
+        // Match the assignment operator
+        input.eatWS();
+        input.expect("=");
+
+        // Cannot assign a global def to another global def
+        input.eatWS();
+        if (input.match('@'))
+        {
+            throw ParseError(
+                input,
+                "cannot assign a global definition to another global definition"
+            );
+        }
+
+        // Parse the right-hand expression
+        auto defVal = parseExpr(input, state);
+
+        // A global name can only be associated with one definition
+        if (globalDefs.find(ident) != globalDefs.end())
+        {
+            throw ParseError(input, "redefinition of \"" + ident + "\"");
+        }
+
+        // Add the value to the global definitions map
+        globalDefs[ident] = defVal;
+
+        // Every top-level expression must end with a semicolon
+        // This allows splitting the input without fully parsing it
+        input.eatWS();
+        input.expect(";");
     }
-    else
+
+    // Parse the final expression. This is the value this image exports,
+    // which is usually an object
+    auto exports = parseExpr(input, state);
+
+    input.eatWS();
+    input.expect(";");
+
+    // If there remains unparsed input
+    input.eatWS();
+    if (!input.eof())
+    {
+        throw ParseError(input, "unconsumed input remains");
+    }
+
+    // Resolve the global references in the image
+    auto startTime = std::chrono::steady_clock::now();
+    patchRefs(globalDefs, state.fixups);
+    resolveRefsNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - startTime
+    ).count();
+
+    // The exported value may itself be a reference
+    if (exports.getTag() == TAG_IMGREF)
     {
-        visitStack.push_back(val);
+        auto name = ImgRef(exports).getName();
+        auto refVal = globalDefs.find(name);
 
-        return val;
+        if (refVal == globalDefs.end())
+        {
+            throw ParseError(
+                "unresolved reference to \"" + name + "\""
+            );
+        }
+
+        exports = refVal->second;
     }
+
+    imports = std::move(state.imports);
+
+    if (defs)
+        *defs = std::move(globalDefs);
+
+    // Return the last evaluated value
+    return exports;
+}
+
+Value parseInput(Input& input)
+{
+    std::vector<std::string> imports;
+    return parseInput(input, imports);
 }
 
 /**
-Resolve the references in values exported by the image
+Lazily loaded image
+The image data is kept mapped in memory, and global definitions are
+only parsed when first referenced. Function entry blocks are left as
+bound references until the function is first called.
 */
-Value resolveRefs(
-    std::unordered_map<std::string, Value>& globalDefs,
-    Value exportsTree
-)
+struct LazyImage
 {
-    // Set of visited nodes
-    std::unordered_set<refptr> visited;
+    /// Position of an unparsed global definition in the input
+    struct Def
+    {
+        size_t strIdx;
+        size_t lineNo;
+        size_t colNo;
 
-    // Stack of nodes to visit
-    std::vector<Value> stack;
+        /// Parsed value, undefined until materialized
+        Value val;
+        bool parsed = false;
+    };
 
-    // The root node itself may be a reference, so we process it firstg
-    exportsTree = processRef(globalDefs, stack, exportsTree);
+    std::string srcName;
 
-    // Until we are done
-    while (!stack.empty())
-    {
-        // Pop a node off the stack
-        auto node = stack.back();
-        stack.pop_back();
+    /// Image data (memory-mapped)
+    const char* data;
+    size_t dataLen;
+
+    /// Global definitions, by name
+    std::unordered_map<std::string, Def> defs;
 
-        // If this is an array or an object
-        if (node.isPointer())
+    /// Number of definitions materialized so far
+    size_t numParsed = 0;
+};
+
+/// Lazily loaded images, indexed by the image index stored in
+/// bound references. Index zero is reserved for unbound references.
+std::vector<LazyImage*> lazyImages(1);
+
+/**
+Skip over the expression of a global definition, up to its
+terminating semicolon, without parsing it
+*/
+void skipDef(Input& input)
+{
+    for (;;)
+    {
+        if (input.eof())
         {
-            auto ptr = (refptr)node;
+            throw ParseError(input, "end of input in global definition");
+        }
 
-            // If this node was previously visited, skip it
-            if (visited.find(ptr) != visited.end())
-                continue;
+        auto ch = input.readCh();
 
-            // Mark the node as visited
-            visited.insert(ptr);
+        // Semicolons only appear at the end of definitions
+        // or inside string literals
+        if (ch == ';')
+            break;
+
+        if (ch == '#')
+        {
+            while (!input.eof() && input.readCh() != '\n') {}
+            continue;
         }
 
-        switch (node.getTag())
+        if (ch == '\'' || ch == '"')
         {
-            case TAG_ARRAY:
+            for (;;)
             {
-                auto arr = Array(node);
-                auto len = arr.length();
-
-                // For each array element
-                for (size_t i = 0; i < len; ++i)
+                if (input.eof())
                 {
-                    auto elemVal = arr.getElem(i);
-                    auto newVal = processRef(globalDefs, stack, elemVal);
-                    arr.setElem(i, newVal);
+                    throw ParseError(input, "end of input inside string literal");
                 }
+
+                auto strCh = input.readCh();
+
+                if (strCh == ch)
+                    break;
+
+                if (strCh == '\\')
+                    input.readCh();
             }
-            break;
+        }
+    }
+}
 
-            case TAG_OBJECT:
-            {
-                auto obj = Object(node);
+/// Parse a global definition of a lazy image, if not already parsed
+/// The references in the definition are added to the fixup list
+Value materializeDef(LazyImage& image, std::string name, ParseState& state)
+{
+    auto& def = image.defs[name];
 
-                // For each object field
-                for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
-                {
-                    auto fieldName = itr.get();
-                    auto fieldVal = obj.getField(fieldName);
+    if (def.parsed)
+        return def.val;
 
-                    auto newVal = processRef(globalDefs, stack, fieldVal);
+    Input input(
+        image.data,
+        image.dataLen,
+        image.srcName,
+        def.strIdx,
+        def.lineNo,
+        def.colNo
+    );
 
-                    obj.setField(fieldName, newVal);
-                    assert (obj.getField(fieldName).getTag() != TAG_IMGREF);
-                }
-            }
-            break;
+    def.val = parseExpr(input, state);
+    def.parsed = true;
+    image.numParsed++;
 
-            case TAG_UNDEF:
-            case TAG_BOOL:
-            case TAG_INT32:
-            case TAG_INT64:
-            case TAG_FLOAT32:
-            case TAG_STRING:
-            continue;
+    if (def.val.getTag() == TAG_IMGREF)
+    {
+        throw ParseError(
+            input,
+            "cannot assign a global definition to another global definition"
+        );
+    }
+
+    return def.val;
+}
 
-            case TAG_IMGREF:
-            assert (false);
+/// Look up a global definition of a lazy image
+LazyImage::Def& getLazyDef(LazyImage& image, std::string name)
+{
+    auto itr = image.defs.find(name);
 
-            default:
-            assert (false);
-        }
+    if (itr == image.defs.end())
+    {
+        throw ParseError(
+            image.srcName + " - unresolved reference to \"" + name + "\""
+        );
     }
 
-    return exportsTree;
+    return itr->second;
 }
 
-Value parseInput(Input& input)
+/// Check if a reference is the entry block of a function definition,
+/// ie: an object with both entry and num_locals fields
+static bool isFunEntryRef(const RefFixup& fixup)
 {
-    // Global definitions
-    std::unordered_map<std::string, Value> globalDefs;
+    if (!fixup.node.isObject() || (std::string)fixup.field != "entry")
+        return false;
 
-    // Until done parsing all expressions
+    return Object(fixup.node).hasField("num_locals");
+}
+
+/**
+Patch the references recorded while parsing lazy image definitions,
+materializing the definitions they point to. References to function
+entry blocks are left as bound references, materialized on first call.
+*/
+void patchLazyRefs(LazyImage& image, uint32_t imgIdx, ParseState& state)
+{
+    while (!state.fixups.empty())
+    {
+        auto fixup = state.fixups.back();
+        state.fixups.pop_back();
+
+        auto& def = getLazyDef(image, fixup.name);
+
+        Value refVal;
+        if (def.parsed)
+            refVal = def.val;
+        else if (isFunEntryRef(fixup))
+            refVal = ImgRef(String(fixup.name), imgIdx);
+        else
+            refVal = materializeDef(image, fixup.name, state);
+
+        if (fixup.node.isArray())
+            Array(fixup.node).setElem(fixup.idx, refVal);
+        else
+            Object(fixup.node).setSlotVal(fixup.idx, refVal);
+    }
+}
+
+Value resolveLazyRef(Value ref)
+{
+    auto imgRef = ImgRef(ref);
+    auto imgIdx = imgRef.getImgIdx();
+    assert (imgIdx > 0 && imgIdx < lazyImages.size());
+
+    auto& image = *lazyImages[imgIdx];
+    auto name = imgRef.getName();
+
+    ParseState state;
+    auto val = materializeDef(image, name, state);
+    patchLazyRefs(image, imgIdx, state);
+
+    return val;
+}
+
+Value parseInputLazy(Input& input)
+{
+    auto image = new LazyImage();
+    image->srcName = input.getSrcName();
+    image->data = input.getDataPtr();
+    image->dataLen = input.getDataLen();
+
+    auto imgIdx = (uint32_t)lazyImages.size();
+    lazyImages.push_back(image);
+
+    // Pre-scan the input to index the global definitions
     for (;;)
     {
         input.eatWS();
 
-        // If this is not an identifier, we are done parsing
-        // global definitions (ie: foo = 1)
         if (input.peek() != '_' && !isalpha(input.peek()))
             break;
 
         std::string ident = parseIdentStr(input);
 
-        // Match the assignment operator
         input.eatWS();
         input.expect("=");
-
-        // Cannot assign a global def to another global def
         input.eatWS();
-        if (input.match('@'))
-        {
-            throw ParseError(
-                input,
-                "cannot assign a global definition to another global definition"
-            );
-        }
 
-        // Parse the right-hand expression
-        auto defVal = parseExpr(input);
-
-        // A global name can only be associated with one definition
-        if (globalDefs.find(ident) != globalDefs.end())
+        if (image->defs.find(ident) != image->defs.end())
         {
             throw ParseError(input, "redefinition of \"" + ident + "\"");
         }
 
-        // Add the value to the global definitions map
-        globalDefs[ident] = defVal;
+        LazyImage::Def def;
+        def.strIdx = input.getInputIdx();
+        def.lineNo = input.getLineNo();
+        def.colNo = input.getColNo();
+        image->defs[ident] = def;
 
-        // Every top-level expression must end with a semicolon
-        // This allows splitting the input without fully parsing it
-        input.eatWS();
-        input.expect(";");
+        skipDef(input);
     }
 
-    // Parse the final expression. This is the value this image exports,
-    // which is usually an object
-    auto exports = parseExpr(input);
+    // Parse the exports expression
+    ParseState state;
+    auto exports = parseExpr(input, state);
 
     input.eatWS();
     input.expect(";");
 
-    // If there remains unparsed input
     input.eatWS();
     if (!input.eof())
     {
         throw ParseError(input, "unconsumed input remains");
     }
 
-    // Resolve the global references in the image
-    exports = resolveRefs(globalDefs, exports);
+    // The exported value may itself be a reference
+    if (exports.getTag() == TAG_IMGREF)
+    {
+        auto name = ImgRef(exports).getName();
+        getLazyDef(*image, name);
+        exports = materializeDef(*image, name, state);
+    }
+
+    patchLazyRefs(*image, imgIdx, state);
 
-    // Return the last evaluated value
     return exports;
 }
 
+size_t numLazyDefs(size_t& numParsed)
+{
+    size_t numDefs = 0;
+    numParsed = 0;
+
+    for (size_t i = 1; i < lazyImages.size(); ++i)
+    {
+        numDefs += lazyImages[i]->defs.size();
+        numParsed += lazyImages[i]->numParsed;
+    }
+
+    return numDefs;
+}
+
 // Parse the optional hashbang line at the beginning of a file
 void parseHashbang(Input& input)
 {
@@ -946,6 +1309,59 @@ void testParse(std::string str, Tag expectTag)
     }
 }
 
+/// Parse a string as a lazily loaded image
+Value parseStringLazy(std::string str, std::string srcName)
+{
+    // The input data must outlive the lazy image
+    auto data = new std::string(str);
+    Input input(data->c_str(), data->size(), srcName);
+    return parseInputLazy(input);
+}
+
+/// Test that the lazy parsing of a string succeeds
+Value testParseLazy(std::string str, Tag expectTag)
+{
+    std::cout << "lazy: " << str << std::endl;
+
+    try
+    {
+        auto val = parseStringLazy(str, "parser_lazy_test");
+
+        if (val.getTag() != expectTag)
+        {
+            std::cout << "incorrect tag for parse" << std::endl;
+            exit(-1);
+        }
+
+        return val;
+    }
+
+    catch (RunError& e)
+    {
+        std::cout << e.toString() << std::endl;
+        exit(-1);
+    }
+}
+
+/// Test that the lazy parsing of a string fails
+void testParseLazyFail(std::string str)
+{
+    std::cout << "lazy: " << str << std::endl;
+
+    try
+    {
+        parseStringLazy(str, "parser_lazy_fail_test");
+    }
+
+    catch (ParseError e)
+    {
+        return;
+    }
+
+    std::cout << "parsing did not fail for: " << str << std::endl;
+    exit(-1);
+}
+
 /// Test that the parsing of a string fails
 void testParseFail(std::string str)
 {
@@ -1050,6 +1466,56 @@ void testParser()
     testParse("x = 1; y = 2; [@x, @y, 3];", TAG_ARRAY);
     testParseFail("x = 1; y = @x; @x");
 
+    // Lazily parsed images
+    testParseLazy("x = 1; @x;", TAG_INT32);
+    testParseLazy("x = 'a;b'; y = \"#;\\\";\"; # c;d\n [@x, @y];", TAG_ARRAY);
+    testParseLazy("unused = [1, 2 3]; 1;", TAG_INT32);
+    testParseLazy("b = { x:@f }; f = { entry:@b }; { f:@f };", TAG_OBJECT);
+    testParseLazyFail("x=1; x=2; 1;");
+    testParseLazyFail("x = 1; y = @x; @y;");
+    testParseLazyFail("x = [@z]; @x;");
+    testParseLazyFail("x = 'abc; 1;");
+
+    // Function entry blocks are only parsed on first access
+    {
+        auto val = testParseLazy(
+            "b = { x:[1, 2] }; f = { num_locals:0, entry:@b }; { f:@f };",
+            TAG_OBJECT
+        );
+        auto fun = Object(Object(val).getField("f"));
+        auto entry = fun.getField("entry");
+        assert (entry.getTag() == TAG_IMGREF);
+        auto block = resolveLazyRef(entry);
+        assert (block.isObject() && Object(block).hasField("x"));
+        assert (resolveLazyRef(entry) == block);
+    }
+
+    // Entry fields of other objects are plain references
+    {
+        auto val = testParseLazy(
+            "b = { x:1 }; o = { entry:@b }; { o:@o };",
+            TAG_OBJECT
+        );
+        auto obj = Object(Object(val).getField("o"));
+        assert (obj.getField("entry").isObject());
+    }
+
+    // Static imports
+    {
+        std::vector<std::string> imports;
+        Input input(
+            "b = { instrs: ["
+            "{ op:'push', val:'core/io' }, { op:'import' },"
+            "{ op:'push', val:1 }, { op:'import' },"
+            "{ op:'push', val:'std/math/0' }, { op:'import' } ] };"
+            "{ entry:@b, imports:['core/io'], op:'import' };",
+            "parser_test"
+        );
+        parseInput(input, imports);
+        assert (imports.size() == 2);
+        assert (imports[0] == "core/io" && imports[1] == "std/math/0");
+    }
+
     // Parse test image files
     testParseFile("tests/vm/ex_image2.zim");
     testParseFile("tests/vm/ex_image.zim");
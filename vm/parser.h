@@ -2,6 +2,8 @@
 
 #include <cstdio>
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <exception>
 #include "runtime.h"
 
@@ -15,9 +17,21 @@ private:
     /// Input source name
     std::string srcName;
 
-    /// Input string to be parsed
+    /// Input string to be parsed, if owned by this object
     std::string inStr;
 
+    /// File mapping owned by this object, if any
+    const char* mapData = nullptr;
+    size_t mapLen = 0;
+
+    /// Index below which consumed file data was released
+    size_t releasedIdx = 0;
+
+    /// Pointer to the input data and its length
+    /// Note: this may point into memory not owned by this object
+    const char* data;
+    size_t dataLen;
+
     /// Current index in the input string
     size_t strIdx;
 
@@ -27,12 +41,35 @@ private:
     /// Current column number
     size_t colNo;
 
+    /// Release the memory of file data already consumed
+    void releaseConsumed();
+
 public:
 
+    /// Size of the file data released at once
+    static const size_t RELEASE_CHUNK = 1 << 22;
+
+    /// Create an input over a memory-mapped file
+    /// The file data is released as it is consumed, so that
+    /// the memory used stays bounded for large files
     Input(std::string fileName);
 
     Input(std::string str, std::string srcName);
 
+    /// Create an input over external data, starting at a given position
+    /// Note: the data must remain valid for the lifetime of the input
+    Input(
+        const char* data,
+        size_t dataLen,
+        std::string srcName,
+        size_t strIdx = 0,
+        size_t lineNo = 1,
+        size_t colNo = 1
+    );
+
+    Input(const Input& that) = delete;
+    Input& operator = (const Input& that) = delete;
+
     ~Input();
 
     /// Read/consume a character from the input
@@ -65,7 +102,11 @@ public:
     void eatWS();
 
     /// Get the entire input as a string
-    std::string getInputStr() const { return inStr; }
+    std::string getInputStr() const { return std::string(data, dataLen); }
+
+    /// Get a pointer to the input data and its length
+    const char* getDataPtr() const { return data; }
+    size_t getDataLen() const { return dataLen; }
 
     /// Get the current index in the input
     size_t getInputIdx() const { return strIdx; }
@@ -107,9 +148,45 @@ public:
 // Parse the optional language directive at the beginning of a file
 std::string parseLang(Input& input);
 
+/// Map a file into memory, read-only
+const char* mapFile(std::string fileName, size_t& len);
+
+/// Release a file mapping created by mapFile()
+void unmapFile(const char* data, size_t len);
+
 // Parse the contents of plain image file
 Value parseInput(Input& input);
 
+/// Global definitions of an image, by name
+typedef std::unordered_map<std::string, Value> ImageDefs;
+
+/// Parse the contents of a plain image file, and list the packages
+/// it imports with constant names, in the order they appear
+/// The global definitions are kept in defs, if provided
+/// Note: this may be called concurrently on different inputs
+Value parseInput(
+    Input& input,
+    std::vector<std::string>& imports,
+    ImageDefs* defs = nullptr
+);
+
+/// Parse the contents of an image file lazily
+/// Global definitions are only parsed once referenced, and function
+/// entry blocks are left as bound references, see resolveLazyRef()
+/// Note: the input data must remain valid for the program lifetime
+Value parseInputLazy(Input& input);
+
+/// Materialize the value a lazy image reference points to
+Value resolveLazyRef(Value ref);
+
+/// Get the number of lazy image definitions, and how many were parsed
+size_t numLazyDefs(size_t& numParsed);
+
+/// Time spent resolving references in images parsed by the calling
+/// thread, in nanoseconds. Packages preloaded on worker threads are not
+/// counted, so that this never exceeds the wall-clock time of a load
+extern thread_local uint64_t resolveRefsNanos;
+
 // Parse a plain image file
 Value parseFile(std::string fileName);
 
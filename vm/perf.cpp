@@ -0,0 +1,226 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include "perf.h"
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#endif
+
+/// Event names, as printed and used as JSON keys
+static const char* EVENT_NAMES[NUM_PERF_EVENTS] = {
+    "instructions",
+    "cycles",
+    "branch_misses",
+    "l1d_misses",
+    "llc_misses"
+};
+
+/// File descriptor for each event, -1 if not available
+static int eventFds[NUM_PERF_EVENTS] = { -1, -1, -1, -1, -1 };
+
+/// Error reported when opening the first unavailable event
+static std::string openError;
+
+PerfCounts::PerfCounts()
+{
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+        vals[i] = -1;
+}
+
+PerfCounts PerfCounts::operator - (const PerfCounts& that) const
+{
+    PerfCounts delta;
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        if (vals[i] >= 0 && that.vals[i] >= 0)
+            delta.vals[i] = vals[i] - that.vals[i];
+    }
+
+    return delta;
+}
+
+PerfCounts& PerfCounts::operator += (const PerfCounts& that)
+{
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        if (that.vals[i] < 0)
+            vals[i] = -1;
+        else if (vals[i] >= 0)
+            vals[i] += that.vals[i];
+    }
+
+    return *this;
+}
+
+std::string PerfCounts::toJSON() const
+{
+    std::string out = "{";
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        if (i > 0)
+            out += ", ";
+
+        out += "\"" + std::string(EVENT_NAMES[i]) + "\": ";
+        out += (vals[i] < 0)? "null":std::to_string(vals[i]);
+    }
+
+    return out + "}";
+}
+
+#ifdef __linux__
+
+/// Open a counter for the calling thread and its children, on any CPU
+static int openEvent(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+
+    // Kernel events are usually not accessible to regular users
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Also count threads created later, ie: the threads preloading
+    // packages. Their counts are added when they exit.
+    attr.inherit = 1;
+
+    // Needed to scale the counts when the PMU is multiplexed
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/// Encode the config of a hardware cache read miss event
+static uint64_t cacheMiss(uint64_t cache)
+{
+    return (
+        cache |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    );
+}
+
+bool openPerfCounters()
+{
+    const std::pair<uint32_t, uint64_t> events[NUM_PERF_EVENTS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D) },
+        { PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_LL) },
+    };
+
+    bool anyOpen = false;
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        if (eventFds[i] != -1)
+        {
+            anyOpen = true;
+            continue;
+        }
+
+        eventFds[i] = openEvent(events[i].first, events[i].second);
+
+        if (eventFds[i] == -1)
+        {
+            if (openError == "")
+                openError = EVENT_NAMES[i] + std::string(": ") + strerror(errno);
+            continue;
+        }
+
+        ioctl(eventFds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(eventFds[i], PERF_EVENT_IOC_ENABLE, 0);
+        anyOpen = true;
+    }
+
+    return anyOpen;
+}
+
+PerfCounts readPerfCounters()
+{
+    PerfCounts counts;
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        if (eventFds[i] == -1)
+            continue;
+
+        // Value, time enabled and time running
+        uint64_t buf[3];
+        if (read(eventFds[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+
+        // The counter was never scheduled on the PMU
+        if (buf[2] == 0)
+            continue;
+
+        // Extrapolate the count over the time the counter was enabled
+        auto val = buf[0];
+        if (buf[2] < buf[1])
+            val = (uint64_t)((double)val * buf[1] / buf[2]);
+
+        counts.vals[i] = (int64_t)val;
+    }
+
+    return counts;
+}
+
+#else
+
+bool openPerfCounters()
+{
+    openError = "perf_event_open is only supported on Linux";
+    return false;
+}
+
+PerfCounts readPerfCounters()
+{
+    return PerfCounts();
+}
+
+#endif
+
+std::string perfCountersError()
+{
+    return openError;
+}
+
+void printPerfCounters(const PerfPhases& phases)
+{
+    printf("%-16s", "perf counters:");
+    for (auto& phase : phases)
+        printf("%16s", phase.first.c_str());
+    printf("\n");
+
+    for (size_t i = 0; i < NUM_PERF_EVENTS; ++i)
+    {
+        printf("  %-14s", EVENT_NAMES[i]);
+
+        for (auto& phase : phases)
+        {
+            auto val = phase.second.vals[i];
+            if (val < 0)
+                printf("%16s", "n/a");
+            else
+                printf("%16lld", (long long)val);
+        }
+
+        printf("\n");
+    }
+}
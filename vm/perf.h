@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Hardware events counted with --perf-counters
+enum PerfEvent
+{
+    PERF_INSTRS,
+    PERF_CYCLES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    NUM_PERF_EVENTS
+};
+
+/**
+Snapshot of the hardware counters
+Events which could not be counted have a negative value
+*/
+struct PerfCounts
+{
+    int64_t vals[NUM_PERF_EVENTS];
+
+    PerfCounts();
+
+    /// Counts accumulated between two snapshots
+    PerfCounts operator - (const PerfCounts& that) const;
+    PerfCounts& operator += (const PerfCounts& that);
+
+    /// Format the counts as a JSON object
+    std::string toJSON() const;
+};
+
+/// Phases of execution and the counts attributed to them
+typedef std::vector<std::pair<std::string, PerfCounts>> PerfPhases;
+
+/**
+Open and enable the hardware counters for the current thread
+Returns false if no event can be counted, ie: when running in
+a container without access to perf_event_open
+*/
+bool openPerfCounters();
+
+/// Reason why counters could not be opened, if any
+std::string perfCountersError();
+
+/// Read the current counter values
+PerfCounts readPerfCounters();
+
+/// Print a table of counts, one column per phase
+void printPerfCounters(const PerfPhases& phases);
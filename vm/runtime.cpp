@@ -105,6 +105,11 @@ Value::operator std::string () const
 
 VM::VM()
 {
+    for (size_t i = 0; i < NUM_TAGS; ++i)
+    {
+        numAllocs[i] = 0;
+        numBytes[i] = 0;
+    }
 }
 
 /**
@@ -116,6 +121,17 @@ Value VM::alloc(uint32_t size, Tag tag)
     // FIXME: use an alloc pool of some kind
     auto ptr = (refptr)calloc(1, size);
 
+    assert (tag < NUM_TAGS);
+
+    if (__builtin_expect(countingAllocs, 0))
+    {
+        numAllocs[tag].fetch_add(1, std::memory_order_relaxed);
+        numBytes[tag].fetch_add(size, std::memory_order_relaxed);
+    }
+
+    if (__builtin_expect(allocHook != nullptr, 0))
+        allocHook(ptr, size, tag);
+
     // Set the tag in the object header
     *(Tag*)ptr = tag;
 
@@ -123,6 +139,33 @@ Value VM::alloc(uint32_t size, Tag tag)
     return Value(ptr, tag);
 }
 
+size_t VM::allocated() const
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < NUM_TAGS; ++i)
+        total += numBytes[i];
+
+    return total;
+}
+
+void VM::printHeapStats() const
+{
+    std::cout << "heap allocations per tag:" << std::endl;
+
+    for (size_t i = 0; i < NUM_TAGS; ++i)
+    {
+        if (numAllocs[i] == 0)
+            continue;
+
+        std::cout << "  " << tagToStr(i) << ": ";
+        std::cout << numAllocs[i] << " allocs, ";
+        std::cout << numBytes[i] << " bytes" << std::endl;
+    }
+
+    std::cout << "total bytes allocated: " << allocated() << std::endl;
+}
+
 void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
 {
     // Get the object header
@@ -174,6 +217,23 @@ String::String(std::string str)
     strcpy((char*)(ptr + OF_DATA), str.c_str());
 }
 
+String::String(const char* data, size_t len)
+{
+    // Compute the string object size
+    auto numBytes = memSize(len);
+
+    // Allocate memory
+    val = vm.alloc(numBytes, TAG_STRING);
+    auto ptr = (refptr)val;
+
+    // Set the string length
+    *(uint32_t*)(ptr + OF_LEN) = len;
+
+    // Copy the string data
+    // Note: the terminating null is already zeroed
+    memcpy((char*)(ptr + OF_DATA), data, len);
+}
+
 String::String(Value value)
 {
     assert (value.isString());
@@ -215,6 +275,16 @@ bool String::operator == (const char* that) const
     return strcmp(getDataPtr(), that) == 0;
 }
 
+bool String::operator == (String that) const
+{
+    auto len = length();
+
+    if (that.length() != len)
+        return false;
+
+    return memcmp(getDataPtr(), that.getDataPtr(), len) == 0;
+}
+
 /// Get the ith character code
 char String::operator [] (size_t i)
 {
@@ -284,7 +354,7 @@ uint32_t Array::length()
 void Array::setElem(size_t i, Value v)
 {
     auto ptr = getObjPtr();
-    auto cap = length();
+    auto cap = getCap();
 
     auto words = (Word*)(ptr + OF_DATA);
     auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
@@ -376,6 +446,14 @@ Object Object::newObject(size_t cap)
     if (cap < MIN_CAP)
         cap = MIN_CAP;
 
+    return newObjectExact(cap);
+}
+
+Object Object::newObjectExact(size_t cap)
+{
+    // The capacity doubles when extending objects
+    assert (cap > 0);
+
     // Compute the object size
     auto numBytes = memSize(cap);
 
@@ -435,6 +513,30 @@ size_t Object::getSlotIdx(
     return cap;
 }
 
+size_t Object::getSlotIdx(
+    refptr ptr,
+    size_t cap,
+    const char* fieldName
+)
+{
+    auto values = (Value*)(ptr + OF_FIELDS);
+
+    for (size_t idx = 0; idx < cap; idx += 2)
+    {
+        // Empty slot, property name not found
+        if (values[idx] == Value::UNDEF)
+            return cap;
+
+        assert (values[idx].isString());
+
+        // Slot found
+        if (String(values[idx]) == fieldName)
+            return idx;
+    }
+
+    return cap;
+}
+
 bool Object::hasField(String fieldName)
 {
     auto ptr = getObjPtr();
@@ -508,8 +610,9 @@ bool Object::getField(const char* name, Value& value, size_t& idxCache)
     //std::cout << "  name=" << name << std::endl;
     //std::cout << "  idxCache=" << idxCache << std::endl;
 
-    assert (idxCache < cap);
-    auto nameSlot = values[idxCache];
+    // Note: objects may have less than the minimum capacity when
+    // their fields were known at allocation time (ie: from images)
+    auto nameSlot = (idxCache < cap)? values[idxCache]:Value::UNDEF;
     if (nameSlot.isString())
     {
         auto nameSlotStr = String(nameSlot);
@@ -525,7 +628,7 @@ bool Object::getField(const char* name, Value& value, size_t& idxCache)
     //std::cout << "  name=" << name << std::endl;
 
 
-    size_t slotIdx = getSlotIdx(ptr, cap, String(name), false);
+    size_t slotIdx = getSlotIdx(ptr, cap, name);
 
     if (slotIdx >= cap)
     {
@@ -541,6 +644,33 @@ bool Object::getField(const char* name, Value& value, size_t& idxCache)
     return true;
 }
 
+void Object::setSlotVal(size_t slotIdx, Value value)
+{
+    auto ptr = getObjPtr();
+    auto values = (Value*)(ptr + OF_FIELDS);
+
+    assert (slotIdx + 1 < getCap());
+    assert (values[slotIdx].isString());
+    values[slotIdx + 1] = value;
+}
+
+uint32_t Object::getAuxIdx()
+{
+    // The index is kept in the root object, which never moves
+    auto ptr = (refptr)val;
+    auto header = *(uint64_t*)ptr;
+    return (uint32_t)(header >> HEADER_IDX_AUX);
+}
+
+void Object::setAuxIdx(uint32_t idx)
+{
+    auto ptr = (refptr)val;
+    auto header = *(uint64_t*)ptr;
+    header &= ((uint64_t)1 << HEADER_IDX_AUX) - 1;
+    header |= (uint64_t)idx << HEADER_IDX_AUX;
+    *(uint64_t*)ptr = header;
+}
+
 ObjFieldItr::ObjFieldItr(Object obj)
 : obj(obj)
 {
@@ -571,6 +701,21 @@ std::string ObjFieldItr::get()
     return values[slotIdx];
 }
 
+Value ObjFieldItr::getName()
+{
+    auto ptr = obj.getObjPtr();
+    auto values = (Value*)(ptr + Object::OF_FIELDS);
+    assert (values[slotIdx].isString());
+    return values[slotIdx];
+}
+
+Value ObjFieldItr::getVal()
+{
+    auto ptr = obj.getObjPtr();
+    auto values = (Value*)(ptr + Object::OF_FIELDS);
+    return values[slotIdx + 1];
+}
+
 void ObjFieldItr::next()
 {
     auto ptr = obj.getObjPtr();
@@ -586,14 +731,49 @@ void ObjFieldItr::next()
         slotIdx = cap;
 }
 
-ImgRef::ImgRef(String symbol)
+refptr getContentsPtr(Value value)
+{
+    assert (value.isString() || value.isArray() || value.isObject());
+    auto ptr = (refptr)value;
+
+    // Note: the next pointer overwrites the capacity field
+    auto header = *(uint64_t*)ptr;
+    if (header & HEADER_MSK_NEXT)
+        return *(refptr*)(ptr + OBJ_OF_NEXT);
+
+    return ptr;
+}
+
+size_t getContentsSize(Value value)
+{
+    auto ptr = getContentsPtr(value);
+
+    switch (value.getTag())
+    {
+        case TAG_STRING:
+        return String::memSize(String(value).length());
+
+        case TAG_ARRAY:
+        return Array::memSize(*(uint32_t*)(ptr + Array::OF_CAP));
+
+        case TAG_OBJECT:
+        return Object::memSize(*(uint32_t*)(ptr + Object::OF_CAP));
+
+        default:
+        assert (false);
+        return 0;
+    }
+}
+
+ImgRef::ImgRef(String symbol, uint32_t imgIdx)
 {
     // Allocate memory
     val = vm.alloc(ImgRef::SIZE, TAG_IMGREF);
     auto ptr = (refptr)val;
 
-    // Set the string pointer
+    // Set the string pointer and image index
     *(refptr*)(ptr + OF_SYM) = (refptr)symbol;
+    *(uint32_t*)(ptr + OF_IMG) = imgIdx;
 }
 
 ImgRef::ImgRef(Value val)
@@ -613,6 +793,13 @@ std::string ImgRef::getName() const
     return (std::string)strVal;
 }
 
+uint32_t ImgRef::getImgIdx() const
+{
+    auto ptr = (refptr)val;
+    assert (ptr != nullptr);
+    return *(uint32_t*)(ptr + OF_IMG);
+}
+
 bool isValidIdent(std::string identStr)
 {
     if (identStr.length() == 0)
@@ -647,7 +834,29 @@ Tag strToTag(std::string str)
     if (str == "object")    return TAG_OBJECT;
     if (str == "array")     return TAG_ARRAY;
     if (str == "hostfn")    return TAG_HOSTFN;
-    assert (false);
+
+    throw RunError("invalid type tag \"" + str + "\"");
+}
+
+std::string tagToStr(Tag tag)
+{
+    switch (tag)
+    {
+        case TAG_UNDEF:     return "undef";
+        case TAG_BOOL:      return "bool";
+        case TAG_INT32:     return "int32";
+        case TAG_INT64:     return "int64";
+        case TAG_FLOAT32:   return "float32";
+        case TAG_FLOAT64:   return "float64";
+        case TAG_STRING:    return "string";
+        case TAG_OBJECT:    return "object";
+        case TAG_ARRAY:     return "array";
+        case TAG_HOSTFN:    return "hostfn";
+        case TAG_RAWPTR:    return "rawptr";
+        case TAG_IMGREF:    return "imgref";
+    }
+
+    return "tag" + std::to_string((int)tag);
 }
 
 std::string posToString(Value srcPos)
@@ -707,6 +916,23 @@ void testRuntime()
     assert (arr2.getElem(0) == Value::ONE);
     assert (arr2.getElem(1) == Value::TWO);
 
+    // Setting elements when the capacity exceeds the length
+    auto arr3 = Array(4);
+    arr3.push(Value::ONE);
+    arr3.push(Value::TWO);
+    arr3.setElem(1, Value::UNDEF);
+    assert (arr3.getElem(0) == Value::ONE);
+    assert (arr3.getElem(1) == Value::UNDEF);
+
+    // The contents of grown arrays move to a new block
+    auto arr4 = Array(1);
+    assert (getContentsPtr(arr4) == (refptr)arr4);
+    assert (getContentsSize(arr4) == Array::memSize(1));
+    arr4.push(Value::ONE);
+    arr4.push(Value::TWO);
+    assert (getContentsPtr(arr4) != (refptr)arr4);
+    assert (getContentsSize(arr4) == Array::memSize(3));
+
     // Objects
     auto obj = Object::newObject();
     assert (!obj.hasField("foo"));
@@ -720,6 +946,36 @@ void testRuntime()
     assert (obj.hasField("foo"));
     assert (obj.hasField("bar"));
 
+    // Cached field lookups
+    Value fieldVal;
+    size_t idxCache = 0;
+    assert (obj.getField("bar", fieldVal, idxCache));
+    assert (fieldVal == Value::TWO);
+    assert (obj.getField("bar", fieldVal, idxCache));
+    assert (!obj.getField("baz", fieldVal, idxCache));
+
+    // Exact capacity objects, extended past their capacity
+    auto obj3 = Object::newObjectExact(2);
+    obj3.setField("a", Value::ONE);
+    obj3.setField("b", Value::TWO);
+    assert (obj3.getField("a") == Value::ONE);
+    assert (obj3.getField("b") == Value::TWO);
+
+    // Cached slot indices beyond the capacity of an object
+    idxCache = 2 * Object::MIN_CAP;
+    assert (obj3.getField("b", fieldVal, idxCache));
+    assert (fieldVal == Value::TWO);
+
+    // Side table index, preserved across object extension
+    auto obj2 = Object::newObject(2);
+    assert (obj2.getAuxIdx() == 0);
+    obj2.setAuxIdx(7);
+    for (size_t i = 0; i < 2 * Object::MIN_CAP; ++i)
+        obj2.setField("f" + std::to_string(i), Value::ONE);
+    assert (obj2.getAuxIdx() == 7);
+    assert (obj2.getField("f20") == Value::ONE);
+    assert (Value(obj2).getTag() == TAG_OBJECT);
+
     // Field iteration
     std::string fieldStr;
     for (auto itr = ObjFieldItr(obj); itr.valid(); itr.next())
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 
@@ -23,6 +24,9 @@ const Tag TAG_HOSTFN    = 9;
 const Tag TAG_RAWPTR    = 10;
 const Tag TAG_IMGREF    = 11;
 
+/// Number of type tags
+const size_t NUM_TAGS   = 12;
+
 /// Object header size
 const size_t HEADER_SIZE = sizeof(intptr_t);
 
@@ -33,6 +37,9 @@ const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
 /// Offset of the next pointer
 const size_t OBJ_OF_NEXT = HEADER_SIZE;
 
+/// The upper 32 header bits hold a VM-internal side table index
+const size_t HEADER_IDX_AUX = 32;
+
 /**
 64-bit word union
 */
@@ -118,7 +125,10 @@ class VM
 {
 private:
 
-    // TODO: total memory size allocated
+    /// Number of allocations and bytes allocated, per tag
+    /// Note: images may be parsed on worker threads
+    std::atomic<size_t> numAllocs[NUM_TAGS];
+    std::atomic<size_t> numBytes[NUM_TAGS];
 
     // TODO: dynamically grow pools?
 
@@ -128,12 +138,25 @@ private:
 
 public:
 
+    /// Callback invoked on every allocation while profiling
+    typedef void (*AllocHook)(refptr ptr, uint32_t size, Tag tag);
+
+    /// Allocation callback, null when not profiling
+    AllocHook allocHook = nullptr;
+
+    /// Count allocations per tag, for --heap-stats
+    bool countingAllocs = false;
+
     VM();
 
     /// Allocate a block of memory on the heap
     Value alloc(uint32_t size, Tag tag);
 
+    /// Get the total number of bytes allocated while counting
     size_t allocated() const;
+
+    /// Print the number of bytes allocated per tag
+    void printHeapStats() const;
 };
 
 /**
@@ -229,6 +252,7 @@ public:
     }
 
     String(std::string str);
+    String(const char* data, size_t len);
     String(Value value);
 
     /// Get the length of the string
@@ -245,7 +269,7 @@ public:
     bool operator == (const char* that) const;
 
     // FIXME: temporary until string interning is implemented
-    bool operator == (String that) { return (std::string)*this == (std::string)that; }
+    bool operator == (String that) const;
 
     /// Get the ith character code
     char operator [] (size_t i);
@@ -321,6 +345,13 @@ class Object : public Wrapper
         bool newField
     );
 
+    /// Find the slot index of an existing field, without allocating
+    size_t getSlotIdx(
+        refptr ptr,
+        size_t cap,
+        const char* fieldName
+    );
+
 public:
 
     /// Minimum guaranteed object capacity
@@ -345,15 +376,28 @@ public:
     /// Allocate a new empty object
     static Object newObject(size_t cap = 0);
 
+    /// Allocate a new empty object with an exact capacity, which may be
+    /// below the minimum capacity. Used when the fields are known ahead.
+    static Object newObjectExact(size_t cap);
+
     Object(Value value);
 
     bool hasField(String name);
     void setField(String name, Value val);
     Value getField(String name);
 
+    /// Get/set the VM-internal side table index stored in the header
+    /// Note: zero means that no side table entry is associated
+    uint32_t getAuxIdx();
+    void setAuxIdx(uint32_t idx);
+
     /// Property lookup with a slot index cache
     bool getField(const char* name, Value& value, size_t& idxCache);
 
+    /// Overwrite the value of an existing field at a known slot index,
+    /// as found by a lookup with a slot index cache
+    void setSlotVal(size_t slotIdx, Value value);
+
     bool hasField(std::string name) { return hasField(String(name)); }
     void setField(std::string name, Value val) { return setField(String(name), val); }
     Value getField(std::string name) { return getField(String(name)); }
@@ -378,9 +422,23 @@ public:
 
     std::string get();
 
+    /// Get the name of the current field as a string value
+    Value getName();
+
+    /// Get the value of the current field
+    Value getVal();
+
     void next();
 };
 
+/// Get the block holding the contents of a string, array or object,
+/// which is not the value's own block once an array or object has grown
+refptr getContentsPtr(Value value);
+
+/// Get the size in bytes of the block holding the contents of a
+/// string, array or object
+size_t getContentsSize(Value value);
+
 /**
 Image reference/pointer placeholder
 This is used for linkage during image loading, so that
@@ -390,14 +448,20 @@ class ImgRef : public Wrapper
 {
 public:
 
-    // This object contains only a header and a string pointer
+    // This object contains a header, a string pointer and the
+    // index of the lazily loaded image it refers into, if any
     static const size_t OF_SYM = HEADER_SIZE;
-    static const size_t SIZE = OF_SYM + sizeof(refptr);
+    static const size_t OF_IMG = OF_SYM + sizeof(refptr);
+    static const size_t SIZE = OF_IMG + sizeof(uint32_t);
 
-    ImgRef(String symbol);
+    ImgRef(String symbol, uint32_t imgIdx = 0);
     ImgRef(Value val);
 
     std::string getName() const;
+
+    /// Get the index of the lazy image this refers into
+    /// Note: zero means the reference is not bound to a lazy image
+    uint32_t getImgIdx() const;
 };
 
 /// Global virtual machine instance
@@ -409,6 +473,9 @@ bool isValidIdent(std::string identStr);
 /// Get the tag enumeration value for a given tag string
 Tag strToTag(std::string str);
 
+/// Get the name of a tag
+std::string tagToStr(Tag tag);
+
 /// Get a string representation of a source position object
 std::string posToString(Value srcPos);
 